@@ -9,11 +9,25 @@
 
 @interface NSString (NSString_HPHashAdditions)
 
+/** Returns the hex encoded SHA-1 digest of the UTF-8 representation
+ 
+ @returns 40 character lowercase hex string
+ */
 - (NSString *)SHA1Hash;
+
 - (NSData *)SHA1HashWithSalt:(NSString *)salt;
 - (NSData *)HMACSHA1withKey:(NSString *)key;
 - (NSString *)md5HexDigest;
 
+/** Returns a hex encoded non-cryptographic 128-bit hash of the UTF-8 representation
+ 
+ Uses MurmurHash3, which is several times faster than SHA-1 but offers no 
+ protection against deliberately crafted collisions. Suitable for cache keys.
+ 
+ @returns 32 character lowercase hex string
+ */
+- (NSString *)fastHash;
+
 + (NSString *)stringWithUUID;
 
 @end
@@ -12,26 +12,227 @@
 #import "NSString+HPHashAdditions.h"
 
 
+// Size of the stack buffer strings are converted into before being hashed
+#define HP_HASH_CHUNK_LENGTH 256
+
+static const char kHPHexDigits[] = "0123456789abcdef";
+
+typedef void (*HPHashUpdateFunction)(void *context, const uint8_t *bytes, size_t length);
+
+
+// Feeds the UTF-8 representation of a string to a hash function without 
+// creating an intermediate NSData or C string
+static void HPHashUpdateWithString(NSString *string, HPHashUpdateFunction update, void *context) {
+    CFStringRef cfString = (CFStringRef)string;
+    const char *cString = CFStringGetCStringPtr(cfString, kCFStringEncodingUTF8);
+    
+    if (cString != NULL) {
+        update(context, (const uint8_t *)cString, strlen(cString));
+        
+        return;
+    }
+    
+    uint8_t buffer[HP_HASH_CHUNK_LENGTH];
+    CFIndex length = CFStringGetLength(cfString);
+    CFIndex location = 0;
+    
+    while (location < length) {
+        CFIndex usedLength = 0;
+        CFIndex convertedLength = CFStringGetBytes(cfString, CFRangeMake(location, length - location), 
+                                                   kCFStringEncodingUTF8, 0, false, 
+                                                   buffer, sizeof(buffer), &usedLength);
+        
+        if (convertedLength == 0) {
+            break;
+        }
+        
+        update(context, buffer, (size_t)usedLength);
+        
+        location += convertedLength;
+    }
+}
+
+static NSString *HPHexStringWithBytes(const uint8_t *bytes, size_t length) {
+    char hex[2 * CC_SHA512_DIGEST_LENGTH];
+    
+    length = MIN(length, sizeof(hex) / 2);
+    
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = kHPHexDigits[bytes[i] >> 4];
+        hex[2 * i + 1] = kHPHexDigits[bytes[i] & 0x0F];
+    }
+    
+    return [[[NSString alloc] initWithBytes:hex 
+                                     length:2 * length 
+                                   encoding:NSASCIIStringEncoding] autorelease];
+}
+
+static void HPSHA1Update(void *context, const uint8_t *bytes, size_t length) {
+    CC_SHA1_Update((CC_SHA1_CTX *)context, bytes, (CC_LONG)length);
+}
+
+static void HPMD5Update(void *context, const uint8_t *bytes, size_t length) {
+    CC_MD5_Update((CC_MD5_CTX *)context, bytes, (CC_LONG)length);
+}
+
+
+#pragma mark - MurmurHash3
+
+// Incremental version of MurmurHash3 x64 128, which gives the same result as 
+// hashing all bytes at once
+typedef struct {
+    uint64_t h1;
+    uint64_t h2;
+    uint8_t tail[16];
+    size_t tailLength;
+    uint64_t totalLength;
+} HPMurmurHash3State;
+
+static inline uint64_t HPRotateLeft64(uint64_t x, int8_t r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t HPMurmurHash3Mix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    
+    return k;
+}
+
+static const uint64_t kHPMurmurHash3C1 = 0x87C37B91114253D5ULL;
+static const uint64_t kHPMurmurHash3C2 = 0x4CF5AD432745937FULL;
+
+static void HPMurmurHash3Block(HPMurmurHash3State *state, const uint8_t *block) {
+    uint64_t k1, k2;
+    
+    memcpy(&k1, block, sizeof(k1));
+    memcpy(&k2, block + sizeof(k1), sizeof(k2));
+    
+    k1 *= kHPMurmurHash3C1;
+    k1 = HPRotateLeft64(k1, 31);
+    k1 *= kHPMurmurHash3C2;
+    state->h1 ^= k1;
+    
+    state->h1 = HPRotateLeft64(state->h1, 27);
+    state->h1 += state->h2;
+    state->h1 = state->h1 * 5 + 0x52DCE729;
+    
+    k2 *= kHPMurmurHash3C2;
+    k2 = HPRotateLeft64(k2, 33);
+    k2 *= kHPMurmurHash3C1;
+    state->h2 ^= k2;
+    
+    state->h2 = HPRotateLeft64(state->h2, 31);
+    state->h2 += state->h1;
+    state->h2 = state->h2 * 5 + 0x38495AB5;
+}
+
+static void HPMurmurHash3Update(void *context, const uint8_t *bytes, size_t length) {
+    HPMurmurHash3State *state = (HPMurmurHash3State *)context;
+    
+    state->totalLength += length;
+    
+    if (state->tailLength > 0) {
+        size_t fill = MIN(sizeof(state->tail) - state->tailLength, length);
+        
+        memcpy(state->tail + state->tailLength, bytes, fill);
+        
+        state->tailLength += fill;
+        bytes += fill;
+        length -= fill;
+        
+        if (state->tailLength < sizeof(state->tail)) {
+            return;
+        }
+        
+        HPMurmurHash3Block(state, state->tail);
+        
+        state->tailLength = 0;
+    }
+    
+    while (length >= sizeof(state->tail)) {
+        HPMurmurHash3Block(state, bytes);
+        
+        bytes += sizeof(state->tail);
+        length -= sizeof(state->tail);
+    }
+    
+    memcpy(state->tail, bytes, length);
+    
+    state->tailLength = length;
+}
+
+static void HPMurmurHash3Final(HPMurmurHash3State *state, uint8_t digest[16]) {
+    const uint8_t *tail = state->tail;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    uint64_t h1 = state->h1;
+    uint64_t h2 = state->h2;
+    
+    switch (state->tailLength) {
+        case 15: k2 ^= ((uint64_t)tail[14]) << 48;
+        case 14: k2 ^= ((uint64_t)tail[13]) << 40;
+        case 13: k2 ^= ((uint64_t)tail[12]) << 32;
+        case 12: k2 ^= ((uint64_t)tail[11]) << 24;
+        case 11: k2 ^= ((uint64_t)tail[10]) << 16;
+        case 10: k2 ^= ((uint64_t)tail[9]) << 8;
+        case 9:
+            k2 ^= ((uint64_t)tail[8]);
+            k2 *= kHPMurmurHash3C2;
+            k2 = HPRotateLeft64(k2, 33);
+            k2 *= kHPMurmurHash3C1;
+            h2 ^= k2;
+        case 8: k1 ^= ((uint64_t)tail[7]) << 56;
+        case 7: k1 ^= ((uint64_t)tail[6]) << 48;
+        case 6: k1 ^= ((uint64_t)tail[5]) << 40;
+        case 5: k1 ^= ((uint64_t)tail[4]) << 32;
+        case 4: k1 ^= ((uint64_t)tail[3]) << 24;
+        case 3: k1 ^= ((uint64_t)tail[2]) << 16;
+        case 2: k1 ^= ((uint64_t)tail[1]) << 8;
+        case 1:
+            k1 ^= ((uint64_t)tail[0]);
+            k1 *= kHPMurmurHash3C1;
+            k1 = HPRotateLeft64(k1, 31);
+            k1 *= kHPMurmurHash3C2;
+            h1 ^= k1;
+    }
+    
+    h1 ^= state->totalLength;
+    h2 ^= state->totalLength;
+    
+    h1 += h2;
+    h2 += h1;
+    
+    h1 = HPMurmurHash3Mix64(h1);
+    h2 = HPMurmurHash3Mix64(h2);
+    
+    h1 += h2;
+    h2 += h1;
+    
+    // Big endian output, so the hex form reads the same on every platform
+    for (NSUInteger i = 0; i < 8; i++) {
+        digest[i] = (uint8_t)(h1 >> (56 - 8 * i));
+        digest[8 + i] = (uint8_t)(h2 >> (56 - 8 * i));
+    }
+}
+
+
 @implementation NSString (NSString_HPHashAdditions)
 
 #pragma mark - SHA1
 
 - (NSString *)SHA1Hash {
-	const char *cString = [self cStringUsingEncoding:NSUTF8StringEncoding];
-	
-	NSData *stringData = [NSData dataWithBytes:cString length:[self length]];
-	
+    CC_SHA1_CTX context;
 	uint8_t digest[CC_SHA1_DIGEST_LENGTH];
+    
+    CC_SHA1_Init(&context);
+    HPHashUpdateWithString(self, HPSHA1Update, &context);
+    CC_SHA1_Final(digest, &context);
 	
-	CC_SHA1([stringData bytes], [stringData length], digest);
-	
-	NSMutableString *outputString = [NSMutableString stringWithCapacity:CC_SHA1_DIGEST_LENGTH * 2];
-	
-	for (int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
-		[outputString appendFormat:@"%02x", digest[i]];
-	}
-	
-	return outputString;
+	return HPHexStringWithBytes(digest, sizeof(digest));
 }
 
 - (NSData *)SHA1HashWithSalt:(NSString *)salt {
@@ -61,18 +262,28 @@
 #pragma mark - MD5
 
 - (NSString *)md5HexDigest {
-	const char *cString = [self cStringUsingEncoding:NSUTF8StringEncoding];
+    CC_MD5_CTX context;
     unsigned char result[CC_MD5_DIGEST_LENGTH];
 
-    CC_MD5(cString, strlen(cString), result);
+    CC_MD5_Init(&context);
+    HPHashUpdateWithString(self, HPMD5Update, &context);
+    CC_MD5_Final(result, &context);
+    
+    return HPHexStringWithBytes(result, sizeof(result));
+}
+
+#pragma mark - Fast hash
+
+- (NSString *)fastHash {
+    HPMurmurHash3State state;
+    uint8_t digest[16];
     
-    NSMutableString *ret = [NSMutableString stringWithCapacity:CC_MD5_DIGEST_LENGTH*2];
+    memset(&state, 0, sizeof(state));
     
-    for (int i = 0; i < CC_MD5_DIGEST_LENGTH; i++) {
-        [ret appendFormat:@"%02x", result[i]];
-    }
+    HPHashUpdateWithString(self, HPMurmurHash3Update, &state);
+    HPMurmurHash3Final(&state, digest);
     
-    return ret;
+    return HPHexStringWithBytes(digest, sizeof(digest));
 }
 
 #pragma mark - UUID
@@ -0,0 +1,25 @@
+//
+//  NSURL+HPCanonicalAdditions.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-20.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+
+@interface NSURL (NSURL_HPCanonicalAdditions)
+
+/** Returns a canonical string form of the URL
+ 
+ Logically identical URLs produce the same string: the scheme and host are 
+ lowercased, default ports and fragments are dropped, an empty path becomes /, 
+ percent escapes of unreserved characters are decoded, the remaining escapes 
+ are uppercased and query parameters are sorted by name. Parameters with the 
+ same name keep their relative order. URLs with credentials or without a host 
+ are returned as they are.
+ 
+ @returns Canonical URL string
+ */
+- (NSString *)canonicalString;
+
+@end
@@ -0,0 +1,132 @@
+//
+//  NSURL+HPCanonicalAdditions.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-20.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import "NSURL+HPCanonicalAdditions.h"
+
+
+static const char kHPUppercaseHexDigits[] = "0123456789ABCDEF";
+
+static int HPHexValue(unichar character) {
+    if (character >= '0' && character <= '9') {
+        return character - '0';
+    } else if (character >= 'a' && character <= 'f') {
+        return character - 'a' + 10;
+    } else if (character >= 'A' && character <= 'F') {
+        return character - 'A' + 10;
+    }
+    
+    return -1;
+}
+
+static BOOL HPIsUnreservedCharacter(unichar character) {
+    return ((character >= 'a' && character <= 'z') 
+            || (character >= 'A' && character <= 'Z') 
+            || (character >= '0' && character <= '9') 
+            || character == '-' || character == '.' || character == '_' || character == '~');
+}
+
+// Decodes escaped unreserved characters and uppercases all other escapes, 
+// which are the only encoding differences that never change the meaning
+static NSString *HPNormalizedPercentEscapes(NSString *string) {
+    if ([string rangeOfString:@"%"].location == NSNotFound) {
+        return string;
+    }
+    
+    NSUInteger length = [string length];
+    NSMutableString *normalizedString = [NSMutableString stringWithCapacity:length];
+    
+    for (NSUInteger i = 0; i < length; i++) {
+        unichar character = [string characterAtIndex:i];
+        
+        if (character == '%' && i + 2 < length) {
+            int high = HPHexValue([string characterAtIndex:i + 1]);
+            int low = HPHexValue([string characterAtIndex:i + 2]);
+            
+            if (high >= 0 && low >= 0) {
+                unichar decodedCharacter = (unichar)(high * 16 + low);
+                
+                if (HPIsUnreservedCharacter(decodedCharacter)) {
+                    [normalizedString appendFormat:@"%C", decodedCharacter];
+                } else {
+                    [normalizedString appendFormat:@"%%%c%c", kHPUppercaseHexDigits[high], kHPUppercaseHexDigits[low]];
+                }
+                
+                i += 2;
+                
+                continue;
+            }
+        }
+        
+        [normalizedString appendFormat:@"%C", character];
+    }
+    
+    return normalizedString;
+}
+
+static NSString *HPQueryParameterName(NSString *parameter) {
+    NSRange separatorRange = [parameter rangeOfString:@"="];
+    
+    if (separatorRange.location == NSNotFound) {
+        return parameter;
+    }
+    
+    return [parameter substringToIndex:separatorRange.location];
+}
+
+
+@implementation NSURL (NSURL_HPCanonicalAdditions)
+
+- (NSString *)canonicalString {
+    NSString *scheme = [[self scheme] lowercaseString];
+    NSString *host = [[self host] lowercaseString];
+    
+    if (scheme == nil || host == nil || [self user] != nil) {
+        return [self absoluteString];
+    }
+    
+    NSMutableString *canonicalString = [NSMutableString stringWithFormat:@"%@://%@", scheme, host];
+    NSInteger port = [[self port] integerValue];
+    
+    if (port > 0 && !(port == 80 && [scheme isEqualToString:@"http"]) 
+        && !(port == 443 && [scheme isEqualToString:@"https"])) {
+        [canonicalString appendFormat:@":%ld", (long)port];
+    }
+    
+    // The CF accessors leave percent escapes alone, unlike the NSURL ones
+    NSString *path = [(NSString *)CFURLCopyPath((CFURLRef)self) autorelease];
+    NSString *parameters = [(NSString *)CFURLCopyParameterString((CFURLRef)self, NULL) autorelease];
+    NSString *query = [(NSString *)CFURLCopyQueryString((CFURLRef)self, NULL) autorelease];
+    
+    [canonicalString appendString:([path length] > 0) ? HPNormalizedPercentEscapes(path) : @"/"];
+    
+    if (parameters != nil) {
+        [canonicalString appendFormat:@";%@", HPNormalizedPercentEscapes(parameters)];
+    }
+    
+    if ([query length] > 0) {
+        NSMutableArray *queryParameters = [NSMutableArray array];
+        
+        for (NSString *parameter in [query componentsSeparatedByString:@"&"]) {
+            if ([parameter length] > 0) {
+                [queryParameters addObject:HPNormalizedPercentEscapes(parameter)];
+            }
+        }
+        
+        [queryParameters sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(id first, id second) {
+            return [HPQueryParameterName(first) compare:HPQueryParameterName(second)];
+        }];
+        
+        if ([queryParameters count] > 0) {
+            [canonicalString appendFormat:@"?%@", [queryParameters componentsJoinedByString:@"&"]];
+        }
+    }
+    
+    return canonicalString;
+}
+
+@end
@@ -18,4 +18,5 @@ enum {
     kHPRequestParserFailureErrorCode = 104,
     kHPRequestAuthenticationFailureErrorCode = 105,
     kHPLocationDeniedErrorCode = 106,
+    kHPRequestFileFailureErrorCode = 107,
 };
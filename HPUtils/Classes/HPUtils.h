@@ -13,6 +13,7 @@
 #import "HPLocationManager.h"
 #import "HPReachabilityManager.h"
 #import "HPAuthenticationManager.h"
+#import "HPMemoryPressureManager.h"
 
 #import "HPImageOperation.h"
 #import "HPRequestOperation.h"
@@ -35,6 +36,7 @@
 #import "UIColor+HPColorAdditions.h"
 #import "UIScreen+HPScaleAdditions.h"
 #import "NSString+HPHashAdditions.h"
+#import "NSURL+HPCanonicalAdditions.h"
 #import "NSDate+HPTimeSinceAdditions.h"
 #import "NSObject+HPKVCAdditions.h"
 #import "UIDevice+HPCapabilityAdditions.h"
@@ -42,3 +44,5 @@
 #import "NSData+HPBase64Additions.h"
 
 #import "HPKeychainItem.h"
+#import "HPMemoryCache.h"
+#import "HPJSONArrayStreamParser.h"
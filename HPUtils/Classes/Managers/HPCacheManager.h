@@ -6,6 +6,36 @@
 //  Copyright 2011 Hippo Foundry. All rights reserved.
 //
 
+@class HPCacheIndex;
+@class HPMemoryCache;
+
+
+/** Hash functions for deriving cache keys from URLs
+ */
+typedef enum {
+    HPCacheKeyHashSHA1,
+    HPCacheKeyHashFast,
+} HPCacheKeyHash;
+
+
+/** Tiers of the cache manager, used for statistics
+ */
+typedef enum {
+    HPCacheTierMemory,
+    HPCacheTierCache,
+    HPCacheTierStorage,
+} HPCacheTier;
+
+
+extern NSString * const HPCacheStatisticsHitCountKey;
+extern NSString * const HPCacheStatisticsMissCountKey;
+extern NSString * const HPCacheStatisticsBytesReadKey;
+extern NSString * const HPCacheStatisticsBytesWrittenKey;
+extern NSString * const HPCacheStatisticsEvictionCountKey;
+extern NSString * const HPCacheStatisticsLatencyHistogramKey;
+extern NSString * const HPCacheStatisticsSizeKey;
+extern NSString * const HPCacheStatisticsCapacityKey;
+
 
 /** Cache item object stored by the [HPCacheManager](HPCacheManager)
  
@@ -19,9 +49,15 @@
 	NSString *_MIMEType;
 	NSString *_cachePath;
     NSDictionary *_metaData;
+    NSDate *_expirationDate;
+    NSString *_entityTag;
+    NSString *_lastModified;
 }
 
 /** NSData instance with the contents of the cache
+ 
+ For items read from disk, this is backed by a memory mapped view of the cache 
+ file whenever the file system allows it, so reading it does not copy the bytes.
  */
 @property (nonatomic, retain, readonly) NSData *cacheData;
 
@@ -38,9 +74,35 @@
 @property (nonatomic, retain, readonly) NSString *cachePath;
 
 /** Additional meta data for the cache object
+ 
+ Meta data is stored as a property list, so it can only contain property list 
+ objects.
  */
 @property (nonatomic, readonly, retain) NSDictionary *metaData;
 
+/** Time after which the cache object is no longer fresh
+ 
+ For HTTP responses this is derived from the Cache-Control and Expires headers. 
+ Items without caching headers stay fresh for 24 hours after storage.
+ */
+@property (nonatomic, readonly, retain) NSDate *expirationDate;
+
+/** ETag validator of the HTTP response the cache object was created from
+ */
+@property (nonatomic, readonly, retain) NSString *entityTag;
+
+/** Last-Modified validator of the HTTP response the cache object was created from
+ */
+@property (nonatomic, readonly, retain) NSString *lastModified;
+
+/** Whether the cache object has passed its expiration date
+ */
+@property (nonatomic, readonly, getter=isStale) BOOL stale;
+
+/** Whether the cache object can be revalidated with a conditional request
+ */
+@property (nonatomic, readonly) BOOL hasValidators;
+
 /** Generates a cache item from an NSDictionary
  
  @param pickle NDictionary that contains cache parameters
@@ -70,12 +132,42 @@
                                MIMEType:(NSString *)type 
                                   stamp:(NSDate *)stamp;
 
+/** Generates a cache item with freshness information
+ 
+ @param data NSData with cache contents
+ @param path File system path for the cache file
+ @param type MIME type for the cached file
+ @param stamp Timestamp of storage
+ @param metaData Additional meta data
+ @param expirationDate Expiration date, or nil for the default lifetime
+ @param entityTag ETag validator
+ @param lastModified Last-Modified validator
+ 
+ @returns An autoreleased HPCacheItem instance
+ */
++ (HPCacheItem *)cacheItemWithCacheData:(NSData *)data
+                                   path:(NSString *)path
+                               MIMEType:(NSString *)type
+                                  stamp:(NSDate *)stamp
+                               metaData:(NSDictionary *)metaData
+                         expirationDate:(NSDate *)expirationDate
+                              entityTag:(NSString *)entityTag
+                           lastModified:(NSString *)lastModified;
+
 - (id)initWithPickledObject:(NSDictionary *)pickle;
 - (id)initWithCacheData:(NSData *)data 
                    path:(NSString *)path 
                MIMEType:(NSString *)type 
                   stamp:(NSDate *)stamp
                metaData:(NSDictionary *)metaData;
+- (id)initWithCacheData:(NSData *)data
+                   path:(NSString *)path
+               MIMEType:(NSString *)type
+                  stamp:(NSDate *)stamp
+               metaData:(NSDictionary *)metaData
+         expirationDate:(NSDate *)expirationDate
+              entityTag:(NSString *)entityTag
+           lastModified:(NSString *)lastModified;
 
 /** Generates an NSDictionary object with cache item parameters
  
@@ -88,10 +180,17 @@
 
 /** Custom cache manager for storing cached items on disk
  
- This is an alternative cache manager that injects itself into the shared URL 
- cache routines to store some responses on disk instead of live memory. This 
- allows images and other long-term data to be stored in a temporary directory 
- so they can persist across app launches and memory warnings.
+ This is the only response cache used by HPUtils. Responses are stored once, 
+ served from a byte-budgeted memory tier in front of their files on disk, and 
+ never passed through the shared NSURLCache. This allows images and other 
+ long-term data to be stored in a temporary directory so they can persist 
+ across app launches and memory warnings.
+ 
+ Files are spread over subdirectories named after a hash prefix of their key, 
+ and files left at the top level by earlier versions are moved into place on 
+ launch or on first access. The most recently hit entries are remembered 
+ across launches and read back into memory in the background shortly after 
+ launch.
  
  [HPRequestManager](HPRequestManager) uses HPCacheManager behind the scenes and 
  no direct interaction is necessary unless access to the cache database is 
@@ -102,8 +201,144 @@
 	NSString *_cacheDirectoryPath;
 	NSString *_storageDirectoryPath;
 	NSOperationQueue *_saveQueue;
+    NSMutableDictionary *_pendingWrites;
+    NSLock *_pendingWritesLock;
+    BOOL _flushScheduled;
+    HPMemoryCache *_memoryCache;
+    HPMemoryCache *_cacheKeys;
+    HPCacheKeyHash _cacheKeyHash;
+    HPCacheIndex *_cacheIndex;
+    HPCacheIndex *_storageIndex;
+    dispatch_queue_t _evictionQueue;
+    dispatch_queue_t _readQueue;
+    dispatch_queue_t _flushQueue;
+    unsigned long long _cacheCapacity;
+    unsigned long long _storageCapacity;
+    volatile int32_t _evictionScheduled;
+    volatile int32_t _flatLayoutMigrated;
+    NSMutableSet *_compressedMIMETypes;
+    volatile int32_t _foregroundActivityCount;
+    NSMutableDictionary *_sweepShards;
+    NSUInteger _sweepShardIndex;
+    NSUInteger _sweepShardsRemaining;
+    NSTimeInterval _sweepTime;
+    void *_accessLogShards;
+    volatile int64_t _accessLogSequence;
+    void *_tierCounters;
 }
 
+/** In-memory hot tier
+
+ Recently read and written items for both the cache and the storage 
+ directories are kept in a byte-budgeted LRU cache, so repeated lookups are 
+ served without touching the file system. The cost limit can be adjusted and 
+ the hit and miss counters can be used for sizing.
+ */
+@property (nonatomic, readonly, retain) HPMemoryCache *memoryCache;
+
+/** Byte budget for the temporary cache directory
+ 
+ When the cache directory grows beyond this size, least recently used entries 
+ are evicted in small batches on a background queue until it is back under 
+ 90% of the budget. Reads are never blocked by eviction. Pass 0 to disable the 
+ limit. Default value is 100 MB.
+ */
+@property (nonatomic, assign) unsigned long long cacheCapacity;
+
+/** Byte budget for the permanent storage directory
+ 
+ Works the same way as cacheCapacity. Default value is 0, which means stored 
+ items are never evicted.
+ */
+@property (nonatomic, assign) unsigned long long storageCapacity;
+
+/** Hash function used for URL cache keys
+ 
+ HPCacheKeyHashSHA1 is the default and matches the keys of earlier versions. 
+ HPCacheKeyHashFast uses a non-cryptographic 128-bit hash that is cheaper to 
+ compute. Changing this orphans entries stored under the previous keys until 
+ they expire, so it should be set once at launch.
+ */
+@property (nonatomic, assign) HPCacheKeyHash cacheKeyHash;
+
+/** Enables or disables on-disk compression for a MIME type
+ 
+ Bodies of the enabled types are zlib compressed when they are written, if 
+ that makes them smaller, and inflated when they are read back from disk. The 
+ memory tier always holds the uncompressed data. All subtypes of a type can 
+ be enabled at once with an asterisk subtype. Images are never compressed. 
+ Compression is enabled for text, JSON, JavaScript and XML by default.
+ 
+ Inflating happens on the thread that reads the file, so prefer the 
+ asynchronous lookups, which read on the cache I/O queue.
+ 
+ @param compressesData Whether data of the type is compressed
+ @param MIMEType MIME type to configure
+ */
+- (void)setCompressesData:(BOOL)compressesData forMIMEType:(NSString *)MIMEType;
+
+/** Checks whether data of a MIME type is compressed on disk
+ 
+ @param MIMEType MIME type to check
+ 
+ @returns BOOL Boolean that determines whether data of the type is compressed
+ */
+- (BOOL)compressesDataForMIMEType:(NSString *)MIMEType;
+
+/** Marks the start of foreground work that needs the disk
+ 
+ Expired entries are swept a few at a time in the background after launch, 
+ and the sweep pauses while any foreground activity is in progress. 
+ [HPRequestOperation](HPRequestOperation) calls this while it is executing. 
+ Each call has to be balanced with a call to endForegroundActivity.
+ */
+- (void)beginForegroundActivity;
+
+/** Marks the end of foreground work started with beginForegroundActivity
+ */
+- (void)endForegroundActivity;
+
+/** Returns a snapshot of the statistics for a tier
+ 
+ The dictionary contains hit and miss counts, bytes returned by hits under 
+ HPCacheStatisticsBytesReadKey, bytes added to the tier, eviction counts, the 
+ current size and the capacity. Lookups that miss the memory tier go on to the 
+ disk tier of their directory, so they are counted in both. Expired entries 
+ removed by the background sweep count as cache evictions.
+ 
+ HPCacheStatisticsLatencyHistogramKey holds an array of lookup counts by 
+ latency. The first element counts lookups that took less than a microsecond, 
+ element i counts lookups between 2^(i-1) and 2^i microseconds and the last 
+ element every slower lookup.
+ 
+ Counters are updated with atomic increments and read without stopping other 
+ threads, so values in a snapshot may be a few lookups apart.
+ 
+ @param tier Tier to return the statistics for
+ 
+ @returns Dictionary of NSNumber values and the latency histogram array
+ */
+- (NSDictionary *)statisticsForTier:(HPCacheTier)tier;
+
+/** Resets the statistics of all tiers
+ 
+ This also resets the counters of the memoryCache.
+ */
+- (void)resetStatistics;
+
+/** Places the cache and storage directories in a container shared with other 
+ processes
+ 
+ Use this to let an app and its extensions share downloads. Files are written 
+ under per-process temporary names and renamed into place, so concurrent 
+ writers never corrupt an entry, and the directory indexes are coordinated 
+ with advisory file locks. Lookups that miss pick up entries stored by other 
+ processes. Has to be called before sharedManager is first used.
+ 
+ @param containerPath Path of the shared container directory
+ */
++ (void)setSharedContainerPath:(NSString *)containerPath;
+
 /** Returns the shared instance of the cache manager
  
  You should always use this call and never instantiate the HPCacheManager.
@@ -112,6 +347,22 @@
  */
 + (HPCacheManager *)sharedManager;
 
+/** Derives the expiration date of a response from its caching headers
+ 
+ All Cache-Control directives are read before any is applied, so their order 
+ does not matter. no-store anywhere makes the response non-storable, no-cache 
+ makes it expire immediately, otherwise max-age minus the Age header is used. 
+ Without Cache-Control, the Expires header is measured against the Date 
+ header of the server.
+ 
+ @param response HTTP response to read the headers of
+ @param storable Set to NO if the response must not be cached, can be NULL
+ 
+ @returns Expiration date, or nil if the response has no caching headers and 
+ the default lifetime applies
+ */
++ (NSDate *)expirationDateForResponse:(NSHTTPURLResponse *)response storable:(BOOL *)storable;
+
 /** Finds the permanently stored cache item associated with a given storage key
  
  @param storageKey Storage key to search for
@@ -120,6 +371,17 @@
  */
 - (HPCacheItem *)storedItemForStorageKey:(NSString *)storageKey;
 
+/** Asynchronously finds the permanently stored cache item for a storage key
+ 
+ The lookup runs on the cache I/O queue, which is also where the completion 
+ block is called.
+ 
+ @param storageKey Storage key to search for
+ @param completion Block that receives the HPCacheItem instance, or nil
+ */
+- (void)storedItemForStorageKey:(NSString *)storageKey 
+                     completion:(void (^)(HPCacheItem *cacheItem))completion;
+
 /** Permanently stores an NSData and MIMEType combination for a given storage key
  
  @param storageData NSData to be stored
@@ -144,7 +406,7 @@
  */
 - (BOOL)hasCachedItemForCacheKey:(NSString *)cacheKey;
 
-/** Finds a temporary cache item associated with a given cache key
+/** Finds a fresh temporary cache item associated with a given cache key
  
  @param cacheKey Cache key to search for
  
@@ -152,6 +414,32 @@
  */
 - (HPCacheItem *)cachedItemForCacheKey:(NSString *)cacheKey;
 
+/** Finds a temporary cache item associated with a given cache key
+ 
+ When stale items are not allowed, stale items without validators are removed, 
+ since they can never be revalidated.
+ 
+ @param cacheKey Cache key to search for
+ @param allowStale Whether stale items are returned
+ 
+ @returns HPCacheItem instance for the cache key
+ */
+- (HPCacheItem *)cachedItemForCacheKey:(NSString *)cacheKey allowStale:(BOOL)allowStale;
+
+/** Asynchronously finds a temporary cache item associated with a given cache key
+ 
+ The lookup, including any file system access, runs on a concurrent cache I/O 
+ queue, which is also where the completion block is called. Use this instead 
+ of cachedItemForCacheKey:allowStale: on the main thread.
+ 
+ @param cacheKey Cache key to search for
+ @param allowStale Whether stale items are returned
+ @param completion Block that receives the HPCacheItem instance, or nil
+ */
+- (void)cachedItemForCacheKey:(NSString *)cacheKey 
+                   allowStale:(BOOL)allowStale 
+                   completion:(void (^)(HPCacheItem *cacheItem))completion;
+
 /** Temporarily caches an NSData and MIMEType combination for a given cache key
  
  @param cacheData NSData to be cached
@@ -168,6 +456,27 @@
       forCacheKey:(NSString *)cacheKey 
      withMIMEType:(NSString *)MIMEType;
 
+/** Returns the cache key for a URL string
+ 
+ The URL is canonicalized before hashing, so URLs that only differ in query 
+ parameter order, host case, default ports, fragments or escaping share a key. 
+ Keys of recently used URLs are remembered, so repeated lookups for the same 
+ URL do not hash it again.
+ 
+ @param URLString Absolute URL string
+ 
+ @returns Cache key for the URL
+ */
+- (NSString *)cacheKeyForURLString:(NSString *)URLString;
+
+/** Returns the cache key for a URL
+ 
+ @param url URL to generate the key for
+ 
+ @returns Cache key for the URL
+ */
+- (NSString *)cacheKeyForURL:(NSURL *)url;
+
 /** Checks whether a cached item is available for a given URL
  
  @param url URL to search for
@@ -176,7 +485,7 @@
  */
 - (BOOL)hasCachedItemForURL:(NSURL *)url;
 
-/** Finds a temporary cache item associated with a given URL
+/** Finds a fresh temporary cache item associated with a given URL
  
  @param url URL to search for
  
@@ -184,6 +493,94 @@
  */
 - (HPCacheItem *)cachedItemForURL:(NSURL *)url;
 
+/** Finds a temporary cache item associated with a given URL
+ 
+ @param url URL to search for
+ @param allowStale Whether stale items are returned
+ 
+ @returns HPCacheItem instance for the URL
+ */
+- (HPCacheItem *)cachedItemForURL:(NSURL *)url allowStale:(BOOL)allowStale;
+
+/** Asynchronously finds a temporary cache item associated with a given URL
+ 
+ See cachedItemForCacheKey:allowStale:completion: for details.
+ 
+ @param url URL to search for
+ @param allowStale Whether stale items are returned
+ @param completion Block that receives the HPCacheItem instance, or nil
+ */
+- (void)cachedItemForURL:(NSURL *)url 
+              allowStale:(BOOL)allowStale 
+              completion:(void (^)(HPCacheItem *cacheItem))completion;
+
+/** Caches the body of an HTTP response for its URL
+ 
+ The ETag and Last-Modified validators of the response are stored with the 
+ item and its expiration date is derived from the Cache-Control and Expires 
+ headers. Responses marked no-store are not cached. Unlike the other cache 
+ calls, this replaces an existing item for the URL.
+ 
+ The data is not copied, so mutable data such as a connection buffer must not 
+ be modified after this call.
+ 
+ @param cacheData NSData to be cached
+ @param url URL for identification
+ @param response HTTP response the data belongs to
+ */
+- (void)cacheData:(NSData *)cacheData
+           forURL:(NSURL *)url
+         response:(NSHTTPURLResponse *)response;
+
+/** Returns a unique temporary path for downloading the body of a URL
+ 
+ The path is in a temporary directory inside the cache directory, so a file 
+ downloaded there can be adopted with cacheFileAtPath:forURL:response: without 
+ copying it. Files left behind by a process that is no longer running are 
+ removed the next time the cache manager is created.
+ 
+ @param url URL that will be downloaded
+ 
+ @returns Temporary file path, or nil if the directory can not be created
+ */
+- (NSString *)temporaryPathForURL:(NSURL *)url;
+
+/** Turns a downloaded file into the cache entry for its URL
+ 
+ The metadata is appended to the file, which is then renamed into place, so 
+ the body is never copied or loaded into memory. The file has to be on the 
+ same volume as the cache directory, which is always the case for paths 
+ returned by temporaryPathForURL:. Adopted files are stored uncompressed and 
+ are not added to the memory tier. Like cacheData:forURL:response:, this 
+ replaces an existing item for the URL and responses marked no-store are not 
+ cached.
+ 
+ If nil is returned, the file is left at its original path unchanged.
+ 
+ @param filePath Path of the downloaded body
+ @param url URL for identification
+ @param response HTTP response the body belongs to
+ 
+ @returns HPCacheItem instance with a memory mapped view of the cached body, 
+ or nil if the file was not cached
+ */
+- (HPCacheItem *)cacheFileAtPath:(NSString *)filePath 
+                          forURL:(NSURL *)url 
+                        response:(NSHTTPURLResponse *)response;
+
+/** Refreshes a stale cache item after a 304 Not Modified response
+ 
+ The cached bytes are kept, the expiration date is recalculated from the 
+ headers of the response and updated validators replace the stored ones.
+ 
+ @param cacheItem Stale cache item that was revalidated
+ @param response 304 response received for the conditional request
+ 
+ @returns The refreshed HPCacheItem instance
+ */
+- (HPCacheItem *)refreshCachedItem:(HPCacheItem *)cacheItem 
+                      withResponse:(NSHTTPURLResponse *)response;
+
 /** Temporarily caches an NSData and MIMEType combination for a given URL
  
  @param cacheData NSData to be cached
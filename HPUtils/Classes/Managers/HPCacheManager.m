@@ -6,17 +6,84 @@
 //  Copyright 2011 Hippo Foundry. All rights reserved.
 //
 
+#include <errno.h>
+#include <fcntl.h>
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/xattr.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#import "HPCacheIndex.h"
 #import "HPCacheManager.h"
+#import "HPMemoryCache.h"
 #import "NSString+HPHashAdditions.h"
+#import "NSURL+HPCanonicalAdditions.h"
 
 
-const NSUInteger kHPURLCacheMemoryCapacity = 1024 * 1024;
-const NSUInteger kHPURLCacheDiskCapacity = 10 * 1024 * 1024;
+const NSUInteger kHPMemoryCacheCapacity = 4 * 1024 * 1024;
+const NSUInteger kHPMemoryCacheShardCount = 8;
+const unsigned long long kHPCacheDiskCapacity = 100 * 1024 * 1024;
 
+NSString * const HPCacheStatisticsHitCountKey = @"hitCount";
+NSString * const HPCacheStatisticsMissCountKey = @"missCount";
+NSString * const HPCacheStatisticsBytesReadKey = @"bytesRead";
+NSString * const HPCacheStatisticsBytesWrittenKey = @"bytesWritten";
+NSString * const HPCacheStatisticsEvictionCountKey = @"evictionCount";
+NSString * const HPCacheStatisticsLatencyHistogramKey = @"latencyHistogram";
+NSString * const HPCacheStatisticsSizeKey = @"size";
+NSString * const HPCacheStatisticsCapacityKey = @"capacity";
+
+// Number of URL to cache key mappings remembered. Each mapping costs 1, so 
+// the memo stays out of memory pressure passes, which compare bytes.
+static NSUInteger const kCacheKeyMemoCapacity = 512;
+static NSUInteger const kCacheKeyMemoShardCount = 4;
+
+// Eviction brings directories down to this fraction of their capacity, so it 
+// does not kick in again on the very next write
+static double const kEvictionLowWaterMark = 0.9;
+static NSUInteger const kEvictionBatchSize = 32;
+
+// Lifetime of items stored without HTTP caching headers
 double const kHPStaleCacheInterval = 60.0 * 60.0 * 24.0;
 
+// Expired items are kept this long for revalidation before the launch sweep 
+// removes them
+static double const kCacheRevalidationWindow = 60.0 * 60.0 * 24.0 * 7.0;
+
+// The launch sweep clears at most this many entries per tick, within the 
+// time budget, and waits between ticks so it never saturates the disk
+static NSUInteger const kSweepBatchSize = 16;
+static double const kSweepTickBudget = 0.005;
+static double const kSweepTickInterval = 0.05;
+static double const kSweepPauseInterval = 0.5;
+
+// Shard the sweep continues from after a relaunch, stored in the cache directory
+static NSString * const kSweepCursorFilename = @".sweep";
+
+// Most recently hit keys, persisted when the app moves to the background and 
+// read back into the memory tier on the next launch
+static NSString * const kAccessLogFilename = @".access-log";
+static NSString * const kAccessLogCacheKey = @"cache";
+static NSString * const kAccessLogStorageKey = @"storage";
+static NSUInteger const kAccessLogCapacity = 256;
+
+// Hits are recorded in rings split by path hash, each holding the given number 
+// of the most recent hits, and only deduplicated when the log is written
+static NSUInteger const kAccessLogShardCount = 8;
+static NSUInteger const kAccessLogShardCapacity = 256;
+
+// Longest the main thread waits for the access log and the indexes to be 
+// flushed when the app is terminating, well within the time the system allows
+static double const kTerminationFlushTimeout = 2.0;
+
+// Fraction of the memory tier the launch warm-up is allowed to fill
+static double const kWarmUpMemoryFraction = 0.5;
+
 static NSString * const kURLCachePath = @"caches";
 static NSString * const kURLStoragePath = @"storage";
 static NSString * const kURLCacheFilename = @"shared";
@@ -26,26 +93,478 @@ static NSString * const kCacheInfoDataKey = @"cacheData";
 static NSString * const kCacheInfoDateKey = @"cacheDate";
 static NSString * const kCacheInfoMIMETypeKey = @"mimeType";
 static NSString * const kCacheInfoMetaDataKey = @"metaData";
+static NSString * const kCacheInfoExpirationDateKey = @"expirationDate";
+static NSString * const kCacheInfoEntityTagKey = @"entityTag";
+static NSString * const kCacheInfoLastModifiedKey = @"lastModified";
+static NSString * const kCacheInfoContentLengthKey = @"contentLength";
+
+// Temporary files live in a hidden directory next to the shards, which no 
+// cache or storage key can map to, and are named after the owning process
+static NSString * const kCacheTemporaryDirectoryName = @".tmp";
+
+// Files are spread over this many subdirectories named after a hash prefix of 
+// their key, which keeps directory listings and lookups short
+static NSUInteger const kCacheShardCount = 256;
+
+// Cache files are laid out as [body][metadata plist][trailer], so the body 
+// always starts at offset zero and can be handed out straight from a mapping
+static uint32_t const kCacheFileMagic = 0x31435048; // "HPC1"
+static uint16_t const kCacheFileVersion = 1;
+
+// Set in the trailer when the body is zlib compressed, in which case the 
+// metadata holds its uncompressed length
+static uint16_t const kCacheFileFlagCompressed = 1 << 0;
+
+// Bodies smaller than this are never worth compressing
+static NSUInteger const kCacheCompressionMinimumLength = 1024;
+
+// Compressed bodies are inflated from the mapping in chunks of this size, so 
+// only a window of the file is paged in at a time
+static NSUInteger const kCacheInflateChunkLength = 64 * 1024;
+
+// Lookup latencies are counted in power of two microsecond buckets, the last 
+// bucket takes everything slower
+enum {
+    kCacheLatencyBucketCount = 20,
+    kCacheTierCount = 3,
+};
+
+typedef struct {
+    volatile int64_t hitCount;
+    volatile int64_t missCount;
+    volatile int64_t bytesRead;
+    volatile int64_t bytesWritten;
+    volatile int64_t evictionCount;
+    volatile int64_t latencies[kCacheLatencyBucketCount];
+} HPCacheTierCounters;
+
+typedef struct {
+    NSString *path;
+    int64_t sequence;
+} HPCacheAccessRecord;
+
+typedef struct {
+    pthread_mutex_t lock;
+    NSUInteger cursor;
+    HPCacheAccessRecord *records;
+} HPCacheAccessLogShard;
+
+static int HPCacheCompareAccessRecords(const void *first, const void *second) {
+    int64_t firstSequence = ((const HPCacheAccessRecord *)first)->sequence;
+    int64_t secondSequence = ((const HPCacheAccessRecord *)second)->sequence;
+    
+    // Most recent first
+    if (firstSequence > secondSequence) {
+        return -1;
+    } else if (firstSequence < secondSequence) {
+        return 1;
+    }
+    
+    return 0;
+}
+
+typedef struct {
+    uint64_t bodyLength;
+    uint32_t metadataLength;
+    uint16_t flags;
+    uint16_t version;
+    uint32_t magic;
+} __attribute__((packed)) HPCacheFileTrailer;
+
+
+// Writes all buffers with as few system calls as possible, straight from 
+// their own memory
+static BOOL HPCacheFileWriteVector(int fd, struct iovec *vector, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, vector, count);
+        
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            return NO;
+        }
+        
+        // Skip what was written, which can end in the middle of a buffer
+        while (count > 0 && (size_t)written >= vector->iov_len) {
+            written -= vector->iov_len;
+            vector++;
+            count--;
+        }
+        
+        if (count > 0) {
+            vector->iov_base = (uint8_t *)vector->iov_base + written;
+            vector->iov_len -= written;
+        }
+    }
+    
+    return YES;
+}
+
+// Counters only need to be atomic, not ordered with other memory accesses, 
+// so the cheaper non-barrier variants are used on the lookup path
+static void HPCacheCountLookup(HPCacheTierCounters *counters, uint64_t startTime, NSUInteger length, BOOL hit) {
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        mach_timebase_info(&timebase);
+    });
+    
+    uint64_t microseconds = (mach_absolute_time() - startTime) * timebase.numer / timebase.denom / 1000;
+    NSUInteger bucket = (microseconds == 0) ? 0 : MIN((NSUInteger)(64 - __builtin_clzll(microseconds)), (NSUInteger)kCacheLatencyBucketCount - 1);
+    
+    if (hit) {
+        OSAtomicIncrement64(&counters->hitCount);
+        OSAtomicAdd64((int64_t)length, &counters->bytesRead);
+    } else {
+        OSAtomicIncrement64(&counters->missCount);
+    }
+    
+    OSAtomicIncrement64(&counters->latencies[bucket]);
+}
+
+static int64_t HPCacheReadCounter(volatile int64_t *counter) {
+    return OSAtomicAdd64Barrier(0, counter);
+}
+
+static void HPCacheResetCounter(volatile int64_t *counter) {
+    int64_t count;
+    
+    do {
+        count = *counter;
+    } while (!OSAtomicCompareAndSwap64Barrier(count, 0, counter));
+}
+
+static NSData *HPCacheDeflateData(NSData *data) {
+    uLong bound = compressBound((uLong)[data length]);
+    NSMutableData *compressedData = [NSMutableData dataWithLength:bound];
+    uLongf compressedLength = bound;
+    
+    if (compress2((Bytef *)[compressedData mutableBytes], &compressedLength, 
+                  (const Bytef *)[data bytes], (uLong)[data length], 
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return nil;
+    }
+    
+    // Not worth the inflate on every read
+    if (compressedLength >= [data length]) {
+        return nil;
+    }
+    
+    [compressedData setLength:compressedLength];
+    
+    return compressedData;
+}
+
+static NSData *HPCacheInflateBytes(const uint8_t *bytes, NSUInteger length, NSUInteger inflatedLength) {
+    NSMutableData *inflatedData = [NSMutableData dataWithLength:inflatedLength];
+    z_stream stream;
+    
+    memset(&stream, 0, sizeof(stream));
+    
+    if (inflateInit(&stream) != Z_OK) {
+        return nil;
+    }
+    
+    stream.next_out = (Bytef *)[inflatedData mutableBytes];
+    stream.avail_out = (uInt)inflatedLength;
+    
+    NSUInteger offset = 0;
+    int status = Z_OK;
+    
+    while (status == Z_OK) {
+        if (stream.avail_in == 0) {
+            if (offset == length) {
+                break;
+            }
+            
+            NSUInteger chunkLength = MIN(kCacheInflateChunkLength, length - offset);
+            
+            stream.next_in = (Bytef *)(bytes + offset);
+            stream.avail_in = (uInt)chunkLength;
+            offset += chunkLength;
+        }
+        
+        status = inflate(&stream, Z_NO_FLUSH);
+    }
+    
+    BOOL success = (status == Z_STREAM_END && stream.total_out == inflatedLength);
+    
+    inflateEnd(&stream);
+    
+    return (success) ? inflatedData : nil;
+}
+
+static NSUInteger HPCacheShardIndexForKey(NSString *key) {
+    char buffer[256];
+    const char *bytes = buffer;
+    
+    if (![key getCString:buffer maxLength:sizeof(buffer) encoding:NSUTF8StringEncoding]) {
+        bytes = [key UTF8String];
+    }
+    
+    // FNV-1a, folded down to the shard count
+    uint32_t hash = 2166136261U;
+    
+    for (const char *cursor = bytes; *cursor != '\0'; cursor++) {
+        hash ^= (uint8_t)*cursor;
+        hash *= 16777619U;
+    }
+    
+    return ((hash >> 16) ^ hash) % kCacheShardCount;
+}
+
+static NSString *HPCacheShardNameForIndex(NSUInteger shardIndex) {
+    return [NSString stringWithFormat:@"%02lx", (unsigned long)shardIndex];
+}
+
+static BOOL HPCacheCreateShardDirectoryForPath(NSString *path) {
+    int result = mkdir([[path stringByDeletingLastPathComponent] fileSystemRepresentation], 0755);
+    
+    return (result == 0 || errno == EEXIST);
+}
+
+static BOOL HPCacheMoveFileIntoShard(NSString *sourcePath, NSString *path) {
+    if (rename([sourcePath fileSystemRepresentation], [path fileSystemRepresentation]) == 0) {
+        return YES;
+    }
+    
+    // Shard directories are created on first use
+    return (errno == ENOENT 
+            && HPCacheCreateShardDirectoryForPath(path) 
+            && rename([sourcePath fileSystemRepresentation], [path fileSystemRepresentation]) == 0);
+}
+
+static NSString *HPCacheHeaderValue(NSHTTPURLResponse *response, NSString *headerName) {
+    NSDictionary *headers = [response allHeaderFields];
+    NSString *value = [headers objectForKey:headerName];
+    
+    if (value != nil) {
+        return value;
+    }
+    
+    for (NSString *key in headers) {
+        if ([key caseInsensitiveCompare:headerName] == NSOrderedSame) {
+            return [headers objectForKey:key];
+        }
+    }
+    
+    return nil;
+}
+
+static NSDate *HPCacheDateFromHTTPDateString(NSString *dateString) {
+    static NSDateFormatter *dateFormatter = nil;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        dateFormatter = [[NSDateFormatter alloc] init];
+        
+        [dateFormatter setLocale:[[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"] autorelease]];
+        [dateFormatter setTimeZone:[NSTimeZone timeZoneWithAbbreviation:@"GMT"]];
+        [dateFormatter setDateFormat:@"EEE',' dd MMM yyyy HH':'mm':'ss 'GMT'"];
+    });
+    
+    if (dateString == nil) {
+        return nil;
+    }
+    
+    @synchronized(dateFormatter) {
+        return [dateFormatter dateFromString:dateString];
+    }
+}
+
+// Derives the expiration date of a response from its Cache-Control and Expires 
+// headers. Returns nil when neither is present, so the default lifetime applies.
+static NSDate *HPCacheExpirationDateForResponse(NSHTTPURLResponse *response, BOOL *storable) {
+    if (storable != NULL) {
+        *storable = YES;
+    }
+    
+    NSString *cacheControl = HPCacheHeaderValue(response, @"Cache-Control");
+    
+    if (cacheControl != nil) {
+        NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
+        BOOL noStore = NO;
+        BOOL noCache = NO;
+        NSString *maxAgeValue = nil;
+        
+        // Directives can come in any order, so all of them are read before 
+        // any is applied
+        for (NSString *component in [cacheControl componentsSeparatedByString:@","]) {
+            NSString *directive = [[component stringByTrimmingCharactersInSet:whitespace] lowercaseString];
+            
+            if ([directive isEqualToString:@"no-store"]) {
+                noStore = YES;
+            } else if ([directive isEqualToString:@"no-cache"]) {
+                noCache = YES;
+            } else if ([directive hasPrefix:@"max-age="] && maxAgeValue == nil) {
+                maxAgeValue = [directive substringFromIndex:8];
+            }
+        }
+        
+        if (noStore) {
+            if (storable != NULL) {
+                *storable = NO;
+            }
+            
+            return [NSDate date];
+        }
+        
+        if (noCache) {
+            return [NSDate date];
+        }
+        
+        if (maxAgeValue != nil) {
+            NSTimeInterval maxAge = [maxAgeValue doubleValue];
+            NSTimeInterval age = [HPCacheHeaderValue(response, @"Age") doubleValue];
+            
+            return [NSDate dateWithTimeIntervalSinceNow:MAX(maxAge - age, 0.0)];
+        }
+    }
+    
+    NSString *expires = HPCacheHeaderValue(response, @"Expires");
+    
+    if (expires != nil) {
+        NSDate *expirationDate = HPCacheDateFromHTTPDateString(expires);
+        
+        // Invalid values such as "0" mean the response is already expired
+        if (expirationDate == nil) {
+            return [NSDate date];
+        }
+        
+        // Measure against the server clock when possible
+        NSDate *serverDate = HPCacheDateFromHTTPDateString(HPCacheHeaderValue(response, @"Date"));
+        
+        if (serverDate != nil) {
+            return [NSDate dateWithTimeIntervalSinceNow:[expirationDate timeIntervalSinceDate:serverDate]];
+        }
+        
+        return expirationDate;
+    }
+    
+    return nil;
+}
+
+
+/** Immutable view into a range of another NSData instance
 
+ Used to expose the body of a memory mapped cache file, an inflated body or a 
+ finished download buffer, without copying it. The backing data, and with it 
+ the mapping, stays alive as long as the view does.
+ */
+@interface HPCacheSliceData : NSData {
+@private
+    NSData *_backingData;
+    NSRange _range;
+}
+
+- (id)initWithData:(NSData *)data range:(NSRange)range;
 
-@interface HPURLCache : NSURLCache
 @end
 
 
 @interface HPCacheManager (PrivateMethods)
 - (void)storeCacheWithCacheItem:(HPCacheItem *)cacheItem;
+- (HPCacheItem *)cacheItemAtPath:(NSString *)path;
+- (void)addItemToMemoryCache:(HPCacheItem *)cacheItem;
+- (HPCacheTierCounters *)countersForTier:(HPCacheTier)tier;
+- (HPCacheTierCounters *)countersForPath:(NSString *)path;
+- (HPCacheItem *)pendingItemForPath:(NSString *)path;
+- (void)enqueueWriteForCacheItem:(HPCacheItem *)cacheItem;
+- (void)cancelPendingWriteForPath:(NSString *)path;
+- (void)flushPendingWrites;
+- (HPCacheItem *)readCacheItemAtPath:(NSString *)path options:(NSDataReadingOptions)options isLegacy:(BOOL *)isLegacy;
+- (void)recordAccessToPath:(NSString *)path;
+- (void)writeAccessLog;
+- (void)warmUpFromAccessLog;
+- (NSMutableDictionary *)infoForCacheItem:(HPCacheItem *)cacheItem;
+- (BOOL)writeCacheItem:(HPCacheItem *)cacheItem toPath:(NSString *)path fileSize:(unsigned long long *)fileSize;
+- (void)indexCacheItem:(HPCacheItem *)cacheItem fileSize:(unsigned long long)fileSize;
+- (void)didStoreCacheItem:(HPCacheItem *)cacheItem fileSize:(unsigned long long)fileSize;
+- (void)didReceiveApplicationNotification:(NSNotification *)notification;
+- (HPCacheIndex *)indexForPath:(NSString *)path;
+- (NSString *)pathForKey:(NSString *)key inIndex:(HPCacheIndex *)index;
+- (HPCacheIndexEntry *)indexEntryForKey:(NSString *)key atPath:(NSString *)path;
+- (void)migrateFlatFilesInIndex:(HPCacheIndex *)index;
+- (NSString *)temporaryPathInIndex:(HPCacheIndex *)index;
+- (void)removeAbandonedTemporaryFilesInIndex:(HPCacheIndex *)index;
+- (BOOL)migrateLegacyFileToPath:(NSString *)path;
+- (void)startSweepForEntriesExpiredBeforeDate:(NSDate *)date;
+- (void)sweepNextBatch;
+- (void)advanceSweepShard;
+- (void)scheduleEvictionIfNeeded;
+- (void)evictEntriesWithCacheCandidates:(NSEnumerator *)cacheCandidates storageCandidates:(NSEnumerator *)storageCandidates;
+- (BOOL)evictEntriesFromIndex:(HPCacheIndex *)index capacity:(unsigned long long)capacity candidates:(NSEnumerator **)candidates;
 - (NSString *)cachePathForCacheKey:(NSString *)cacheKey;
 - (NSString *)storagePathForStorageKey:(NSString *)storageKey;
 - (BOOL)addSkipBackupAttributeToItemAtURL:(NSURL *)URL;
 @end
 
 
+@implementation HPCacheSliceData
+
+- (id)initWithData:(NSData *)data range:(NSRange)range {
+    self = [super init];
+    
+    if (self) {
+        _backingData = [data retain];
+        _range = range;
+    }
+    
+    return self;
+}
+
+- (NSUInteger)length {
+    return _range.length;
+}
+
+- (const void *)bytes {
+    return (const uint8_t *)[_backingData bytes] + _range.location;
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    return [self retain];
+}
+
+- (void)dealloc {
+    [_backingData release], _backingData = nil;
+    
+    [super dealloc];
+}
+
+@end
+
+
 @implementation HPCacheItem
 
 @synthesize cachePath = _cachePath;
 @synthesize cacheData = _cacheData;
 @synthesize timeStamp = _timeStamp;
 @synthesize MIMEType = _MIMEType;
+@synthesize metaData = _metaData;
+@synthesize expirationDate = _expirationDate;
+@synthesize entityTag = _entityTag;
+@synthesize lastModified = _lastModified;
+
++ (HPCacheItem *)cacheItemWithCacheData:(NSData *)data
+                                   path:(NSString *)path
+                               MIMEType:(NSString *)type
+                                  stamp:(NSDate *)stamp
+                               metaData:(NSDictionary *)metaData
+                         expirationDate:(NSDate *)expirationDate
+                              entityTag:(NSString *)entityTag
+                           lastModified:(NSString *)lastModified {
+	return [[[HPCacheItem alloc] initWithCacheData:data
+                                              path:path
+                                          MIMEType:type
+                                             stamp:stamp
+                                          metaData:metaData
+                                    expirationDate:expirationDate
+                                         entityTag:entityTag
+                                      lastModified:lastModified] autorelease];
+}
 
 + (HPCacheItem *)cacheItemWithCacheData:(NSData *)data
                                    path:(NSString *)path
@@ -77,7 +596,10 @@ static NSString * const kCacheInfoMetaDataKey = @"metaData";
                    path:(NSString *)path
                MIMEType:(NSString *)type
                   stamp:(NSDate *)stamp
-               metaData:(NSDictionary *)metaData {
+               metaData:(NSDictionary *)metaData
+         expirationDate:(NSDate *)expirationDate
+              entityTag:(NSString *)entityTag
+           lastModified:(NSString *)lastModified {
 	self = [super init];
 	
 	if (self) {
@@ -85,36 +607,49 @@ static NSString * const kCacheInfoMetaDataKey = @"metaData";
 		_cacheData = [data copy];
 		_MIMEType = [type copy];
         _metaData = [metaData copy];
+        _entityTag = [entityTag copy];
+        _lastModified = [lastModified copy];
 		
 		if (stamp != nil) {
 			_timeStamp = [stamp copy];
 		} else {
 			_timeStamp = [[NSDate date] copy];
 		}
+        
+        if (expirationDate != nil) {
+            _expirationDate = [expirationDate copy];
+        } else {
+            _expirationDate = [[_timeStamp dateByAddingTimeInterval:kHPStaleCacheInterval] retain];
+        }
 	}
 	
 	return self;
 }
 
+- (id)initWithCacheData:(NSData *)data
+                   path:(NSString *)path
+               MIMEType:(NSString *)type
+                  stamp:(NSDate *)stamp
+               metaData:(NSDictionary *)metaData {
+	return [self initWithCacheData:data 
+                              path:path 
+                          MIMEType:type 
+                             stamp:stamp 
+                          metaData:metaData 
+                    expirationDate:nil 
+                         entityTag:nil 
+                      lastModified:nil];
+}
+
 - (id)initWithCacheData:(NSData *)data 
                    path:(NSString *)path 
                MIMEType:(NSString *)type 
                   stamp:(NSDate *)stamp {
-	self = [super init];
-	
-	if (self) {
-		_cachePath = [path copy];
-		_cacheData = [data copy];
-		_MIMEType = [type copy];
-		
-		if (stamp != nil) {
-			_timeStamp = [stamp copy];
-		} else {
-			_timeStamp = [[NSDate date] copy];
-		}
-	}
-	
-	return self;
+	return [self initWithCacheData:data 
+                              path:path 
+                          MIMEType:type 
+                             stamp:stamp 
+                          metaData:nil];
 }
 
 - (id)initWithPickledObject:(NSDictionary *)pickle {
@@ -122,7 +657,18 @@ static NSString * const kCacheInfoMetaDataKey = @"metaData";
 							  path:[pickle objectForKey:kCacheInfoPathKey] 
 						  MIMEType:[pickle objectForKey:kCacheInfoMIMETypeKey] 
 							 stamp:[pickle objectForKey:kCacheInfoDateKey]
-                          metaData:[pickle objectForKey:kCacheInfoMetaDataKey]];
+                          metaData:[pickle objectForKey:kCacheInfoMetaDataKey]
+                    expirationDate:[pickle objectForKey:kCacheInfoExpirationDateKey]
+                         entityTag:[pickle objectForKey:kCacheInfoEntityTagKey]
+                      lastModified:[pickle objectForKey:kCacheInfoLastModifiedKey]];
+}
+
+- (BOOL)isStale {
+    return ([_expirationDate timeIntervalSinceNow] <= 0.0);
+}
+
+- (BOOL)hasValidators {
+    return (_entityTag != nil || _lastModified != nil);
 }
 
 - (NSDictionary *)pickledObjectForArchive {
@@ -136,6 +682,18 @@ static NSString * const kCacheInfoMetaDataKey = @"metaData";
         [pickle setObject:_metaData forKey:kCacheInfoMetaDataKey];
     }
     
+    if (_expirationDate != nil) {
+        [pickle setObject:_expirationDate forKey:kCacheInfoExpirationDateKey];
+    }
+    
+    if (_entityTag != nil) {
+        [pickle setObject:_entityTag forKey:kCacheInfoEntityTagKey];
+    }
+    
+    if (_lastModified != nil) {
+        [pickle setObject:_lastModified forKey:kCacheInfoLastModifiedKey];
+    }
+    
     return pickle;
 }
 
@@ -145,6 +703,9 @@ static NSString * const kCacheInfoMetaDataKey = @"metaData";
 	[_cacheData release], _cacheData = nil;
 	[_MIMEType release], _MIMEType = nil;
     [_metaData release], _metaData = nil;
+    [_expirationDate release], _expirationDate = nil;
+    [_entityTag release], _entityTag = nil;
+    [_lastModified release], _lastModified = nil;
 	
 	[super dealloc];
 }
@@ -154,16 +715,39 @@ static NSString * const kCacheInfoMetaDataKey = @"metaData";
 
 @implementation HPCacheManager
 
+@synthesize memoryCache = _memoryCache;
+@synthesize cacheKeyHash = _cacheKeyHash;
+@synthesize cacheCapacity = _cacheCapacity;
+@synthesize storageCapacity = _storageCapacity;
+
 static HPCacheManager *_sharedManager = nil;
+static NSString *_sharedContainerPath = nil;
+
++ (void)setSharedContainerPath:(NSString *)containerPath {
+    if (_sharedManager != nil) {
+        NSLog(@">>> CACHE ERROR: The shared container has to be set before the cache manager is first used");
+        
+        return;
+    }
+    
+    [_sharedContainerPath release];
+    _sharedContainerPath = [containerPath copy];
+}
 
 + (HPCacheManager *)sharedManager {
-    if (_sharedManager == nil) {
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
         _sharedManager = [[super allocWithZone:NULL] init];
-    }
+    });
     
 	return _sharedManager;
 }
 
++ (NSDate *)expirationDateForResponse:(NSHTTPURLResponse *)response storable:(BOOL *)storable {
+    return HPCacheExpirationDateForResponse(response, storable);
+}
+
 + (id)allocWithZone:(NSZone *)zone {
     return [[self sharedManager] retain];
 }
@@ -193,12 +777,59 @@ static HPCacheManager *_sharedManager = nil;
     
 	if (self) {
 		_saveQueue = [[NSOperationQueue alloc] init];
-		_cacheDirectoryPath = [[[NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject] 
-								stringByAppendingPathComponent:kURLCachePath] copy];
-		_storageDirectoryPath = [[[NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject] 
-                                  stringByAppendingPathComponent:kURLStoragePath] copy];
+        _pendingWrites = [[NSMutableDictionary alloc] init];
+        _pendingWritesLock = [[NSLock alloc] init];
+        _flushScheduled = NO;
+        _memoryCache = [[HPMemoryCache alloc] initWithTotalCostLimit:kHPMemoryCacheCapacity 
+                                                          shardCount:kHPMemoryCacheShardCount];
+        _cacheKeys = [[HPMemoryCache alloc] initWithTotalCostLimit:kCacheKeyMemoCapacity 
+                                                        shardCount:kCacheKeyMemoShardCount 
+                                          respondsToMemoryPressure:NO];
+        _cacheKeyHash = HPCacheKeyHashSHA1;
+        NSString *containerPath = _sharedContainerPath;
+        
+        if (containerPath == nil) {
+            containerPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject];
+        }
+        
+		_cacheDirectoryPath = [[containerPath stringByAppendingPathComponent:kURLCachePath] copy];
+		_storageDirectoryPath = [[containerPath stringByAppendingPathComponent:kURLStoragePath] copy];
 		
 		[_saveQueue setMaxConcurrentOperationCount:1];
+        
+        _cacheIndex = [[HPCacheIndex alloc] initWithDirectoryPath:_cacheDirectoryPath 
+                                                           shared:(_sharedContainerPath != nil)];
+        _storageIndex = [[HPCacheIndex alloc] initWithDirectoryPath:_storageDirectoryPath 
+                                                             shared:(_sharedContainerPath != nil)];
+        _cacheCapacity = kHPCacheDiskCapacity;
+        _storageCapacity = 0;
+        _evictionScheduled = 0;
+        _flatLayoutMigrated = 0;
+        _foregroundActivityCount = 0;
+        _sweepShards = nil;
+        _sweepShardIndex = 0;
+        _sweepShardsRemaining = 0;
+        _sweepTime = 0.0;
+        _accessLogShards = calloc(kAccessLogShardCount, sizeof(HPCacheAccessLogShard));
+        _accessLogSequence = 0;
+        
+        for (NSUInteger i = 0; i < kAccessLogShardCount; i++) {
+            HPCacheAccessLogShard *shard = &((HPCacheAccessLogShard *)_accessLogShards)[i];
+            
+            pthread_mutex_init(&shard->lock, NULL);
+            
+            shard->records = calloc(kAccessLogShardCapacity, sizeof(HPCacheAccessRecord));
+        }
+        
+        _compressedMIMETypes = [[NSMutableSet alloc] initWithObjects:@"text/*", @"application/json", 
+                                @"application/javascript", @"application/xml", nil];
+        _evictionQueue = dispatch_queue_create("com.hippofoundry.HPUtils.HPCacheManager.eviction", DISPATCH_QUEUE_SERIAL);
+        
+        dispatch_set_target_queue(_evictionQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        
+        _readQueue = dispatch_queue_create("com.hippofoundry.HPUtils.HPCacheManager.read", DISPATCH_QUEUE_CONCURRENT);
+        _flushQueue = dispatch_queue_create("com.hippofoundry.HPUtils.HPCacheManager.flush", DISPATCH_QUEUE_SERIAL);
+        _tierCounters = calloc(kCacheTierCount, sizeof(HPCacheTierCounters));
 		
 		NSFileManager *fileManager = [NSFileManager defaultManager];
 
@@ -234,42 +865,42 @@ static HPCacheManager *_sharedManager = nil;
 		}
 
         dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
-            // Loop through existing files and delete old ones
-            NSError *clearError = nil;
-            NSArray *filePaths = [fileManager contentsOfDirectoryAtPath:_cacheDirectoryPath error:&clearError];
-
-            if (clearError == nil && filePaths != nil && [filePaths count] > 0) {
-                for (NSString *filePath in filePaths) {
-                    NSString *fullFilePath = [_cacheDirectoryPath stringByAppendingPathComponent:filePath];
-                    NSDictionary *pickle = [NSKeyedUnarchiver unarchiveObjectWithFile:fullFilePath];
-
-                    if (pickle == nil) {
-                        continue;
-                    }
-                    
-                    HPCacheItem *cachedItem = [HPCacheItem cacheItemWithPickledObject:pickle];
-                    
-                    if (cachedItem.timeStamp != nil
-                        && (-1 * [cachedItem.timeStamp timeIntervalSinceNow]) < kHPStaleCacheInterval) {
-                        continue;
-                    }
-                    
-                    NSError *deleteError = nil;
-                    
-                    if (![fileManager removeItemAtPath:fullFilePath error:&deleteError]) {
-                        NSLog(@">>> DELETE ERROR: %@", deleteError);
-                    }
-                }
+            NSArray *indexes = [NSArray arrayWithObjects:_cacheIndex, _storageIndex, nil];
+            
+            // Move files written by earlier versions into their shards before 
+            // recovery gets a chance to list the directories
+            for (HPCacheIndex *index in indexes) {
+                [self migrateFlatFilesInIndex:index];
+                [self removeAbandonedTemporaryFilesInIndex:index];
             }
+            
+            OSAtomicCompareAndSwap32Barrier(0, 1, &_flatLayoutMigrated);
+            
+            // Load the indexes, only opening files if the previous session did 
+            // not shut down cleanly
+            for (HPCacheIndex *index in indexes) {
+                [index loadWithEntryBlock:^ HPCacheIndexEntry * (NSString *key, NSString *path) {
+                    return [self indexEntryForKey:key atPath:path];
+                }];
+            }
+            
+            [self warmUpFromAccessLog];
+            
+            // Delete files that expired too long ago to be worth revalidating
+            [self startSweepForEntriesExpiredBeforeDate:[NSDate dateWithTimeIntervalSinceNow:-kCacheRevalidationWindow]];
+            
+            [self scheduleEvictionIfNeeded];
         });
         
-		HPURLCache *urlCache = [[HPURLCache alloc] initWithMemoryCapacity:kHPURLCacheMemoryCapacity
-                                                             diskCapacity:kHPURLCacheDiskCapacity 
-                                                                 diskPath:_cacheDirectoryPath];
-		
-		[NSURLCache setSharedURLCache:urlCache];
-		
-		[urlCache release];
+        [[NSNotificationCenter defaultCenter] addObserver:self 
+                                                 selector:@selector(didReceiveApplicationNotification:) 
+                                                     name:UIApplicationDidEnterBackgroundNotification 
+                                                   object:nil];
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self 
+                                                 selector:@selector(didReceiveApplicationNotification:) 
+                                                     name:UIApplicationWillTerminateNotification 
+                                                   object:nil];
 	}
 	
 	return self;
@@ -287,103 +918,779 @@ static HPCacheManager *_sharedManager = nil;
 }
 
 - (NSString *)cachePathForCacheKey:(NSString *)cacheKey {
-	return [_cacheDirectoryPath stringByAppendingPathComponent:cacheKey];
+	return [self pathForKey:cacheKey inIndex:_cacheIndex];
 }
 
 - (NSString *)storagePathForStorageKey:(NSString *)storageKey {
-	return [_storageDirectoryPath stringByAppendingPathComponent:storageKey];
+	return [self pathForKey:storageKey inIndex:_storageIndex];
 }
 
-- (HPCacheItem *)storedItemForStorageKey:(NSString *)storageKey {
-    NSDictionary *pickle = [NSKeyedUnarchiver unarchiveObjectWithFile:[self storagePathForStorageKey:storageKey]];
-	
-	if (pickle != nil) {
-		HPCacheItem *cachedItem = [HPCacheItem cacheItemWithPickledObject:pickle];
-		
-		return cachedItem;
-	} else {
-		return nil;
-	}
+- (HPCacheIndex *)indexForPath:(NSString *)path {
+    NSString *directoryPath = [[path stringByDeletingLastPathComponent] stringByDeletingLastPathComponent];
+    
+    if ([directoryPath isEqualToString:_cacheDirectoryPath]) {
+        return _cacheIndex;
+    } else if ([directoryPath isEqualToString:_storageDirectoryPath]) {
+        return _storageIndex;
+    }
+    
+    return nil;
 }
 
-- (void)storeData:(NSData *)storageData
-    forStorageKey:(NSString *)storageKey
-     withMIMEType:(NSString *)MIMEType
-         metaData:(NSDictionary *)metaData {
-    if (storageData != nil) {
-		NSString *storagePath = [self storagePathForStorageKey:storageKey];
-        
-        [_saveQueue addOperation:[[[NSInvocationOperation alloc]
-                                   initWithTarget:self
-                                   selector:@selector(storeCacheWithCacheItem:)
-                                   object:[HPCacheItem cacheItemWithCacheData:storageData
-                                                                         path:storagePath
-                                                                     MIMEType:MIMEType
-                                                                        stamp:nil
-                                                                     metaData:metaData]] autorelease]];
-	}
+- (NSString *)pathForKey:(NSString *)key inIndex:(HPCacheIndex *)index {
+    NSString *shardName = HPCacheShardNameForIndex(HPCacheShardIndexForKey(key));
+    
+    return [[index.directoryPath stringByAppendingPathComponent:shardName] stringByAppendingPathComponent:key];
 }
 
-- (void)storeData:(NSData *)storageData
-    forStorageKey:(NSString *)storageKey
-     withMIMEType:(NSString *)MIMEType {
-
-    [self storeData:storageData
-      forStorageKey:storageKey
-       withMIMEType:MIMEType
-           metaData:nil];
+- (HPCacheIndexEntry *)indexEntryForKey:(NSString *)key atPath:(NSString *)path {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    HPCacheItem *cachedItem = [self readCacheItemAtPath:path options:NSDataReadingMappedIfSafe isLegacy:NULL];
+    
+    if (cachedItem == nil) {
+        return nil;
+    }
+    
+    return [HPCacheIndexEntry entryWithKey:key 
+                                      size:[[fileManager attributesOfItemAtPath:path error:nil] fileSize] 
+                                 timeStamp:[cachedItem.timeStamp timeIntervalSinceReferenceDate] 
+                            expirationTime:[cachedItem.expirationDate timeIntervalSinceReferenceDate] 
+                                  MIMEType:cachedItem.MIMEType];
 }
 
-- (BOOL)hasCachedItemForCacheKey:(NSString *)cacheKey {
-    return [[NSFileManager defaultManager] fileExistsAtPath:[self cachePathForCacheKey:cacheKey]];
-}
+#pragma mark - Temporary files
 
-- (HPCacheItem *)cachedItemForCacheKey:(NSString *)cacheKey {
-	NSDictionary *pickle = [NSKeyedUnarchiver unarchiveObjectWithFile:[self cachePathForCacheKey:cacheKey]];
-	
-	if (pickle != nil) {
-		HPCacheItem *cachedItem = [HPCacheItem cacheItemWithPickledObject:pickle];
-		
-		if (cachedItem.timeStamp == nil || 
-            (cachedItem.timeStamp != nil && 
-             (-1 * [cachedItem.timeStamp timeIntervalSinceNow]) > kHPStaleCacheInterval)) {
-			[self clearCacheForCacheKey:cacheKey];
-			
-			return nil;
-		} else {
-			return cachedItem;
-		}
-	} else {
-		return nil;
-	}
+- (NSString *)temporaryPathInIndex:(HPCacheIndex *)index {
+    static volatile int32_t temporaryFileCount = 0;
+    NSString *fileName = [NSString stringWithFormat:@"%d.%d", getpid(), OSAtomicIncrement32Barrier(&temporaryFileCount)];
+    
+    return [[index.directoryPath stringByAppendingPathComponent:kCacheTemporaryDirectoryName] 
+            stringByAppendingPathComponent:fileName];
 }
 
-- (BOOL)hasCachedItemForURL:(NSURL *)url {
-    return [[NSFileManager defaultManager] fileExistsAtPath:[self cachePathForCacheKey:[[url absoluteString] SHA1Hash]]];
+- (void)removeAbandonedTemporaryFilesInIndex:(HPCacheIndex *)index {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *directoryPath = [index.directoryPath stringByAppendingPathComponent:kCacheTemporaryDirectoryName];
+    
+    // Leftovers from interrupted writes and downloads, unless the process that 
+    // owns them is still running and may be about to rename them into place
+    for (NSString *fileName in [fileManager contentsOfDirectoryAtPath:directoryPath error:nil]) {
+        pid_t pid = (pid_t)[[fileName stringByDeletingPathExtension] intValue];
+        
+        if (pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) {
+            [fileManager removeItemAtPath:[directoryPath stringByAppendingPathComponent:fileName] error:nil];
+        }
+    }
+    
+    [pool drain];
 }
 
-- (HPCacheItem *)cachedItemForURL:(NSURL *)url {
-	return [self cachedItemForCacheKey:[[url absoluteString] SHA1Hash]];
-}
+#pragma mark - Flat layout migration
 
-- (void)cacheData:(NSData *)cacheData
-      forCacheKey:(NSString *)cacheKey
-     withMIMEType:(NSString *)MIMEType
-         metaData:(NSDictionary *)metaData {
+- (void)migrateFlatFilesInIndex:(HPCacheIndex *)index {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
     
-	if (cacheData != nil) {
-		NSString *cachePath = [self cachePathForCacheKey:cacheKey];
-		
-		if (![[NSFileManager defaultManager] fileExistsAtPath:cachePath]) {
-			[_saveQueue addOperation:[[[NSInvocationOperation alloc]
-                                       initWithTarget:self
-                                       selector:@selector(storeCacheWithCacheItem:)
-                                       object:[HPCacheItem cacheItemWithCacheData:cacheData
-                                                                             path:cachePath
-                                                                         MIMEType:MIMEType
-                                                                            stamp:nil
-                                                                         metaData:metaData]] autorelease]];
-		}
+    for (NSString *fileName in [fileManager contentsOfDirectoryAtPath:index.directoryPath error:nil]) {
+        if ([fileName hasPrefix:@"."]) {
+            continue;
+        }
+        
+        BOOL isDirectory = NO;
+        NSString *flatPath = [index.directoryPath stringByAppendingPathComponent:fileName];
+        
+        if ([fileManager fileExistsAtPath:flatPath isDirectory:&isDirectory] && !isDirectory) {
+            [self migrateLegacyFileToPath:[self pathForKey:fileName inIndex:index]];
+        }
+    }
+    
+    [pool drain];
+}
+
+- (BOOL)migrateLegacyFileToPath:(NSString *)path {
+    if (_flatLayoutMigrated) {
+        return NO;
+    }
+    
+    NSString *flatPath = [[[path stringByDeletingLastPathComponent] stringByDeletingLastPathComponent] 
+                          stringByAppendingPathComponent:[path lastPathComponent]];
+    const char *flatFilePath = [flatPath fileSystemRepresentation];
+    
+    if (access(flatFilePath, F_OK) != 0 || !HPCacheCreateShardDirectoryForPath(path)) {
+        return NO;
+    }
+    
+    // Linking never replaces a file, so a newer copy written to the shard in 
+    // the meantime wins over the flat one
+    BOOL success = (link(flatFilePath, [path fileSystemRepresentation]) == 0);
+    
+    if (success || errno == EEXIST) {
+        unlink(flatFilePath);
+    }
+    
+    return success;
+}
+
+- (HPCacheItem *)cacheItemAtPath:(NSString *)path {
+    HPCacheTierCounters *memoryCounters = [self countersForTier:HPCacheTierMemory];
+    uint64_t startTime = mach_absolute_time();
+    
+    // Memory tier is keyed by the full path, which keeps cache and storage 
+    // entries with the same key apart
+    HPCacheItem *cachedItem = [_memoryCache objectForKey:path];
+    
+    [[self indexForPath:path] touchKey:[path lastPathComponent]];
+    
+    if (cachedItem != nil) {
+        HPCacheCountLookup(memoryCounters, startTime, [cachedItem.cacheData length], YES);
+        
+        [self recordAccessToPath:path];
+        
+        return cachedItem;
+    }
+    
+    // Serve writes that have not reached the disk yet
+    cachedItem = [self pendingItemForPath:path];
+    
+    if (cachedItem != nil) {
+        HPCacheCountLookup(memoryCounters, startTime, [cachedItem.cacheData length], YES);
+        
+        [self recordAccessToPath:path];
+        
+        return cachedItem;
+    }
+    
+    HPCacheCountLookup(memoryCounters, startTime, 0, NO);
+    
+    HPCacheTierCounters *diskCounters = [self countersForPath:path];
+    BOOL isLegacy = NO;
+    
+    startTime = mach_absolute_time();
+    cachedItem = [self readCacheItemAtPath:path options:NSDataReadingMappedIfSafe isLegacy:&isLegacy];
+	
+    if (cachedItem == nil && [self migrateLegacyFileToPath:path]) {
+        cachedItem = [self readCacheItemAtPath:path options:NSDataReadingMappedIfSafe isLegacy:&isLegacy];
+    }
+    
+    HPCacheCountLookup(diskCounters, startTime, [cachedItem.cacheData length], (cachedItem != nil));
+    
+	if (cachedItem == nil) {
+        return nil;
+    }
+    
+    if (isLegacy) {
+        // Rewrite keyed archive pickles in the raw format the first time they are read
+        [self enqueueWriteForCacheItem:cachedItem];
+    }
+    
+    [self addItemToMemoryCache:cachedItem];
+    [self recordAccessToPath:path];
+    
+    return cachedItem;
+}
+
+- (void)addItemToMemoryCache:(HPCacheItem *)cacheItem {
+    NSUInteger length = [cacheItem.cacheData length];
+    
+    [_memoryCache setObject:cacheItem forKey:cacheItem.cachePath cost:length];
+    
+    OSAtomicAdd64((int64_t)length, &[self countersForTier:HPCacheTierMemory]->bytesWritten);
+}
+
+#pragma mark - Access log
+
+- (void)recordAccessToPath:(NSString *)path {
+    HPCacheAccessLogShard *shard = &((HPCacheAccessLogShard *)_accessLogShards)[[path hash] % kAccessLogShardCount];
+    int64_t sequence = OSAtomicIncrement64Barrier(&_accessLogSequence);
+    NSString *replacedPath = nil;
+    
+    // Every hit lands here, so it only overwrites the oldest slot of its ring
+    pthread_mutex_lock(&shard->lock);
+    
+    HPCacheAccessRecord *record = &shard->records[shard->cursor];
+    
+    replacedPath = record->path;
+    record->path = [path retain];
+    record->sequence = sequence;
+    
+    shard->cursor = (shard->cursor + 1) % kAccessLogShardCapacity;
+    
+    pthread_mutex_unlock(&shard->lock);
+    
+    [replacedPath release];
+}
+
+- (void)writeAccessLog {
+    HPCacheAccessRecord *records = calloc(kAccessLogShardCount * kAccessLogShardCapacity, sizeof(HPCacheAccessRecord));
+    NSUInteger recordCount = 0;
+    
+    for (NSUInteger i = 0; i < kAccessLogShardCount; i++) {
+        HPCacheAccessLogShard *shard = &((HPCacheAccessLogShard *)_accessLogShards)[i];
+        
+        pthread_mutex_lock(&shard->lock);
+        
+        for (NSUInteger j = 0; j < kAccessLogShardCapacity; j++) {
+            if (shard->records[j].path != nil) {
+                records[recordCount].path = [shard->records[j].path retain];
+                records[recordCount].sequence = shard->records[j].sequence;
+                
+                recordCount += 1;
+            }
+        }
+        
+        pthread_mutex_unlock(&shard->lock);
+    }
+    
+    qsort(records, recordCount, sizeof(HPCacheAccessRecord), HPCacheCompareAccessRecords);
+    
+    // Keep the most recent hit of each path, with the most recent at the end
+    NSMutableOrderedSet *recentPaths = [NSMutableOrderedSet orderedSetWithCapacity:kAccessLogCapacity];
+    
+    for (NSUInteger i = 0; i < recordCount; i++) {
+        if ([recentPaths count] < kAccessLogCapacity) {
+            [recentPaths addObject:records[i].path];
+        }
+        
+        [records[i].path release];
+    }
+    
+    free(records);
+    
+    NSArray *paths = [[recentPaths reversedOrderedSet] array];
+    
+    // Keys are stored without the directory, which changes between app updates
+    NSMutableArray *cacheKeys = [NSMutableArray arrayWithCapacity:[paths count]];
+    NSMutableArray *storageKeys = [NSMutableArray array];
+    
+    for (NSString *path in paths) {
+        HPCacheIndex *index = [self indexForPath:path];
+        
+        if (index == _cacheIndex) {
+            [cacheKeys addObject:[path lastPathComponent]];
+        } else if (index == _storageIndex) {
+            [storageKeys addObject:[path lastPathComponent]];
+        }
+    }
+    
+    NSDictionary *accessLog = [NSDictionary dictionaryWithObjectsAndKeys:cacheKeys, kAccessLogCacheKey, 
+                               storageKeys, kAccessLogStorageKey, nil];
+    NSData *logData = [NSPropertyListSerialization dataWithPropertyList:accessLog 
+                                                                 format:NSPropertyListBinaryFormat_v1_0 
+                                                                options:0 
+                                                                  error:nil];
+    
+    [logData writeToFile:[_cacheDirectoryPath stringByAppendingPathComponent:kAccessLogFilename] atomically:YES];
+}
+
+- (void)warmUpFromAccessLog {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSDictionary *accessLog = [NSDictionary dictionaryWithContentsOfFile:[_cacheDirectoryPath stringByAppendingPathComponent:kAccessLogFilename]];
+    NSArray *logKeys = [NSArray arrayWithObjects:kAccessLogCacheKey, kAccessLogStorageKey, nil];
+    NSArray *indexes = [NSArray arrayWithObjects:_cacheIndex, _storageIndex, nil];
+    NSMutableArray *paths = [NSMutableArray arrayWithCapacity:kAccessLogCapacity];
+    unsigned long long budget = (unsigned long long)(_memoryCache.totalCostLimit * kWarmUpMemoryFraction);
+    unsigned long long plannedSize = 0;
+    
+    // Cache keys get the budget first and storage keys fill what is left, in 
+    // the same order on every launch
+    for (NSUInteger i = 0; i < [logKeys count]; i++) {
+        HPCacheIndex *index = [indexes objectAtIndex:i];
+        NSArray *keys = [accessLog objectForKey:[logKeys objectAtIndex:i]];
+        
+        if (![keys isKindOfClass:[NSArray class]]) {
+            continue;
+        }
+        
+        // Most recent hits first, until the budget is used up
+        for (NSString *key in [keys reverseObjectEnumerator]) {
+            HPCacheIndexEntry *entry = [index entryForKey:key];
+            
+            if (entry == nil || plannedSize + entry.size > budget) {
+                continue;
+            }
+            
+            plannedSize += entry.size;
+            
+            [paths addObject:[self pathForKey:key inIndex:index]];
+        }
+    }
+    
+    // Read in path order, so files in the same shard are read back to back. 
+    // Files are read into memory rather than mapped, so first hits never 
+    // fault pages in from disk.
+    for (NSString *path in [paths sortedArrayUsingSelector:@selector(compare:)]) {
+        if ([_memoryCache containsObjectForKey:path] || [self pendingItemForPath:path] != nil) {
+            continue;
+        }
+        
+        BOOL isLegacy = NO;
+        HPCacheItem *cachedItem = [self readCacheItemAtPath:path options:0 isLegacy:&isLegacy];
+        
+        if (cachedItem == nil) {
+            continue;
+        }
+        
+        if (isLegacy) {
+            [self enqueueWriteForCacheItem:cachedItem];
+        }
+        
+        [self addItemToMemoryCache:cachedItem];
+    }
+    
+    [pool drain];
+}
+
+- (HPCacheItem *)readCacheItemAtPath:(NSString *)path options:(NSDataReadingOptions)options isLegacy:(BOOL *)isLegacy {
+    NSData *fileData = [NSData dataWithContentsOfFile:path 
+                                              options:options 
+                                                error:nil];
+    
+    if (fileData == nil) {
+        return nil;
+    }
+    
+    NSUInteger fileLength = [fileData length];
+    HPCacheFileTrailer trailer;
+    
+    if (fileLength >= sizeof(trailer)) {
+        memcpy(&trailer, (const uint8_t *)[fileData bytes] + fileLength - sizeof(trailer), sizeof(trailer));
+        
+        if (trailer.magic == kCacheFileMagic 
+            && trailer.version == kCacheFileVersion 
+            && (trailer.flags & ~kCacheFileFlagCompressed) == 0 
+            && trailer.bodyLength + trailer.metadataLength + sizeof(trailer) == fileLength) {
+            NSData *metadata = [fileData subdataWithRange:NSMakeRange((NSUInteger)trailer.bodyLength, trailer.metadataLength)];
+            NSDictionary *info = [NSPropertyListSerialization propertyListWithData:metadata 
+                                                                           options:NSPropertyListImmutable 
+                                                                            format:NULL 
+                                                                             error:nil];
+            
+            if (![info isKindOfClass:[NSDictionary class]]) {
+                return nil;
+            }
+            
+            if (isLegacy != NULL) {
+                *isLegacy = NO;
+            }
+            
+            NSData *body = nil;
+            
+            if (trailer.flags & kCacheFileFlagCompressed) {
+                NSNumber *contentLength = [info objectForKey:kCacheInfoContentLengthKey];
+                
+                if (![contentLength isKindOfClass:[NSNumber class]]) {
+                    return nil;
+                }
+                
+                NSData *inflatedData = HPCacheInflateBytes([fileData bytes], (NSUInteger)trailer.bodyLength, 
+                                                           [contentLength unsignedIntegerValue]);
+                
+                if (inflatedData == nil) {
+                    return nil;
+                }
+                
+                // The inflated buffer is private to this read, so the item 
+                // adopts it through an immutable view instead of copying it
+                body = [[HPCacheSliceData alloc] initWithData:inflatedData 
+                                                        range:NSMakeRange(0, [inflatedData length])];
+            } else {
+                body = [[HPCacheSliceData alloc] initWithData:fileData 
+                                                        range:NSMakeRange(0, (NSUInteger)trailer.bodyLength)];
+            }
+            
+            HPCacheItem *cacheItem = [HPCacheItem cacheItemWithCacheData:body 
+                                                                    path:path 
+                                                                MIMEType:[info objectForKey:kCacheInfoMIMETypeKey] 
+                                                                   stamp:[info objectForKey:kCacheInfoDateKey] 
+                                                                metaData:[info objectForKey:kCacheInfoMetaDataKey] 
+                                                          expirationDate:[info objectForKey:kCacheInfoExpirationDateKey] 
+                                                               entityTag:[info objectForKey:kCacheInfoEntityTagKey] 
+                                                            lastModified:[info objectForKey:kCacheInfoLastModifiedKey]];
+            
+            [body release];
+            
+            return cacheItem;
+        }
+    }
+    
+    // Fall back to the keyed archive format used by earlier versions
+    NSDictionary *pickle = nil;
+    
+    @try {
+        pickle = [NSKeyedUnarchiver unarchiveObjectWithData:fileData];
+    }
+    @catch (NSException *exception) {
+        pickle = nil;
+    }
+    
+    if (![pickle isKindOfClass:[NSDictionary class]]) {
+        return nil;
+    }
+    
+    if (isLegacy != NULL) {
+        *isLegacy = YES;
+    }
+    
+    return [HPCacheItem cacheItemWithCacheData:[pickle objectForKey:kCacheInfoDataKey] 
+                                          path:path 
+                                      MIMEType:[pickle objectForKey:kCacheInfoMIMETypeKey] 
+                                         stamp:[pickle objectForKey:kCacheInfoDateKey] 
+                                      metaData:[pickle objectForKey:kCacheInfoMetaDataKey]];
+}
+
+- (NSMutableDictionary *)infoForCacheItem:(HPCacheItem *)cacheItem {
+    NSMutableDictionary *info = [NSMutableDictionary dictionaryWithCapacity:7];
+    
+    if (cacheItem.timeStamp != nil) {
+        [info setObject:cacheItem.timeStamp forKey:kCacheInfoDateKey];
+    }
+    
+    if (cacheItem.MIMEType != nil) {
+        [info setObject:cacheItem.MIMEType forKey:kCacheInfoMIMETypeKey];
+    }
+    
+    if (cacheItem.metaData != nil) {
+        [info setObject:cacheItem.metaData forKey:kCacheInfoMetaDataKey];
+    }
+    
+    if (cacheItem.expirationDate != nil) {
+        [info setObject:cacheItem.expirationDate forKey:kCacheInfoExpirationDateKey];
+    }
+    
+    if (cacheItem.entityTag != nil) {
+        [info setObject:cacheItem.entityTag forKey:kCacheInfoEntityTagKey];
+    }
+    
+    if (cacheItem.lastModified != nil) {
+        [info setObject:cacheItem.lastModified forKey:kCacheInfoLastModifiedKey];
+    }
+    
+    return info;
+}
+
+- (BOOL)writeCacheItem:(HPCacheItem *)cacheItem toPath:(NSString *)path fileSize:(unsigned long long *)fileSize {
+    NSMutableDictionary *info = [self infoForCacheItem:cacheItem];
+    NSData *body = cacheItem.cacheData;
+    uint16_t flags = 0;
+    
+    if ([body length] >= kCacheCompressionMinimumLength && [self compressesDataForMIMEType:cacheItem.MIMEType]) {
+        NSData *compressedBody = HPCacheDeflateData(body);
+        
+        if (compressedBody != nil) {
+            [info setObject:[NSNumber numberWithUnsignedInteger:[body length]] forKey:kCacheInfoContentLengthKey];
+            
+            body = compressedBody;
+            flags |= kCacheFileFlagCompressed;
+        }
+    }
+    
+    NSError *error = nil;
+    NSData *metadata = [NSPropertyListSerialization dataWithPropertyList:info 
+                                                                  format:NSPropertyListBinaryFormat_v1_0 
+                                                                 options:0 
+                                                                   error:&error];
+    
+    if (metadata == nil) {
+        NSLog(@">>> CACHE WRITE ERROR: %@", error);
+        
+        return NO;
+    }
+    
+    HPCacheFileTrailer trailer;
+    
+    trailer.bodyLength = [body length];
+    trailer.metadataLength = (uint32_t)[metadata length];
+    trailer.flags = flags;
+    trailer.version = kCacheFileVersion;
+    trailer.magic = kCacheFileMagic;
+    
+    // Write to a temporary file and rename it into place, so readers that have 
+    // the previous version mapped never see a partially written file
+    // Temporary files are named after the process, so processes sharing the 
+    // directory never write into each other's files
+    NSString *temporaryPath = [self temporaryPathInIndex:[self indexForPath:path]];
+    int fd = open([temporaryPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    // The temporary directory is created on first use, like the shards
+    if (fd < 0 && errno == ENOENT && HPCacheCreateShardDirectoryForPath(temporaryPath)) {
+        fd = open([temporaryPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    
+    if (fd < 0) {
+        return NO;
+    }
+    
+    struct iovec vector[3];
+    
+    vector[0].iov_base = (void *)[body bytes];
+    vector[0].iov_len = [body length];
+    vector[1].iov_base = (void *)[metadata bytes];
+    vector[1].iov_len = [metadata length];
+    vector[2].iov_base = &trailer;
+    vector[2].iov_len = sizeof(trailer);
+    
+    BOOL success = HPCacheFileWriteVector(fd, vector, 3);
+    
+    if (close(fd) != 0) {
+        success = NO;
+    }
+    
+    unsigned long long writtenSize = trailer.bodyLength + trailer.metadataLength + sizeof(trailer);
+    
+    if (success) {
+        // Writes that were replaced or cancelled while they were on their way 
+        // to disk, for instance by an adopted download, must not overwrite the 
+        // newer file. Replacements happen under the same lock, so checking, 
+        // renaming and indexing under it lets the newer body always win.
+        [_pendingWritesLock lock];
+        
+        success = ([_pendingWrites objectForKey:path] == cacheItem 
+                   && HPCacheMoveFileIntoShard(temporaryPath, path));
+        
+        if (success) {
+            [self indexCacheItem:cacheItem fileSize:writtenSize];
+        }
+        
+        [_pendingWritesLock unlock];
+    }
+    
+    if (!success) {
+        unlink([temporaryPath fileSystemRepresentation]);
+        
+        return NO;
+    }
+    
+    if (fileSize != NULL) {
+        *fileSize = writtenSize;
+    }
+    
+    return YES;
+}
+
+- (HPCacheItem *)storedItemForStorageKey:(NSString *)storageKey {
+    return [self cacheItemAtPath:[self storagePathForStorageKey:storageKey]];
+}
+
+- (void)storedItemForStorageKey:(NSString *)storageKey 
+                     completion:(void (^)(HPCacheItem *cacheItem))completion {
+    dispatch_async(_readQueue, ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        
+        completion([self storedItemForStorageKey:storageKey]);
+        
+        [pool drain];
+    });
+}
+
+- (void)storeData:(NSData *)storageData
+    forStorageKey:(NSString *)storageKey
+     withMIMEType:(NSString *)MIMEType
+         metaData:(NSDictionary *)metaData {
+    if (storageData != nil) {
+		NSString *storagePath = [self storagePathForStorageKey:storageKey];
+        HPCacheItem *storageItem = [HPCacheItem cacheItemWithCacheData:storageData
+                                                                   path:storagePath
+                                                               MIMEType:MIMEType
+                                                                  stamp:nil
+                                                               metaData:metaData];
+        
+        [self addItemToMemoryCache:storageItem];
+        
+        [self enqueueWriteForCacheItem:storageItem];
+	}
+}
+
+- (void)storeData:(NSData *)storageData
+    forStorageKey:(NSString *)storageKey
+     withMIMEType:(NSString *)MIMEType {
+
+    [self storeData:storageData
+      forStorageKey:storageKey
+       withMIMEType:MIMEType
+           metaData:nil];
+}
+
+- (BOOL)hasCachedItemForCacheKey:(NSString *)cacheKey {
+    NSString *cachePath = [self cachePathForCacheKey:cacheKey];
+    
+    // Items in the memory tier are either on disk and indexed, or still waiting 
+    // to be written, since failed writes drop them from the memory tier. So a 
+    // definite miss in the index filter only leaves the pending writes to 
+    // check. The filter answers YES until the index loads.
+    if (![_cacheIndex mayContainKey:cacheKey]) {
+        // Another process sharing the container may have stored it since, 
+        // later lookups find it once the index has caught up
+        [_cacheIndex refreshFromSharedLog];
+        
+        return ([self pendingItemForPath:cachePath] != nil);
+    }
+    
+    if ([_memoryCache containsObjectForKey:cachePath] || [self pendingItemForPath:cachePath] != nil) {
+        return YES;
+    }
+    
+    if ([_cacheIndex isLoaded]) {
+        return [_cacheIndex containsKey:cacheKey];
+    }
+    
+    return ([[NSFileManager defaultManager] fileExistsAtPath:cachePath] || [self migrateLegacyFileToPath:cachePath]);
+}
+
+- (HPCacheItem *)cachedItemForCacheKey:(NSString *)cacheKey {
+    return [self cachedItemForCacheKey:cacheKey allowStale:NO];
+}
+
+- (HPCacheItem *)cachedItemForCacheKey:(NSString *)cacheKey allowStale:(BOOL)allowStale {
+    uint64_t startTime = mach_absolute_time();
+    
+    if (![self hasCachedItemForCacheKey:cacheKey]) {
+        // Misses answered by the index never reach the tiers, but still count 
+        // as a miss in both
+        HPCacheCountLookup([self countersForTier:HPCacheTierMemory], startTime, 0, NO);
+        HPCacheCountLookup([self countersForTier:HPCacheTierCache], startTime, 0, NO);
+        
+        return nil;
+    }
+    
+	HPCacheItem *cachedItem = [self cacheItemAtPath:[self cachePathForCacheKey:cacheKey]];
+	
+	if (cachedItem != nil && [cachedItem isStale] && !allowStale) {
+        // Stale items are only worth keeping if they can be revalidated
+        if (![cachedItem hasValidators]) {
+			[self clearCacheForCacheKey:cacheKey];
+        }
+        
+        return nil;
+	}
+    
+    return cachedItem;
+}
+
+- (void)setCompressesData:(BOOL)compressesData forMIMEType:(NSString *)MIMEType {
+    @synchronized(_compressedMIMETypes) {
+        if (compressesData) {
+            [_compressedMIMETypes addObject:[MIMEType lowercaseString]];
+        } else {
+            [_compressedMIMETypes removeObject:[MIMEType lowercaseString]];
+        }
+    }
+}
+
+- (BOOL)compressesDataForMIMEType:(NSString *)MIMEType {
+    NSString *type = [MIMEType lowercaseString];
+    
+    // Images are already compressed
+    if (type == nil || [type hasPrefix:@"image/"]) {
+        return NO;
+    }
+    
+    NSRange separatorRange = [type rangeOfString:@"/"];
+    NSString *wildcardType = nil;
+    
+    if (separatorRange.location != NSNotFound) {
+        wildcardType = [[type substringToIndex:separatorRange.location] stringByAppendingString:@"/*"];
+    }
+    
+    @synchronized(_compressedMIMETypes) {
+        return ([_compressedMIMETypes containsObject:type] 
+                || (wildcardType != nil && [_compressedMIMETypes containsObject:wildcardType]));
+    }
+}
+
+- (void)setCacheKeyHash:(HPCacheKeyHash)cacheKeyHash {
+    if (cacheKeyHash == _cacheKeyHash) {
+        return;
+    }
+    
+    _cacheKeyHash = cacheKeyHash;
+    
+    [_cacheKeys removeAllObjects];
+}
+
+- (NSString *)cacheKeyForURLString:(NSString *)URLString {
+    if (URLString == nil) {
+        return nil;
+    }
+    
+    NSString *cacheKey = [_cacheKeys objectForKey:URLString];
+    
+    if (cacheKey != nil) {
+        return cacheKey;
+    }
+    
+    NSURL *url = [NSURL URLWithString:URLString];
+    NSString *canonicalString = (url != nil) ? [url canonicalString] : URLString;
+    
+    switch (_cacheKeyHash) {
+        case HPCacheKeyHashFast:
+            cacheKey = [canonicalString fastHash];
+            break;
+        default:
+            cacheKey = [canonicalString SHA1Hash];
+            break;
+    }
+    
+    [_cacheKeys setObject:cacheKey forKey:URLString cost:1];
+    
+    return cacheKey;
+}
+
+- (NSString *)cacheKeyForURL:(NSURL *)url {
+    return [self cacheKeyForURLString:[url absoluteString]];
+}
+
+- (BOOL)hasCachedItemForURL:(NSURL *)url {
+    return [self hasCachedItemForCacheKey:[self cacheKeyForURL:url]];
+}
+
+- (HPCacheItem *)cachedItemForURL:(NSURL *)url {
+	return [self cachedItemForCacheKey:[self cacheKeyForURL:url]];
+}
+
+- (HPCacheItem *)cachedItemForURL:(NSURL *)url allowStale:(BOOL)allowStale {
+	return [self cachedItemForCacheKey:[self cacheKeyForURL:url] allowStale:allowStale];
+}
+
+- (void)cachedItemForCacheKey:(NSString *)cacheKey 
+                   allowStale:(BOOL)allowStale 
+                   completion:(void (^)(HPCacheItem *cacheItem))completion {
+    dispatch_async(_readQueue, ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        
+        completion([self cachedItemForCacheKey:cacheKey allowStale:allowStale]);
+        
+        [pool drain];
+    });
+}
+
+- (void)cachedItemForURL:(NSURL *)url 
+              allowStale:(BOOL)allowStale 
+              completion:(void (^)(HPCacheItem *cacheItem))completion {
+    [self cachedItemForCacheKey:[self cacheKeyForURL:url] 
+                     allowStale:allowStale 
+                     completion:completion];
+}
+
+- (void)cacheData:(NSData *)cacheData
+      forCacheKey:(NSString *)cacheKey
+     withMIMEType:(NSString *)MIMEType
+         metaData:(NSDictionary *)metaData {
+    
+	if (cacheData != nil) {
+		NSString *cachePath = [self cachePathForCacheKey:cacheKey];
+		
+		if (![self hasCachedItemForCacheKey:cacheKey]) {
+            HPCacheItem *cacheItem = [HPCacheItem cacheItemWithCacheData:cacheData
+                                                                     path:cachePath
+                                                                 MIMEType:MIMEType
+                                                                    stamp:nil
+                                                                 metaData:metaData];
+            
+            [self addItemToMemoryCache:cacheItem];
+            
+            [self enqueueWriteForCacheItem:cacheItem];
+		}
 	}
 }
 
@@ -404,7 +1711,7 @@ static HPCacheManager *_sharedManager = nil;
     
 	if (cacheData != nil) {
 		[self cacheData:cacheData
-			forCacheKey:[[url absoluteString] SHA1Hash]
+			forCacheKey:[self cacheKeyForURL:url]
 		   withMIMEType:MIMEType
                metaData:metaData];
 	}
@@ -420,21 +1727,303 @@ static HPCacheManager *_sharedManager = nil;
            metaData:nil];
 }
 
+- (void)cacheData:(NSData *)cacheData
+           forURL:(NSURL *)url
+         response:(NSHTTPURLResponse *)response {
+    NSString *cacheKey = [self cacheKeyForURL:url];
+    BOOL storable = YES;
+    NSDate *expirationDate = HPCacheExpirationDateForResponse(response, &storable);
+    
+    if (!storable) {
+        [self clearCacheForCacheKey:cacheKey];
+        
+        return;
+    }
+    
+    if (cacheData == nil) {
+        return;
+    }
+    
+    // Adopt the connection buffer instead of letting the item copy it, so 
+    // the body is only held in memory once from download to disk
+    if ([cacheData isKindOfClass:[NSMutableData class]]) {
+        cacheData = [[[HPCacheSliceData alloc] initWithData:cacheData 
+                                                      range:NSMakeRange(0, [cacheData length])] autorelease];
+    }
+    
+    NSString *cachePath = [self cachePathForCacheKey:cacheKey];
+    HPCacheItem *cacheItem = [HPCacheItem cacheItemWithCacheData:cacheData 
+                                                            path:cachePath 
+                                                        MIMEType:[response MIMEType] 
+                                                           stamp:nil 
+                                                        metaData:nil 
+                                                  expirationDate:expirationDate 
+                                                       entityTag:HPCacheHeaderValue(response, @"ETag") 
+                                                    lastModified:HPCacheHeaderValue(response, @"Last-Modified")];
+    
+    [self addItemToMemoryCache:cacheItem];
+    
+    [self enqueueWriteForCacheItem:cacheItem];
+}
+
+- (NSString *)temporaryPathForURL:(NSURL *)url {
+    // Shares the directory and naming of the temporary files of writes, so 
+    // files of downloads that never finished are cleaned up once their process 
+    // is gone
+    NSString *temporaryPath = [self temporaryPathInIndex:_cacheIndex];
+    
+    if (!HPCacheCreateShardDirectoryForPath(temporaryPath)) {
+        return nil;
+    }
+    
+    return temporaryPath;
+}
+
+- (HPCacheItem *)cacheFileAtPath:(NSString *)filePath 
+                          forURL:(NSURL *)url 
+                        response:(NSHTTPURLResponse *)response {
+    NSString *cacheKey = [self cacheKeyForURL:url];
+    BOOL storable = YES;
+    NSDate *expirationDate = HPCacheExpirationDateForResponse(response, &storable);
+    
+    if (!storable) {
+        [self clearCacheForCacheKey:cacheKey];
+        
+        return nil;
+    }
+    
+    NSString *cachePath = [self cachePathForCacheKey:cacheKey];
+    HPCacheItem *cacheItem = [HPCacheItem cacheItemWithCacheData:nil 
+                                                            path:cachePath 
+                                                        MIMEType:[response MIMEType] 
+                                                           stamp:nil 
+                                                        metaData:nil 
+                                                  expirationDate:expirationDate 
+                                                       entityTag:HPCacheHeaderValue(response, @"ETag") 
+                                                    lastModified:HPCacheHeaderValue(response, @"Last-Modified")];
+    
+    NSError *error = nil;
+    NSData *metadata = [NSPropertyListSerialization dataWithPropertyList:[self infoForCacheItem:cacheItem] 
+                                                                  format:NSPropertyListBinaryFormat_v1_0 
+                                                                 options:0 
+                                                                   error:&error];
+    
+    if (metadata == nil) {
+        NSLog(@">>> CACHE WRITE ERROR: %@", error);
+        
+        return nil;
+    }
+    
+    struct stat fileStatus;
+    const char *fileSystemPath = [filePath fileSystemRepresentation];
+    int fd = open(fileSystemPath, O_WRONLY | O_APPEND);
+    
+    if (fd < 0) {
+        return nil;
+    }
+    
+    if (fstat(fd, &fileStatus) != 0) {
+        close(fd);
+        
+        return nil;
+    }
+    
+    // The downloaded file already is the body, adding the metadata and the 
+    // trailer turns it into a cache file that is uncompressed on disk
+    HPCacheFileTrailer trailer;
+    
+    trailer.bodyLength = fileStatus.st_size;
+    trailer.metadataLength = (uint32_t)[metadata length];
+    trailer.flags = 0;
+    trailer.version = kCacheFileVersion;
+    trailer.magic = kCacheFileMagic;
+    
+    struct iovec vector[2];
+    
+    vector[0].iov_base = (void *)[metadata bytes];
+    vector[0].iov_len = [metadata length];
+    vector[1].iov_base = &trailer;
+    vector[1].iov_len = sizeof(trailer);
+    
+    BOOL success = HPCacheFileWriteVector(fd, vector, 2);
+    
+    if (close(fd) != 0) {
+        success = NO;
+    }
+    
+    unsigned long long fileSize = trailer.bodyLength + trailer.metadataLength + sizeof(trailer);
+    
+    if (success) {
+        // Older data queued for the same URL is dropped, and a write of it that 
+        // is already in progress finds its pending entry gone before renaming
+        [_pendingWritesLock lock];
+        
+        [_pendingWrites removeObjectForKey:cachePath];
+        
+        success = HPCacheMoveFileIntoShard(filePath, cachePath);
+        
+        if (success) {
+            [self indexCacheItem:cacheItem fileSize:fileSize];
+        }
+        
+        [_pendingWritesLock unlock];
+    }
+    
+    if (!success) {
+        // Hand the file back the way it was
+        truncate(fileSystemPath, fileStatus.st_size);
+        
+        return nil;
+    }
+    
+    [_memoryCache removeObjectForKey:cachePath];
+    
+    [self didStoreCacheItem:cacheItem fileSize:fileSize];
+    
+    // Large downloads are not added to the memory tier, reading the file back 
+    // maps it instead of loading it
+    return [self readCacheItemAtPath:cachePath options:NSDataReadingMappedIfSafe isLegacy:NULL];
+}
+
+- (HPCacheItem *)refreshCachedItem:(HPCacheItem *)cacheItem 
+                      withResponse:(NSHTTPURLResponse *)response {
+    NSString *entityTag = HPCacheHeaderValue(response, @"ETag");
+    NSString *lastModified = HPCacheHeaderValue(response, @"Last-Modified");
+    HPCacheItem *refreshedItem = [HPCacheItem cacheItemWithCacheData:cacheItem.cacheData 
+                                                                path:cacheItem.cachePath 
+                                                            MIMEType:cacheItem.MIMEType 
+                                                               stamp:nil 
+                                                            metaData:cacheItem.metaData 
+                                                      expirationDate:HPCacheExpirationDateForResponse(response, NULL) 
+                                                           entityTag:(entityTag != nil) ? entityTag : cacheItem.entityTag 
+                                                        lastModified:(lastModified != nil) ? lastModified : cacheItem.lastModified];
+    
+    [self addItemToMemoryCache:refreshedItem];
+    
+    [self enqueueWriteForCacheItem:refreshedItem];
+    
+    return refreshedItem;
+}
+
+#pragma mark - Pending writes
+
+- (HPCacheItem *)pendingItemForPath:(NSString *)path {
+    [_pendingWritesLock lock];
+    HPCacheItem *cacheItem = [[_pendingWrites objectForKey:path] retain];
+    [_pendingWritesLock unlock];
+    
+    return [cacheItem autorelease];
+}
+
+- (void)enqueueWriteForCacheItem:(HPCacheItem *)cacheItem {
+    BOOL needsFlush = NO;
+    
+    [_pendingWritesLock lock];
+    
+    // A newer write for the same path replaces the queued one instead of 
+    // being written separately
+    [_pendingWrites setObject:cacheItem forKey:cacheItem.cachePath];
+    
+    if (!_flushScheduled) {
+        _flushScheduled = YES;
+        needsFlush = YES;
+    }
+    
+    [_pendingWritesLock unlock];
+    
+    if (needsFlush) {
+        [_saveQueue addOperation:[[[NSInvocationOperation alloc]
+                                   initWithTarget:self
+                                   selector:@selector(flushPendingWrites)
+                                   object:nil] autorelease]];
+    }
+}
+
+- (void)cancelPendingWriteForPath:(NSString *)path {
+    [_pendingWritesLock lock];
+    [_pendingWrites removeObjectForKey:path];
+    [_pendingWritesLock unlock];
+}
+
+- (void)flushPendingWrites {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    // Items stay in the table while they are written so reads keep finding 
+    // them, writes that arrive in the meantime schedule another flush
+    [_pendingWritesLock lock];
+    
+    NSArray *cacheItems = [_pendingWrites allValues];
+    
+    _flushScheduled = NO;
+    
+    [_pendingWritesLock unlock];
+    
+    for (HPCacheItem *cacheItem in cacheItems) {
+        [_pendingWritesLock lock];
+        BOOL isCurrent = ([_pendingWrites objectForKey:cacheItem.cachePath] == cacheItem);
+        [_pendingWritesLock unlock];
+        
+        if (!isCurrent) {
+            continue;
+        }
+        
+        [self storeCacheWithCacheItem:cacheItem];
+        
+        [_pendingWritesLock lock];
+        
+        if ([_pendingWrites objectForKey:cacheItem.cachePath] == cacheItem) {
+            [_pendingWrites removeObjectForKey:cacheItem.cachePath];
+        }
+        
+        [_pendingWritesLock unlock];
+    }
+    
+    [pool drain];
+}
+
 - (void)storeCacheWithCacheItem:(HPCacheItem *)cacheItem {
 	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
 
-	[NSKeyedArchiver archiveRootObject:[cacheItem pickledObjectForArchive] 
-								toFile:cacheItem.cachePath];
+    unsigned long long fileSize = 0;
     
-    [self addSkipBackupAttributeToItemAtURL:[NSURL URLWithString:cacheItem.cachePath]];
+	if ([self writeCacheItem:cacheItem toPath:cacheItem.cachePath fileSize:&fileSize]) {
+        [self didStoreCacheItem:cacheItem fileSize:fileSize];
+    } else {
+        // Lookups trust a definite miss in the index filter, so an item that 
+        // never made it to the disk cannot stay in the memory tier either
+        [_memoryCache removeObjectForKey:cacheItem.cachePath];
+    }
 	
 	[pool drain];
 }
 
+// Must be called with the pending writes lock held, right after the file was 
+// renamed into place, so index updates happen in the same order as renames
+- (void)indexCacheItem:(HPCacheItem *)cacheItem fileSize:(unsigned long long)fileSize {
+    [[self indexForPath:cacheItem.cachePath] addEntry:[HPCacheIndexEntry entryWithKey:[cacheItem.cachePath lastPathComponent] 
+                                                                                  size:fileSize 
+                                                                             timeStamp:[cacheItem.timeStamp timeIntervalSinceReferenceDate] 
+                                                                        expirationTime:[cacheItem.expirationDate timeIntervalSinceReferenceDate] 
+                                                                              MIMEType:cacheItem.MIMEType]];
+}
+
+- (void)didStoreCacheItem:(HPCacheItem *)cacheItem fileSize:(unsigned long long)fileSize {
+    OSAtomicAdd64((int64_t)fileSize, &[self countersForPath:cacheItem.cachePath]->bytesWritten);
+    
+    [self addSkipBackupAttributeToItemAtURL:[NSURL fileURLWithPath:cacheItem.cachePath]];
+    
+    [self scheduleEvictionIfNeeded];
+}
+
 - (void)clearCacheForCacheKey:(NSString *)cacheKey {
 	NSError *error;
 	NSString *cachePath = [self cachePathForCacheKey:cacheKey];
 	NSFileManager *fileManager = [NSFileManager defaultManager];
+    
+    [self cancelPendingWriteForPath:cachePath];
+    [_memoryCache removeObjectForKey:cachePath];
+    [_cacheIndex removeEntryForKey:cacheKey];
+    [self migrateLegacyFileToPath:cachePath];
 
 	if ([fileManager fileExistsAtPath:cachePath]) {
 		if (![fileManager removeItemAtPath:cachePath error:&error]) {
@@ -444,12 +2033,377 @@ static HPCacheManager *_sharedManager = nil;
 }
 
 - (void)clearCacheForURL:(NSURL *)url {
-	[self clearCacheForCacheKey:[[url absoluteString] SHA1Hash]];
+	[self clearCacheForCacheKey:[self cacheKeyForURL:url]];
+}
+
+#pragma mark - Sweeping
+
+- (void)beginForegroundActivity {
+    OSAtomicIncrement32Barrier(&_foregroundActivityCount);
+}
+
+- (void)endForegroundActivity {
+    OSAtomicDecrement32Barrier(&_foregroundActivityCount);
+}
+
+- (void)startSweepForEntriesExpiredBeforeDate:(NSDate *)date {
+    NSMutableDictionary *shards = [[NSMutableDictionary alloc] init];
+    
+    for (HPCacheIndexEntry *entry in [_cacheIndex entriesExpiredBeforeDate:date]) {
+        NSNumber *shardIndex = [NSNumber numberWithUnsignedInteger:HPCacheShardIndexForKey(entry.key)];
+        NSMutableArray *keys = [shards objectForKey:shardIndex];
+        
+        if (keys == nil) {
+            keys = [NSMutableArray array];
+            
+            [shards setObject:keys forKey:shardIndex];
+        }
+        
+        [keys addObject:entry.key];
+    }
+    
+    NSString *cursor = [NSString stringWithContentsOfFile:[_cacheDirectoryPath stringByAppendingPathComponent:kSweepCursorFilename] 
+                                                 encoding:NSUTF8StringEncoding 
+                                                    error:nil];
+    NSUInteger shardIndex = (NSUInteger)MAX([cursor integerValue], 0) % kCacheShardCount;
+    NSTimeInterval sweepTime = [date timeIntervalSinceReferenceDate];
+    
+    // All sweep state is owned by the eviction queue from here on
+    dispatch_async(_evictionQueue, ^{
+        [_sweepShards release];
+        
+        _sweepShards = shards;
+        _sweepShardIndex = shardIndex;
+        _sweepShardsRemaining = kCacheShardCount;
+        _sweepTime = sweepTime;
+        
+        [self sweepNextBatch];
+    });
+}
+
+- (void)sweepNextBatch {
+    if (_sweepShardsRemaining == 0) {
+        [_sweepShards release], _sweepShards = nil;
+        
+        return;
+    }
+    
+    // Stay off the disk while requests are loading
+    if (_foregroundActivityCount > 0) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kSweepPauseInterval * NSEC_PER_SEC)), _evictionQueue, ^{
+            [self sweepNextBatch];
+        });
+        
+        return;
+    }
+    
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kSweepTickBudget;
+    NSUInteger batchCount = 0;
+    
+    while (_sweepShardsRemaining > 0 && batchCount < kSweepBatchSize && CFAbsoluteTimeGetCurrent() < deadline) {
+        NSMutableArray *keys = [_sweepShards objectForKey:[NSNumber numberWithUnsignedInteger:_sweepShardIndex]];
+        
+        if ([keys count] == 0) {
+            [self advanceSweepShard];
+            
+            continue;
+        }
+        
+        NSString *key = [[[keys lastObject] retain] autorelease];
+        
+        [keys removeLastObject];
+        
+        // Skip entries that were refreshed since the sweep started
+        HPCacheIndexEntry *entry = [_cacheIndex entryForKey:key];
+        
+        if (entry != nil && entry.expirationTime < _sweepTime) {
+            [self clearCacheForCacheKey:key];
+            
+            OSAtomicIncrement64(&[self countersForTier:HPCacheTierCache]->evictionCount);
+        }
+        
+        batchCount++;
+    }
+    
+    [pool drain];
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kSweepTickInterval * NSEC_PER_SEC)), _evictionQueue, ^{
+        [self sweepNextBatch];
+    });
+}
+
+- (void)advanceSweepShard {
+    NSNumber *shardIndex = [NSNumber numberWithUnsignedInteger:_sweepShardIndex];
+    BOOL hadEntries = ([_sweepShards objectForKey:shardIndex] != nil);
+    
+    [_sweepShards removeObjectForKey:shardIndex];
+    
+    _sweepShardIndex = (_sweepShardIndex + 1) % kCacheShardCount;
+    _sweepShardsRemaining--;
+    
+    // Empty shards are skipped without touching the disk
+    if (hadEntries || _sweepShardsRemaining == 0) {
+        NSString *cursor = [NSString stringWithFormat:@"%lu", (unsigned long)_sweepShardIndex];
+        
+        [cursor writeToFile:[_cacheDirectoryPath stringByAppendingPathComponent:kSweepCursorFilename] 
+                 atomically:YES 
+                   encoding:NSUTF8StringEncoding 
+                      error:nil];
+    }
+}
+
+#pragma mark - Eviction
+
+- (void)setCacheCapacity:(unsigned long long)cacheCapacity {
+    _cacheCapacity = cacheCapacity;
+    
+    [self scheduleEvictionIfNeeded];
+}
+
+- (void)setStorageCapacity:(unsigned long long)storageCapacity {
+    _storageCapacity = storageCapacity;
+    
+    [self scheduleEvictionIfNeeded];
+}
+
+- (void)scheduleEvictionIfNeeded {
+    BOOL cacheOverBudget = (_cacheCapacity > 0 && _cacheIndex.totalSize > _cacheCapacity);
+    BOOL storageOverBudget = (_storageCapacity > 0 && _storageIndex.totalSize > _storageCapacity);
+    
+    if (!cacheOverBudget && !storageOverBudget) {
+        return;
+    }
+    
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &_evictionScheduled)) {
+        dispatch_async(_evictionQueue, ^{
+            [self evictEntriesWithCacheCandidates:nil storageCandidates:nil];
+        });
+    }
+}
+
+- (void)evictEntriesWithCacheCandidates:(NSEnumerator *)cacheCandidates storageCandidates:(NSEnumerator *)storageCandidates {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    BOOL cacheNeedsEviction = [self evictEntriesFromIndex:_cacheIndex capacity:_cacheCapacity candidates:&cacheCandidates];
+    BOOL storageNeedsEviction = [self evictEntriesFromIndex:_storageIndex capacity:_storageCapacity candidates:&storageCandidates];
+    
+    [cacheCandidates retain];
+    [storageCandidates retain];
+    
+    [pool drain];
+    
+    if (cacheNeedsEviction || storageNeedsEviction) {
+        // Continue with the next batch in a separate block, so other work on 
+        // the background queues gets a chance to run in between. The sorted 
+        // candidates are handed on, so the index is only sorted once per pass.
+        dispatch_async(_evictionQueue, ^{
+            [self evictEntriesWithCacheCandidates:cacheCandidates storageCandidates:storageCandidates];
+        });
+    } else {
+        OSAtomicCompareAndSwap32Barrier(1, 0, &_evictionScheduled);
+    }
+    
+    [cacheCandidates release];
+    [storageCandidates release];
+}
+
+- (BOOL)evictEntriesFromIndex:(HPCacheIndex *)index capacity:(unsigned long long)capacity candidates:(NSEnumerator **)candidates {
+    if (capacity == 0 || ![index isLoaded]) {
+        return NO;
+    }
+    
+    unsigned long long targetSize = (unsigned long long)(capacity * kEvictionLowWaterMark);
+    
+    if (index.totalSize <= targetSize) {
+        *candidates = nil;
+        
+        return NO;
+    }
+    
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    
+    if (*candidates == nil) {
+        *candidates = [[index leastRecentlyUsedEntries:NSUIntegerMax] objectEnumerator];
+    }
+    
+    for (NSUInteger i = 0; i < kEvictionBatchSize; i++) {
+        if (index.totalSize <= targetSize) {
+            *candidates = nil;
+            
+            return NO;
+        }
+        
+        HPCacheIndexEntry *entry = [*candidates nextObject];
+        
+        if (entry == nil) {
+            // Everything sorted at the start of the pass was visited, anything 
+            // stored since then is sorted again with the next batch
+            *candidates = nil;
+            
+            break;
+        }
+        
+        // Skip entries that were replaced since the candidates were sorted
+        if ([index entryForKey:entry.key] != entry) {
+            continue;
+        }
+        
+        NSString *path = [self pathForKey:entry.key inIndex:index];
+        
+        // A write still waiting in the queue would bring the file back
+        [self cancelPendingWriteForPath:path];
+        [_memoryCache removeObjectForKey:path];
+        [index removeEntryForKey:entry.key];
+        [fileManager removeItemAtPath:path error:nil];
+        
+        OSAtomicIncrement64(&[self countersForPath:path]->evictionCount);
+    }
+    
+    return (index.totalSize > targetSize);
+}
+
+#pragma mark - Statistics
+
+- (HPCacheTierCounters *)countersForTier:(HPCacheTier)tier {
+    return &((HPCacheTierCounters *)_tierCounters)[tier];
+}
+
+- (HPCacheTierCounters *)countersForPath:(NSString *)path {
+    return [self countersForTier:([self indexForPath:path] == _storageIndex) ? HPCacheTierStorage : HPCacheTierCache];
+}
+
+- (NSDictionary *)statisticsForTier:(HPCacheTier)tier {
+    HPCacheTierCounters *counters = [self countersForTier:tier];
+    NSMutableArray *latencies = [NSMutableArray arrayWithCapacity:kCacheLatencyBucketCount];
+    
+    for (NSUInteger i = 0; i < kCacheLatencyBucketCount; i++) {
+        [latencies addObject:[NSNumber numberWithLongLong:HPCacheReadCounter(&counters->latencies[i])]];
+    }
+    
+    int64_t evictionCount = HPCacheReadCounter(&counters->evictionCount);
+    unsigned long long size = 0;
+    unsigned long long capacity = 0;
+    
+    switch (tier) {
+        case HPCacheTierMemory:
+            // The memory tier counts its own evictions
+            evictionCount += _memoryCache.evictionCount;
+            size = _memoryCache.totalCost;
+            capacity = _memoryCache.totalCostLimit;
+            break;
+        case HPCacheTierCache:
+            size = _cacheIndex.totalSize;
+            capacity = _cacheCapacity;
+            break;
+        case HPCacheTierStorage:
+            size = _storageIndex.totalSize;
+            capacity = _storageCapacity;
+            break;
+    }
+    
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithLongLong:HPCacheReadCounter(&counters->hitCount)], HPCacheStatisticsHitCountKey, 
+            [NSNumber numberWithLongLong:HPCacheReadCounter(&counters->missCount)], HPCacheStatisticsMissCountKey, 
+            [NSNumber numberWithLongLong:HPCacheReadCounter(&counters->bytesRead)], HPCacheStatisticsBytesReadKey, 
+            [NSNumber numberWithLongLong:HPCacheReadCounter(&counters->bytesWritten)], HPCacheStatisticsBytesWrittenKey, 
+            [NSNumber numberWithLongLong:evictionCount], HPCacheStatisticsEvictionCountKey, 
+            latencies, HPCacheStatisticsLatencyHistogramKey, 
+            [NSNumber numberWithUnsignedLongLong:size], HPCacheStatisticsSizeKey, 
+            [NSNumber numberWithUnsignedLongLong:capacity], HPCacheStatisticsCapacityKey, nil];
+}
+
+- (void)resetStatistics {
+    for (NSUInteger tier = 0; tier < kCacheTierCount; tier++) {
+        HPCacheTierCounters *counters = [self countersForTier:(HPCacheTier)tier];
+        
+        HPCacheResetCounter(&counters->hitCount);
+        HPCacheResetCounter(&counters->missCount);
+        HPCacheResetCounter(&counters->bytesRead);
+        HPCacheResetCounter(&counters->bytesWritten);
+        HPCacheResetCounter(&counters->evictionCount);
+        
+        for (NSUInteger i = 0; i < kCacheLatencyBucketCount; i++) {
+            HPCacheResetCounter(&counters->latencies[i]);
+        }
+    }
+    
+    [_memoryCache resetStatistics];
+}
+
+- (void)didReceiveApplicationNotification:(NSNotification *)notification {
+    UIApplication *application = [UIApplication sharedApplication];
+    __block UIBackgroundTaskIdentifier taskIdentifier = UIBackgroundTaskInvalid;
+    dispatch_group_t flushGroup = dispatch_group_create();
+    
+    // The task is ended on the main thread, where the expiration handler runs
+    taskIdentifier = [application beginBackgroundTaskWithExpirationHandler:^{
+        [application endBackgroundTask:taskIdentifier];
+        
+        taskIdentifier = UIBackgroundTaskInvalid;
+    }];
+    
+    // Sorting the log and syncing the indexes, which can wait on another 
+    // process for the index lock and fsync, is kept off the main thread. The 
+    // background task keeps the app running until both are on disk.
+    dispatch_group_async(flushGroup, _flushQueue, ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        
+        [self writeAccessLog];
+        [_cacheIndex synchronize];
+        [_storageIndex synchronize];
+        
+        [pool drain];
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (taskIdentifier != UIBackgroundTaskInvalid) {
+                [application endBackgroundTask:taskIdentifier];
+                
+                taskIdentifier = UIBackgroundTaskInvalid;
+            }
+        });
+    });
+    
+    // A terminating app does not get to run the task, so the main thread 
+    // waits for it, but never longer than the timeout
+    if ([[notification name] isEqualToString:UIApplicationWillTerminateNotification]) {
+        dispatch_group_wait(flushGroup, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kTerminationFlushTimeout * NSEC_PER_SEC)));
+    }
+    
+    dispatch_release(flushGroup);
 }
 
 - (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    
 	[_saveQueue cancelAllOperations];
 	[_saveQueue release], _saveQueue = nil;
+    [_pendingWrites release], _pendingWrites = nil;
+    [_pendingWritesLock release], _pendingWritesLock = nil;
+    [_memoryCache release], _memoryCache = nil;
+    [_cacheKeys release], _cacheKeys = nil;
+    [_cacheIndex release], _cacheIndex = nil;
+    [_storageIndex release], _storageIndex = nil;
+    [_compressedMIMETypes release], _compressedMIMETypes = nil;
+    [_sweepShards release], _sweepShards = nil;
+    
+    for (NSUInteger i = 0; i < kAccessLogShardCount; i++) {
+        HPCacheAccessLogShard *shard = &((HPCacheAccessLogShard *)_accessLogShards)[i];
+        
+        for (NSUInteger j = 0; j < kAccessLogShardCapacity; j++) {
+            [shard->records[j].path release];
+        }
+        
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->records);
+    }
+    
+    free(_accessLogShards), _accessLogShards = NULL;
+    
+    dispatch_release(_evictionQueue);
+    dispatch_release(_readQueue);
+    dispatch_release(_flushQueue);
+    free(_tierCounters), _tierCounters = NULL;
 	[_cacheDirectoryPath release], _cacheDirectoryPath = nil;
     [_storageDirectoryPath release], _storageDirectoryPath = nil;
 	
@@ -458,36 +2412,3 @@ static HPCacheManager *_sharedManager = nil;
 
 @end
 
-
-@implementation HPURLCache
-
-- (NSCachedURLResponse *)cachedResponseForRequest:(NSURLRequest *)request {
-	NSCachedURLResponse *memoryResponse = [super cachedResponseForRequest:request];
-	
-	if (memoryResponse != nil) {
-		return memoryResponse;
-	}
-	
-	NSURL *requestURL = [request URL];
-	HPCacheItem *cacheItem = [[HPCacheManager sharedManager] cachedItemForURL:requestURL];
-    
-	if (cacheItem != nil) {
-		NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:requestURL 
-																	MIMEType:cacheItem.MIMEType 
-													   expectedContentLength:[cacheItem.cacheData length] 
-															textEncodingName:nil];
-		
-		NSCachedURLResponse *cachedResponse = [[[NSCachedURLResponse alloc] initWithResponse:response 
-																						data:cacheItem.cacheData] autorelease];
-		
-		[self storeCachedResponse:cachedResponse forRequest:request];
-		
-		[response release];
-		
-		return cachedResponse;
-	}
-    
-	return nil;
-}
-
-@end
@@ -0,0 +1,94 @@
+//
+//  HPMemoryPressureManager.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-18.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+typedef enum {
+    HPMemoryPressureLevelTrim,
+    HPMemoryPressureLevelHalve,
+    HPMemoryPressureLevelPurge,
+} HPMemoryPressureLevel;
+
+
+/** Protocol for in-memory caches and buffer pools that can give memory back
+ */
+@protocol HPMemoryPressureResponder <NSObject>
+
+/** Current cost of the memory held by the responder, usually in bytes
+ */
+- (NSUInteger)memoryCost;
+
+/** Releases memory for a pressure level
+
+ HPMemoryPressureLevelTrim should drop the least valuable quarter of the
+ current cost, HPMemoryPressureLevelHalve half of it and
+ HPMemoryPressureLevelPurge everything that can be rebuilt.
+
+ @param level Pressure level
+ */
+- (void)reduceMemoryForPressureLevel:(HPMemoryPressureLevel)level;
+
+@end
+
+
+/** Central coordinator that sheds memory from registered caches
+
+ Responders are reduced in cost order, largest first, so the biggest consumers
+ give memory back first. A trim pass stops as soon as a quarter of the total
+ registered cost has been released, the other levels reach every responder.
+
+ The application moving to the background applies the trim level, a memory
+ warning applies the halve level and another memory warning shortly after the
+ first one escalates to the purge level.
+
+ Every [HPMemoryCache](HPMemoryCache) registers itself on creation, unless it
+ opts out because its costs are not in bytes.
+ */
+@interface HPMemoryPressureManager : NSObject {
+@private
+    NSMutableArray *_responders;
+    NSRecursiveLock *_lock;
+    CFAbsoluteTime _lastWarningTime;
+}
+
+/** Returns the shared instance of the memory pressure manager
+
+ You should always use this call and never instantiate the
+ HPMemoryPressureManager.
+
+ @returns HPMemoryPressureManager shared instance
+ */
++ (HPMemoryPressureManager *)sharedManager;
+
+/** Registers a responder
+
+ Responders are not retained and have to unregister before they are
+ deallocated.
+
+ @param responder Responder to register
+ */
+- (void)registerResponder:(id <HPMemoryPressureResponder>)responder;
+
+/** Unregisters a responder
+
+ Blocks while a pressure pass that includes the responder is running, so it is
+ safe to call from dealloc.
+
+ @param responder Responder to unregister
+ */
+- (void)unregisterResponder:(id <HPMemoryPressureResponder>)responder;
+
+/** Total cost of all registered responders
+ */
+- (NSUInteger)totalMemoryCost;
+
+/** Sheds memory from registered responders for a pressure level
+
+ @param level Pressure level
+ */
+- (void)applyPressureLevel:(HPMemoryPressureLevel)level;
+
+@end
@@ -0,0 +1,189 @@
+//
+//  HPMemoryPressureManager.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-18.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import "HPMemoryPressureManager.h"
+
+
+// A second memory warning within this interval escalates to a purge
+static NSTimeInterval const kMemoryWarningEscalationInterval = 30.0;
+
+// Fraction of the total cost a trim pass tries to release
+static double const kTrimFraction = 0.25;
+
+
+@interface HPMemoryPressureManager (PrivateMethods)
+- (void)didReceiveApplicationNotification:(NSNotification *)notification;
+@end
+
+
+@implementation HPMemoryPressureManager
+
+#pragma mark - Singleton and init management
+
+static HPMemoryPressureManager *_sharedManager = nil;
+
++ (HPMemoryPressureManager *)sharedManager {
+    static dispatch_once_t onceToken;
+
+    dispatch_once(&onceToken, ^{
+        _sharedManager = [[super allocWithZone:NULL] init];
+    });
+
+	return _sharedManager;
+}
+
++ (id)allocWithZone:(NSZone *)zone {
+    return [[self sharedManager] retain];
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    return self;
+}
+
+- (id)retain {
+    return self;
+}
+
+- (NSUInteger)retainCount {
+    return NSUIntegerMax;
+}
+
+- (oneway void)release {
+
+}
+
+- (id)autorelease {
+    return self;
+}
+
+- (id)init {
+    self = [super init];
+
+    if (self) {
+        _responders = [[NSMutableArray alloc] init];
+        _lock = [[NSRecursiveLock alloc] init];
+        _lastWarningTime = 0.0;
+
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(didReceiveApplicationNotification:)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(didReceiveApplicationNotification:)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+    }
+
+    return self;
+}
+
+#pragma mark - Registration
+
+- (void)registerResponder:(id <HPMemoryPressureResponder>)responder {
+    if (responder == nil) {
+        return;
+    }
+
+    [_lock lock];
+    [_responders addObject:[NSValue valueWithNonretainedObject:responder]];
+    [_lock unlock];
+}
+
+- (void)unregisterResponder:(id <HPMemoryPressureResponder>)responder {
+    if (responder == nil) {
+        return;
+    }
+
+    [_lock lock];
+    [_responders removeObject:[NSValue valueWithNonretainedObject:responder]];
+    [_lock unlock];
+}
+
+#pragma mark - Pressure handling
+
+- (NSUInteger)totalMemoryCost {
+    NSUInteger totalCost = 0;
+
+    [_lock lock];
+
+    for (NSValue *value in _responders) {
+        totalCost += [[value nonretainedObjectValue] memoryCost];
+    }
+
+    [_lock unlock];
+
+    return totalCost;
+}
+
+- (void)applyPressureLevel:(HPMemoryPressureLevel)level {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+    // The lock is held for the whole pass, so a responder that unregisters
+    // from dealloc on another thread waits until it is no longer in use
+    [_lock lock];
+
+    NSMutableArray *responders = [NSMutableArray arrayWithCapacity:[_responders count]];
+    NSUInteger totalCost = 0;
+
+    for (NSValue *value in _responders) {
+        NSUInteger cost = [[value nonretainedObjectValue] memoryCost];
+
+        totalCost += cost;
+
+        [responders addObject:[NSArray arrayWithObjects:value, [NSNumber numberWithUnsignedInteger:cost], nil]];
+    }
+
+    [responders sortUsingComparator:^NSComparisonResult(NSArray *first, NSArray *second) {
+        return [[second objectAtIndex:1] compare:[first objectAtIndex:1]];
+    }];
+
+    NSUInteger targetCost = (NSUInteger)(totalCost * (1.0 - kTrimFraction));
+    NSUInteger remainingCost = totalCost;
+
+    for (NSArray *pair in responders) {
+        NSValue *value = [pair objectAtIndex:0];
+        NSUInteger cost = [[pair objectAtIndex:1] unsignedIntegerValue];
+
+        if (level == HPMemoryPressureLevelTrim && remainingCost <= targetCost) {
+            break;
+        }
+
+        // An earlier responder may have released this one
+        if (cost == 0 || ![_responders containsObject:value]) {
+            continue;
+        }
+
+        id <HPMemoryPressureResponder> responder = [value nonretainedObjectValue];
+
+        [responder reduceMemoryForPressureLevel:level];
+
+        remainingCost -= MIN(remainingCost, cost - MIN(cost, [responder memoryCost]));
+    }
+
+    [_lock unlock];
+
+    [pool drain];
+}
+
+- (void)didReceiveApplicationNotification:(NSNotification *)notification {
+    if ([[notification name] isEqualToString:UIApplicationDidEnterBackgroundNotification]) {
+        [self applyPressureLevel:HPMemoryPressureLevelTrim];
+
+        return;
+    }
+
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    BOOL escalate = (now - _lastWarningTime < kMemoryWarningEscalationInterval);
+
+    _lastWarningTime = now;
+
+    [self applyPressureLevel:(escalate) ? HPMemoryPressureLevelPurge : HPMemoryPressureLevelHalve];
+}
+
+@end
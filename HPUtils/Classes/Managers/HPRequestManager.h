@@ -24,6 +24,9 @@ extern NSString * const HPNetworkStatusChangeNotification;
 @private
     NSOperationQueue *_requestQueue;
     NSOperationQueue *_processQueue;
+    NSMutableSet *_cacheLookups;
+    NSMutableDictionary *_inflightRequests;
+    NSMutableSet *_coalescedRequests;
     
     HPReachabilityManager *_reachabilityManager;
     
@@ -285,7 +288,8 @@ extern NSString * const HPNetworkStatusChangeNotification;
 /** Generates NSData from an NSDictionary
  
  Generates an NSData instance that can be used in POST or PUT operations from an 
- NSDictionary object.
+ NSDictionary object. Keys are sorted, so the same dictionary always produces 
+ the same body.
  
  @param dict NSDictionary to be encoded
  */
@@ -317,7 +321,8 @@ extern NSString * const HPNetworkStatusChangeNotification;
 
 /** Utility method for generating query parameters
  
- Generates a full path with URL encoded query parameters from an NSDictionary.
+ Generates a full path with URL encoded query parameters from an NSDictionary. 
+ Keys are sorted, so the same options always produce the same path.
  
  @param basePath NSString path that will be used as the base for the URL
  @param options NSDictionary parameters that will be converted for the query
@@ -340,7 +345,11 @@ extern NSString * const HPNetworkStatusChangeNotification;
 
 /** Adds an [HPRequestOperation](HPRequestOperation) to the queue
  
- Enqueues an [HPRequestOperation](HPRequestOperation) instance.
+ Enqueues an [HPRequestOperation](HPRequestOperation) instance. If an identical 
+ request is already loading, as determined by the coalescingKey, the request 
+ is attached to it instead of opening another connection. Its progress blocks 
+ follow the shared connection from then on, and it runs its own parser and 
+ completion blocks when the shared response arrives.
  
  @param request Operation to be queued
  */
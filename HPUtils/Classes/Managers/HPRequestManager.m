@@ -10,7 +10,6 @@
 #import "HPErrors.h"
 #import "HPRequestManager.h"
 #import "HPRequestOperation.h"
-#import "NSString+HPHashAdditions.h"
 #import "UIDevice+HPCapabilityAdditions.h"
 
 
@@ -24,6 +23,9 @@ static NSTimeInterval const kNetworkConnectivityCheckInterval = 8.0;
 
 - (void)checkNetworkActivity;
 - (void)checkNetworkConnectivity;
+- (void)addRequestToQueue:(HPRequestOperation *)request;
+- (BOOL)coalesceRequest:(HPRequestOperation *)request;
+- (NSArray *)sortedKeysForDict:(NSDictionary *)dict;
 
 - (void)didReceiveReachabilityNotification:(NSNotification *)notification;
 
@@ -78,6 +80,9 @@ static HPRequestManager *_sharedManager = nil;
 		_networkConnectionAvailable = YES;
 		_requestQueue = [[NSOperationQueue alloc] init];
 		_processQueue = [[NSOperationQueue alloc] init];
+        _cacheLookups = [[NSMutableSet alloc] init];
+        _inflightRequests = [[NSMutableDictionary alloc] init];
+        _coalescedRequests = [[NSMutableSet alloc] init];
 		
 		[_requestQueue setMaxConcurrentOperationCount:[[NSProcessInfo processInfo] activeProcessorCount] + 1];
 		[_processQueue setMaxConcurrentOperationCount:[[NSProcessInfo processInfo] activeProcessorCount] + 1];
@@ -104,11 +109,29 @@ static HPRequestManager *_sharedManager = nil;
 #pragma mark - Operations management
 
 - (void)cancelAllOperations {
+    [_cacheLookups makeObjectsPerformSelector:@selector(cancel)];
+    [[_coalescedRequests allObjects] makeObjectsPerformSelector:@selector(cancel)];
 	[_requestQueue cancelAllOperations];
 	[_processQueue cancelAllOperations];
 }
 
 - (void)cancelOperationsWithIdentifier:(NSString *)identifier {
+	for (HPRequestOperation *request in [_cacheLookups allObjects]) {
+		if ([request.identifier isEqualToString:identifier]) {
+			[request cancel];
+            
+            return;
+		}
+	}
+    
+	for (HPRequestOperation *request in [_coalescedRequests allObjects]) {
+		if ([request.identifier isEqualToString:identifier]) {
+			[request cancel];
+            
+            return;
+		}
+	}
+    
 	for (HPRequestOperation *request in [self activeRequestOperations]) {
 		if ([request.identifier isEqualToString:identifier]) {
 			[request cancel];
@@ -227,40 +250,96 @@ static HPRequestManager *_sharedManager = nil;
 }
 
 - (void)enqueueRequest:(HPRequestOperation *)request {
+    if (![NSThread isMainThread]) {
+        [self performSelectorOnMainThread:_cmd 
+                               withObject:request 
+                            waitUntilDone:NO];
+        
+        return;
+    }
+    
 	if (![request isExecuting]
         && ![request isFinished]
+        && ![_cacheLookups containsObject:request]
+        && ![_coalescedRequests containsObject:request]
         && ![[_requestQueue operations] containsObject:request]) {
 
-        // If request is cachable and there is a cache available, complete it immediately
-        if (![request completeRequestWithCachedResponse]) {
-            // Either the request is not cached or no cache is available, go ahead
-            [[UIApplication sharedApplication] setNetworkActivityIndicatorVisible:YES];
+        [_cacheLookups addObject:request];
+        
+        // If request is cachable and there is a cache available, complete it 
+        // without blocking the main thread on disk access or parsing
+        [request completeRequestWithCachedResponseInBackground:^(BOOL completed) {
+            if (!completed && ![self coalesceRequest:request]) {
+                // Either the request is not cached or no cache is available, go ahead
+                [self addRequestToQueue:request];
+            }
             
-            [request addCompletionBlock:^(id resources, NSError *error) {
-                if (error != nil && [error code] == kHPNetworkErrorCode) {
-                    if (_networkConnectionAvailable) {
-                        _networkConnectionAvailable = NO;
-                        
-                        [[NSNotificationCenter defaultCenter] postNotificationName:HPNetworkStatusChangeNotification
-                                                                            object:self];
-                        
-                        [self performSelector:@selector(checkNetworkConnectivity)
-                                   withObject:nil
-                                   afterDelay:kNetworkConnectivityCheckInterval];
-                    }
-                } else if (!_networkConnectionAvailable && !request.hasCachedResponseAvailable) {
-                    _networkConnectionAvailable = YES;
-                    
-                    [[NSNotificationCenter defaultCenter] postNotificationName:HPNetworkStatusChangeNotification
-                                                                        object:self];
-                }
-                
-                [[UIApplication sharedApplication] setNetworkActivityIndicatorVisible:([_requestQueue operationCount] - 1 > 0)];
-            }];
+            [_cacheLookups removeObject:request];
+        }];
+	}
+}
 
-            [_requestQueue addOperation:request];
+- (BOOL)coalesceRequest:(HPRequestOperation *)request {
+    NSString *coalescingKey = request.coalescingKey;
+    
+    if (coalescingKey == nil) {
+        return NO;
+    }
+    
+    // Blocks are retained by the request, so they must not retain it back
+    __block HPRequestOperation *blockRequest = request;
+    HPRequestOperation *leader = [_inflightRequests objectForKey:coalescingKey];
+    
+    if (leader != nil && [leader addCoalescedRequest:request]) {
+        [_coalescedRequests addObject:request];
+        
+        [request addFinishBlock:^(id resources, NSError *error) {
+            [_coalescedRequests removeObject:blockRequest];
+        }];
+        
+        return YES;
+    }
+    
+    // Identical requests enqueued while this one is loading attach to it. 
+    // Cancelling the request while others are attached drops its completion 
+    // blocks, so the bookkeeping runs as a finish block.
+    [_inflightRequests setObject:request forKey:coalescingKey];
+    
+    [request addFinishBlock:^(id resources, NSError *error) {
+        if ([_inflightRequests objectForKey:coalescingKey] == blockRequest) {
+            [_inflightRequests removeObjectForKey:coalescingKey];
         }
-	}
+    }];
+    
+    return NO;
+}
+
+- (void)addRequestToQueue:(HPRequestOperation *)request {
+    [[UIApplication sharedApplication] setNetworkActivityIndicatorVisible:YES];
+    
+    [request addFinishBlock:^(id resources, NSError *error) {
+        if (error != nil && [error code] == kHPNetworkErrorCode) {
+            if (_networkConnectionAvailable) {
+                _networkConnectionAvailable = NO;
+                
+                [[NSNotificationCenter defaultCenter] postNotificationName:HPNetworkStatusChangeNotification
+                                                                    object:self];
+                
+                [self performSelector:@selector(checkNetworkConnectivity)
+                           withObject:nil
+                           afterDelay:kNetworkConnectivityCheckInterval];
+            }
+        } else if (!_networkConnectionAvailable && !request.hasCachedResponseAvailable) {
+            _networkConnectionAvailable = YES;
+            
+            [[NSNotificationCenter defaultCenter] postNotificationName:HPNetworkStatusChangeNotification
+                                                                object:self];
+        }
+        
+        [[UIApplication sharedApplication] setNetworkActivityIndicatorVisible:([_requestQueue operationCount] - 1 > 0)];
+    }];
+
+    [_requestQueue addOperation:request];
 }
 
 - (void)checkNetworkActivity {
@@ -287,10 +366,16 @@ static HPRequestManager *_sharedManager = nil;
 	return @"";
 }
 
+- (NSArray *)sortedKeysForDict:(NSDictionary *)dict {
+    // Dictionary order depends on hashing and insertion history, sorting the 
+    // keys keeps the same parameters on the same URL and cache key
+    return [[dict allKeys] sortedArrayUsingSelector:@selector(compare:)];
+}
+
 - (NSData *)dataFromDict:(NSDictionary *)dict {
 	NSMutableString *dataString = [NSMutableString string];
 	
-	for (NSString *key in [dict allKeys]) {
+	for (NSString *key in [self sortedKeysForDict:dict]) {
         id value = [dict objectForKey:key];
         
         if ((NSNull *)value == [NSNull null]) {
@@ -384,7 +469,7 @@ static HPRequestManager *_sharedManager = nil;
     }
     
 	if (options != nil) {
-		for (NSString *key in [options allKeys]) {
+		for (NSString *key in [self sortedKeysForDict:options]) {
             id value = [options objectForKey:key];
             
             if ((NSNull *)value == [NSNull null]) {
@@ -470,7 +555,7 @@ static HPRequestManager *_sharedManager = nil;
 				HPImageOperation *operation = [[HPImageOperation alloc] initWithImage:sourceImage
                                                                            targetSize:targetSize
                                                                           contentMode:contentMode
-                                                                             cacheKey:[imageURL SHA1Hash]
+                                                                             cacheKey:[[HPCacheManager sharedManager] cacheKeyForURLString:imageURL]
                                                                           imageFormat:imageFormat];
 				
                 [operation setIdentifier:identifier];
@@ -701,6 +786,9 @@ static HPRequestManager *_sharedManager = nil;
 	[_requestQueue cancelAllOperations];
 	[_processQueue cancelAllOperations];
 	[_reachabilityManager release];
+    [_cacheLookups release];
+    [_inflightRequests release];
+    [_coalescedRequests release];
 	[_requestQueue release];
 	[_processQueue release];
 	
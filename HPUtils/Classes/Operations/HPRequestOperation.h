@@ -6,6 +6,9 @@
 //  Copyright 2011 Hippo Foundry. All rights reserved.
 //
 
+@class HPCacheItem;
+@class HPJSONArrayStreamParser;
+
 
 typedef enum {
 	HPRequestMethodGet,
@@ -31,6 +34,10 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
  to communicate with its delegates. Provides easy access to all kinds of HTTP 
  calls, authentication methods, custom parsing, progress and completion handling.
  It can also be identified and cancelled very easily.
+ 
+ Connections run on a dedicated networking thread with its own run loop, so 
+ receiving data never competes with work on the main thread. Completion, 
+ progress and update blocks are always called on the main thread.
  */
 @interface HPRequestOperation : NSOperation {
 @private
@@ -39,6 +46,7 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
     
     NSMutableSet *_cookies;
     NSMutableSet *_completionBlocks;
+    NSMutableArray *_finishBlocks;
 	NSURLConnection *_connection;
     NSMutableData *_loadedData;
 	NSURLResponse *_response;
@@ -48,13 +56,35 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
 	NSString *_MIMEType;
 	NSURL *_requestURL;
     NSDate *_startTime;
+    HPCacheItem *_revalidatedItem;
+    id _staleResources;
+    NSMutableArray *_subscribers;
+    HPRequestOperation *_leader;
     
     NSString *_username;
     NSString *_password;
 	
 	long long _expectedSize;
+    long long _receivedLength;
+    float _reportedProgress;
+    NSOperationQueue *_parseQueue;
+    NSTimeInterval _parseDuration;
+    HPJSONArrayStreamParser *_streamParser;
+    NSMutableArray *_streamChunks;
+    NSString *_downloadPath;
+    NSMutableData *_downloadBuffer;
+    int _downloadFileDescriptor;
+    volatile int32_t _holdsForegroundActivity;
 	
 	BOOL _isCached;
+    BOOL _staleWhileRevalidate;
+    BOOL _isServingStaleResponse;
+    BOOL _hasServedStaleResponse;
+    BOOL _isDetached;
+    BOOL _isDeliveringToSubscribers;
+    BOOL _downloadsToFile;
+    BOOL _isDrainingStream;
+    BOOL _hasStreamEnded;
 	BOOL _isExecuting;
 	BOOL _isCancelled;
 	BOOL _isFinished;
@@ -64,6 +94,9 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
     id (^_parserBlock)(NSData *, NSString *);
     void (^_uploadProgressBlock)(float progress);
     void (^_progressBlock)(float);
+    void (^_updateBlock)(id, NSError *);
+    void (^_cacheLookupBlock)(BOOL);
+    void (^_itemBlock)(id);
 }
 
 /** HTTP request method
@@ -121,9 +154,62 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
  returns an object parsed from the incoming data. By default, 
  [HPRequestManager](HPRequestManager) will set this property to a JSON parser 
  block that will convert the data to a JSON object.
+ 
+ The block runs on the parseQueue, so it must not touch UIKit state that is 
+ only safe to use on the main thread. Only the parsed result is delivered to 
+ the completion blocks on the main thread.
  */
 @property (nonatomic, copy) id (^parserBlock)(NSData *loadedData, NSString *MIMEType);
 
+/** Item block for streaming a JSON array response
+ 
+ If set, a successful response is expected to be a JSON array and is parsed 
+ on the parseQueue while it downloads, one chunk at a time in the order the 
+ chunks arrived. This block is called on the main thread with every element 
+ of the array as soon as the element has been parsed, so the first items can 
+ be shown before the download finishes. The parser block is not used, and the 
+ completion blocks are called with nil resources once the whole array has 
+ been delivered, or with a parser error if the body is not a valid JSON 
+ array. In that case the download is stopped as soon as the problem is found.
+ 
+ The response body is not kept in memory unless the request is cached. 
+ Cached responses are split into items in one pass when they are served from 
+ the cache. Streaming requests are never coalesced.
+ */
+@property (nonatomic, copy) void (^itemBlock)(id item);
+
+/** File download mode for large responses
+ 
+ If enabled, the body of a successful response is written to a temporary 
+ file as it arrives instead of being collected in memory. Only a small buffer 
+ is held between writes. Once the download finishes, the parser block 
+ receives a memory mapped NSData of the file, which stays valid after the file 
+ is removed. Streaming requests still deliver their items as they arrive.
+ 
+ Cached requests download next to the cache entry, and the finished file 
+ becomes the cache entry by renaming it, so the body is never copied. Error 
+ responses are still collected in memory. Default value is NO.
+ */
+@property (nonatomic, assign) BOOL downloadsToFile;
+
+/** Queue the parser block runs on
+ 
+ Defaults to a concurrent queue shared by all request operations, which runs 
+ as many parsers at once as there are active processor cores. The shared 
+ queue is an NSOperationQueue, so its limit can be adjusted through this 
+ property. Set to nil to run the parser on the thread that delivered the 
+ response. The operation checks for cancellation before and after parsing, 
+ and a cancelled operation never delivers a parsed result.
+ */
+@property (nonatomic, retain) NSOperationQueue *parseQueue;
+
+/** Time the parser block took for the last response, in seconds
+ 
+ Time spent waiting for the parseQueue is not included. Parse times are also 
+ logged if logging is enabled.
+ */
+@property (nonatomic, readonly, assign) NSTimeInterval parseDuration;
+
 /** Upload progress block for this request operation
  
  If set, this block will get called with the progress of the upload operation 
@@ -134,12 +220,45 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
 
 /** Progress block for this request operation
  
- If set, this block will get called with the progress of the download operation 
- whenever the NSURLConnection reports an update. Value of the progress parameter 
- will be between 0.0 and 1.0
+ If set, this block will get called on the main thread with the progress of 
+ the download operation whenever it advances by at least one percent. It is 
+ not called if the server does not report the content length. Value of the 
+ progress parameter will be between 0.0 and 1.0
  */
 @property (nonatomic, copy) void (^progressBlock)(float progress);
 
+/** Stale-while-revalidate mode for cached requests
+ 
+ If enabled and only a stale cached response is available, the completion 
+ blocks are called with the stale response right away and the request is sent 
+ to the network to refresh the cache in the background. The operation finishes 
+ when the refresh completes. Completion blocks added after the stale response 
+ was delivered are called with the result of the refresh. If the server 
+ confirms that the stale response is still valid, that result is the stale 
+ resources again.
+ 
+ Default value is NO.
+ */
+@property (nonatomic, assign) BOOL staleWhileRevalidate;
+
+/** Update block for stale-while-revalidate mode
+ 
+ If set, this block will get called with the refreshed resources when a stale 
+ response was delivered and the server sent a new response, or with an error 
+ if the refresh failed. It is not called when the server confirms that the 
+ stale response is still valid.
+ */
+@property (nonatomic, copy) void (^updateBlock)(id resources, NSError *error);
+
+/** Key that identifies identical requests for coalescing
+ 
+ The key combines the HTTP method, whether the response is cached, the 
+ canonical form of the request URL and a digest of the request body. It is nil for requests that must not share a 
+ response: anything other than GET requests, requests with credentials or 
+ cookies, streaming requests and requests in stale-while-revalidate mode.
+ */
+@property (nonatomic, readonly) NSString *coalescingKey;
+
 /** Username for Basic Authentication
  */
 @property (nonatomic, copy) NSString *username;
@@ -183,7 +302,9 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
  
  @param cached Boolean that determines whether the response to this request 
  should be cached. Passing YES to this parameter will also make the operation 
- check for an available cached item for this request before starting.
+ check for an available cached item for this request before starting. Stale 
+ cached items that have an ETag or Last-Modified validator are revalidated 
+ with a conditional request, and reused if the server responds with 304.
  */
 - (id)initWithURL:(NSURL *)url 
              data:(NSData *)data 
@@ -200,6 +321,36 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
  */
 - (void)addCompletionBlock:(void(^)(id resources, NSError *error))block;
 
+/** Adds a block that is called once when this operation finishes
+ 
+ Unlike completion blocks, finish blocks are not removed when this request is 
+ cancelled while other requests are attached to it, or when a stale response 
+ is served first. They are meant for bookkeeping that has to follow the 
+ lifetime of the connection rather than the callers of this request.
+ 
+ @param block A block that receives the final resource object and NSError 
+ instance, both can be nil for a request nobody is listening to any more
+ */
+- (void)addFinishBlock:(void(^)(id resources, NSError *error))block;
+
+/** Attaches an identical request to this running request
+ 
+ The attached request does not open a connection of its own. When this request 
+ completes, the attached request runs its own parser block over the same 
+ response data and calls its own completion blocks. Its progress blocks are 
+ called with the progress of this request from the moment it is attached. 
+ Cancelling the attached request only detaches it. Cancelling this request 
+ while other requests are attached only calls its own completion blocks with a 
+ cancellation error, the connection is torn down once every attached request 
+ has been cancelled too.
+ 
+ @param request Request with the same coalescingKey that has not started
+ 
+ @returns BOOL Boolean value that indicates whether the request was attached, 
+ NO if this request is already delivering its response
+ */
+- (BOOL)addCoalescedRequest:(HPRequestOperation *)request;
+
 /** Adds a cookie for this request
  
  In rare cases when cookies are required for authentication or for other 
@@ -223,4 +374,18 @@ extern NSString * const HPRequestOperationMultiPartFormBoundary;
  */
 - (BOOL)completeRequestWithCachedResponse;
 
+/** Asynchronously completes this request with cached data if possible
+ 
+ Works like completeRequestWithCachedResponse, but the cache lookup and the 
+ parser block run in the background, so it is safe to call from the main 
+ thread while scrolling. The parser block runs on the parseQueue, or on the 
+ cache read queue if parseQueue is nil.
+ 
+ @param block Block that is called on the main thread with a Boolean value 
+ that indicates whether the request could be completed from cache. It is 
+ called after the completion blocks have received the cached resources, and 
+ right away if this request is not cached.
+ */
+- (void)completeRequestWithCachedResponseInBackground:(void (^)(BOOL completed))block;
+
 @end
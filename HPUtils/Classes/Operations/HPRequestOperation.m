@@ -6,24 +6,90 @@
 //  Copyright 2011 Hippo Foundry. All rights reserved.
 //
 
+#include <errno.h>
+#include <fcntl.h>
+#include <libkern/OSAtomic.h>
+#include <unistd.h>
+
+#import <CommonCrypto/CommonDigest.h>
+
 #import "HPAuthenticationManager.h"
 #import "HPCacheManager.h"
 #import "HPErrors.h"
+#import "HPJSONArrayStreamParser.h"
 #import "HPRequestOperation.h"
+#import "NSURL+HPCanonicalAdditions.h"
 
 
 NSString * const HPRequestOperationMultiPartFormBoundary = @"0xKhTmLbOuNdArY";
 
 static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 
+// Download progress is only reported to the main thread in steps of this size
+static float const HPRequestOperationProgressReportingStep = 0.01;
+
+// Bodies downloaded to a file are written in blocks of at least this size
+static NSUInteger const HPRequestOperationDownloadBufferLength = 256 * 1024;
+
+// Keys of the result a background cache lookup hands to the main thread
+static NSString * const HPRequestOperationCacheLookupItemKey = @"cacheItem";
+static NSString * const HPRequestOperationCacheLookupStaleKey = @"stale";
+static NSString * const HPRequestOperationCacheLookupResourcesKey = @"resources";
+static NSString * const HPRequestOperationCacheLookupErrorKey = @"error";
+
+
+static NSString *HPRequestMethodName(HPRequestMethod method) {
+    switch (method) {
+        case HPRequestMethodPost:
+            return @"POST";
+        case HPRequestMethodDelete:
+            return @"DELETE";
+        case HPRequestMethodPut:
+            return @"PUT";
+        case HPRequestMethodPatch:
+            return @"PATCH";
+        default:
+            return @"GET";
+    }
+}
+
 
 @interface HPRequestOperation (PrivateMethods)
++ (NSThread *)networkThread;
++ (void)runNetworkThread:(id)object;
++ (NSOperationQueue *)sharedParseQueue;
+- (void)parseData:(NSData *)data error:(NSError *)error;
+- (void)enqueueStreamData:(NSData *)data;
+- (void)drainStreamChunks;
+- (void)finishStreamParsing;
+- (void)cancelFailedStream;
+- (id)resourcesFromData:(NSData *)data 
+               MIMEType:(NSString *)MIMEType 
+          responseError:(NSError *)responseError 
+                  error:(NSError **)error;
+- (void)startConnectionWithRequest:(NSURLRequest *)request;
+- (void)cancelConnection;
 - (void)sendErrorToBlocks:(NSError *)error;
 - (void)sendResourcesToBlocks:(id)resources;
 - (void)callUploadProgressBlockWithPercentage:(NSNumber *)percentage;
 - (void)callProgressBlockWithPercentage:(NSNumber *)percentage;
+- (void)callItemBlockWithItems:(NSArray *)items;
+- (BOOL)openDownloadFile;
+- (BOOL)flushDownloadBuffer;
+- (NSData *)dataFromDownloadFile;
+- (void)discardDownloadFile;
 - (void)callParserBlockWithData:(NSData *)data error:(NSError *)error;
 - (void)sendResourcesToBlocks:(id)resources withError:(NSError *)error;
+- (void)sendStaleResourcesToBlocks;
+- (void)serveStaleCacheItem:(HPCacheItem *)cacheItem;
+- (void)parseCachedItem:(HPCacheItem *)cacheItem;
+- (void)finishCacheLookupWithResult:(NSDictionary *)result;
+- (void)sendCancellationToBlocks;
+- (void)beginForegroundActivity;
+- (void)endForegroundActivity;
+- (void)removeCoalescedRequest:(HPRequestOperation *)request;
+- (NSArray *)coalescedRequests;
+- (void)completeCoalescedRequestWithData:(NSData *)data MIMEType:(NSString *)MIMEType error:(NSError *)error;
 @end
 
 
@@ -40,6 +106,12 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 @synthesize username = _username;
 @synthesize password = _password;
 @synthesize requestURL = _requestURL;
+@synthesize staleWhileRevalidate = _staleWhileRevalidate;
+@synthesize updateBlock = _updateBlock;
+@synthesize parseQueue = _parseQueue;
+@synthesize parseDuration = _parseDuration;
+@synthesize itemBlock = _itemBlock;
+@synthesize downloadsToFile = _downloadsToFile;
 
 + (HPRequestOperation *)requestForURL:(NSURL *)url 
                              withData:(NSData *)data 
@@ -64,8 +136,31 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 		_requestURL = [url copy];
 		_requestData = [data copy];
 		_completionBlocks = [[NSMutableSet alloc] init];
+        _finishBlocks = [[NSMutableArray alloc] init];
+        _subscribers = [[NSMutableArray alloc] init];
+        _leader = nil;
+        _isDetached = NO;
+        _isDeliveringToSubscribers = NO;
+        _reportedProgress = 0.0;
+        _parseQueue = [[HPRequestOperation sharedParseQueue] retain];
+        _parseDuration = 0.0;
+        _itemBlock = nil;
+        _streamParser = nil;
+        _streamChunks = [[NSMutableArray alloc] init];
+        _isDrainingStream = NO;
+        _hasStreamEnded = NO;
+        _receivedLength = 0;
+        _downloadsToFile = NO;
+        _downloadPath = nil;
+        _downloadBuffer = nil;
+        _downloadFileDescriptor = -1;
+        _holdsForegroundActivity = 0;
         _cookies = [[NSMutableSet alloc] init];
         _loggingEnabled = NO;
+        _staleWhileRevalidate = NO;
+        _isServingStaleResponse = NO;
+        _hasServedStaleResponse = NO;
+        _staleResources = nil;
         _username = nil;
         _password = nil;
 		
@@ -89,34 +184,44 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 	} else if ([self isFinished]) {
         return;
     }
+    
+    // Held before the operation is visibly executing, so a cancellation that 
+    // finishes it from here on also ends the activity
+    [self beginForegroundActivity];
 	
 	[self willChangeValueForKey:@"isExecuting"];
 	_isExecuting = YES;
 	[self didChangeValueForKey:@"isExecuting"];
     
     _startTime = [[NSDate date] retain];
+    
+    // A stale item may already have been served by completeRequestWithCachedResponse
+    if (_isCached && _revalidatedItem == nil) {
+        HPCacheItem *cacheItem = [[HPCacheManager sharedManager] cachedItemForURL:_requestURL allowStale:YES];
+        
+        if (cacheItem != nil && ![cacheItem isStale]) {
+            [_MIMEType release];
+            _MIMEType = [cacheItem.MIMEType copy];
+            
+            [self callParserBlockWithData:cacheItem.cacheData error:nil];
+            
+            return;
+        }
+        
+        // Stale items are refreshed with a conditional request if they have 
+        // validators, and replaced by the new response otherwise
+        _revalidatedItem = [cacheItem retain];
+        
+        if (_revalidatedItem != nil && _staleWhileRevalidate) {
+            [self serveStaleCacheItem:_revalidatedItem];
+        }
+    }
 
     NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:_requestURL 
-                                                           cachePolicy:(_isCached) ? NSURLRequestReturnCacheDataElseLoad : NSURLRequestReloadIgnoringCacheData 
+                                                           cachePolicy:NSURLRequestReloadIgnoringLocalCacheData 
                                                        timeoutInterval:30.0];
 
-    switch (_requestMethod) {
-        case HPRequestMethodGet:
-            [request setHTTPMethod:@"GET"];
-            break;
-        case HPRequestMethodPost:
-            [request setHTTPMethod:@"POST"];
-            break;
-        case HPRequestMethodDelete:
-            [request setHTTPMethod:@"DELETE"];
-            break;
-        case HPRequestMethodPut:
-            [request setHTTPMethod:@"PUT"];
-            break;
-        case HPRequestMethodPatch:
-            [request setHTTPMethod:@"PATCH"];
-            break;
-    }
+    [request setHTTPMethod:HPRequestMethodName(_requestMethod)];
     
     if (_loggingEnabled) {
         NSMutableString *requestLog = [NSMutableString stringWithFormat:@"%@ %@", 
@@ -134,6 +239,14 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
     [request setValue:@"application/json" forHTTPHeaderField:@"Accept"];
     [request setValue:@"gzip" forHTTPHeaderField:@"Accept-Encoding"];
     
+    if (_revalidatedItem.entityTag != nil) {
+        [request setValue:_revalidatedItem.entityTag forHTTPHeaderField:@"If-None-Match"];
+    }
+    
+    if (_revalidatedItem.lastModified != nil) {
+        [request setValue:_revalidatedItem.lastModified forHTTPHeaderField:@"If-Modified-Since"];
+    }
+    
     if (_requestData) {
         [request setHTTPBody:_requestData];
         
@@ -168,47 +281,139 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
         [cookieHeader release];
     }
     
+    [self performSelector:@selector(startConnectionWithRequest:) 
+                 onThread:[HPRequestOperation networkThread] 
+               withObject:request 
+            waitUntilDone:NO];
+}
+
+#pragma mark - Network thread
+
++ (NSThread *)networkThread {
+    static NSThread *_networkThread = nil;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        _networkThread = [[NSThread alloc] initWithTarget:self 
+                                                 selector:@selector(runNetworkThread:) 
+                                                   object:nil];
+        
+        [_networkThread setName:@"com.hippofoundry.HPUtils.HPRequestOperation.network"];
+        [_networkThread start];
+    });
+    
+    return _networkThread;
+}
+
++ (void)runNetworkThread:(id)object {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+    
+    // The port keeps the run loop alive while no connections are scheduled
+    [runLoop addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+    
+    [pool drain];
+    
+    while (YES) {
+        pool = [[NSAutoreleasePool alloc] init];
+        
+        [runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+        
+        [pool drain];
+    }
+}
+
+- (void)startConnectionWithRequest:(NSURLRequest *)request {
+    // Cancelled while waiting for the network thread. The operation may not 
+    // have been finished by cancel yet, whichever completion reaches the main 
+    // thread first finishes it.
+    if ([self isCancelled]) {
+        [self callParserBlockWithData:nil 
+                                error:[NSError errorWithDomain:kHPErrorDomain 
+                                                          code:kHPRequestConnectionCancelledErrorCode 
+                                                      userInfo:nil]];
+        
+        return;
+    }
+    
+    // Connection callbacks are delivered on this thread, only the completion, 
+    // progress and update blocks are called on the main thread
     _connection = [[NSURLConnection alloc] initWithRequest:request 
                                                   delegate:self 
                                           startImmediately:NO];
     
-    [_connection scheduleInRunLoop:[NSRunLoop mainRunLoop] 
-                           forMode:NSRunLoopCommonModes];
+    [_connection scheduleInRunLoop:[NSRunLoop currentRunLoop] 
+                           forMode:NSDefaultRunLoopMode];
 	
 	if (_connection == nil) {
 		[self cancel];
 	} else {
-        HPCacheItem *cacheItem = nil;
-        
-        if (_isCached) {
-            cacheItem = [[HPCacheManager sharedManager] cachedItemForURL:_requestURL];
-        }
-        
-        if (cacheItem != nil) {
-            [_connection cancel];
-            
-            _MIMEType = [cacheItem.MIMEType copy];
-            
-            [self callParserBlockWithData:cacheItem.cacheData error:nil];
-        } else {
-            [_connection start];
-        }
+        [_connection start];
 	}
 }
 
-- (void)cancel {
+- (void)cancelConnection {
     [_connection cancel];
+    
+    [self discardDownloadFile];
+}
+
+#pragma mark - Parse queue
+
++ (NSOperationQueue *)sharedParseQueue {
+    static NSOperationQueue *_sharedParseQueue = nil;
+    static dispatch_once_t onceToken;
+    
+    dispatch_once(&onceToken, ^{
+        _sharedParseQueue = [[NSOperationQueue alloc] init];
+        
+        [_sharedParseQueue setName:@"com.hippofoundry.HPUtils.HPRequestOperation.parse"];
+        [_sharedParseQueue setMaxConcurrentOperationCount:[[NSProcessInfo processInfo] activeProcessorCount]];
+    });
+    
+    return _sharedParseQueue;
+}
+
+- (void)cancel {
+    HPRequestOperation *leader = nil;
+    BOOL hasSubscribers = NO;
+    
+    @synchronized(_subscribers) {
+        leader = [_leader autorelease];
+        _leader = nil;
+        
+        hasSubscribers = ([_subscribers count] > 0);
+        
+        if (hasSubscribers) {
+            _isDetached = YES;
+        }
+    }
+    
+    if (hasSubscribers) {
+        // Attached requests still wait for the response, so only this 
+        // caller stops listening
+        [self sendCancellationToBlocks];
+        
+        return;
+    }
+    
+    [self performSelector:@selector(cancelConnection) 
+                 onThread:[HPRequestOperation networkThread] 
+               withObject:nil 
+            waitUntilDone:NO];
 	
 	[self willChangeValueForKey:@"isCancelled"];
 	_isCancelled = YES;
 	[self didChangeValueForKey:@"isCancelled"];
     
-    if ([self isExecuting]) {
+    if ([self isExecuting] || leader != nil) {
         [self callParserBlockWithData:nil 
                                 error:[NSError errorWithDomain:kHPErrorDomain 
                                                           code:kHPRequestConnectionCancelledErrorCode 
                                                       userInfo:nil]];
     }
+    
+    [leader removeCoalescedRequest:self];
 }
 
 - (BOOL)isConcurrent {
@@ -227,12 +432,127 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 	return _isExecuting;
 }
 
+#pragma mark - Coalescing
+
+- (NSString *)coalescingKey {
+    // Only safe requests can share a response, every other method has to 
+    // reach the server once per call
+    if (_requestMethod != HPRequestMethodGet) {
+        return nil;
+    }
+    
+    if (_staleWhileRevalidate || _itemBlock != nil || _username != nil || [_cookies count] > 0) {
+        return nil;
+    }
+    
+    // Only the leader stores the response, so cached and uncached requests 
+    // never share one
+    NSMutableString *key = [NSMutableString stringWithFormat:@"%@ %d %@", 
+                            HPRequestMethodName(_requestMethod), _isCached, [_requestURL canonicalString]];
+    
+    if ([_requestData length] > 0) {
+        unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+        
+        CC_SHA1([_requestData bytes], (CC_LONG)[_requestData length], digest);
+        
+        [key appendFormat:@" %d ", _postType];
+        
+        for (NSUInteger i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+            [key appendFormat:@"%02x", digest[i]];
+        }
+    }
+    
+    return key;
+}
+
+- (BOOL)addCoalescedRequest:(HPRequestOperation *)request {
+    if (request == self) {
+        return NO;
+    }
+    
+    @synchronized(_subscribers) {
+        if (_isFinished || _isCancelled || _isDeliveringToSubscribers) {
+            return NO;
+        }
+        
+        @synchronized(request->_subscribers) {
+            if (request->_leader != nil) {
+                return NO;
+            }
+            
+            request->_leader = [self retain];
+        }
+        
+        [_subscribers addObject:request];
+    }
+    
+    return YES;
+}
+
+- (void)removeCoalescedRequest:(HPRequestOperation *)request {
+    BOOL shouldCancel = NO;
+    
+    @synchronized(_subscribers) {
+        [_subscribers removeObjectIdenticalTo:request];
+        
+        shouldCancel = (_isDetached && [_subscribers count] == 0 && !_isDeliveringToSubscribers);
+    }
+    
+    // The last interested caller is gone
+    if (shouldCancel) {
+        [self cancel];
+    }
+}
+
+- (NSArray *)coalescedRequests {
+    @synchronized(_subscribers) {
+        return [[_subscribers copy] autorelease];
+    }
+}
+
+- (void)completeCoalescedRequestWithData:(NSData *)data MIMEType:(NSString *)MIMEType error:(NSError *)error {
+    @synchronized(_subscribers) {
+        // Cancelled while the response was on its way
+        if (_leader == nil) {
+            return;
+        }
+        
+        [_leader autorelease];
+        _leader = nil;
+    }
+    
+    [_MIMEType release];
+    _MIMEType = [MIMEType copy];
+    
+    [self callParserBlockWithData:data error:error];
+}
+
+#pragma mark - Foreground activity
+
+// Each operation holds at most one activity, and every way of finishing 
+// releases it, including cancellation and deallocation
+- (void)beginForegroundActivity {
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &_holdsForegroundActivity)) {
+        [[HPCacheManager sharedManager] beginForegroundActivity];
+    }
+}
+
+- (void)endForegroundActivity {
+    if (OSAtomicCompareAndSwap32Barrier(1, 0, &_holdsForegroundActivity)) {
+        [[HPCacheManager sharedManager] endForegroundActivity];
+    }
+}
+
 #pragma Progress and completion block handling
 
 - (void)addCompletionBlock:(void(^)(id resources, NSError *error))block {
 	[_completionBlocks addObject:[[block copy] autorelease]];
 }
 
+- (void)addFinishBlock:(void(^)(id resources, NSError *error))block {
+    [_finishBlocks addObject:[[block copy] autorelease]];
+}
+
 - (void)sendResourcesToBlocks:(id)resources {
 	if (![NSThread isMainThread]) {
 		[self performSelectorOnMainThread:_cmd 
@@ -257,11 +577,70 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 	[self sendResourcesToBlocks:nil withError:error];
 }
 
+- (void)sendCancellationToBlocks {
+	if (![NSThread isMainThread]) {
+		[self performSelectorOnMainThread:_cmd 
+							   withObject:nil 
+							waitUntilDone:NO];
+		
+		return;
+	}
+    
+    if (_isFinished) {
+        return;
+    }
+    
+    NSError *error = [NSError errorWithDomain:kHPErrorDomain 
+                                         code:kHPRequestConnectionCancelledErrorCode 
+                                     userInfo:nil];
+    
+	for (void(^blk)(id resources, NSError *error) in _completionBlocks) {
+		blk(nil, error);
+	}
+    
+    [_completionBlocks removeAllObjects];
+}
+
 - (void)sendResourcesToBlocks:(id)resources withError:(NSError *)error {
+    // A response that was already on its way to the main thread when the 
+    // operation was cancelled
+    if (_isFinished) {
+        return;
+    }
+    
 	for (void(^blk)(id resources, NSError *error) in _completionBlocks) {
 		blk(resources, error);
 	}
     
+    if (_isServingStaleResponse) {
+        // Keep running to refresh the cache, blocks added from now on will 
+        // receive the result of the refresh, which is these resources again 
+        // if the server confirms them
+        _isServingStaleResponse = NO;
+        _hasServedStaleResponse = YES;
+        
+        [_staleResources release];
+        _staleResources = [resources retain];
+        
+        [_completionBlocks removeAllObjects];
+        
+        return;
+    }
+    
+    // Confirmed stale resources are not an update
+    if (_hasServedStaleResponse && _updateBlock != nil 
+        && resources != _staleResources && (resources != nil || error != nil)) {
+        _updateBlock(resources, error);
+    }
+    
+    for (void(^blk)(id resources, NSError *error) in _finishBlocks) {
+        blk(resources, error);
+    }
+    
+    [_finishBlocks removeAllObjects];
+    
+    [self endForegroundActivity];
+    
 	[self willChangeValueForKey:@"isExecuting"];
 	_isExecuting = NO;
 	[self didChangeValueForKey:@"isExecuting"];
@@ -271,7 +650,49 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 	[self didChangeValueForKey:@"isFinished"];
 }
 
+- (void)sendStaleResourcesToBlocks {
+	if (![NSThread isMainThread]) {
+		[self performSelectorOnMainThread:_cmd 
+							   withObject:nil 
+							waitUntilDone:NO];
+		
+		return;
+	}
+    
+    // Read on the main thread, where the stale response was delivered
+    [self sendResourcesToBlocks:_staleResources withError:nil];
+}
+
 - (void)callParserBlockWithData:(NSData *)data error:(NSError *)error {
+    NSArray *subscribers = nil;
+    BOOL isDetached = NO;
+    
+    @synchronized(_subscribers) {
+        _isDeliveringToSubscribers = YES;
+        
+        subscribers = [[_subscribers copy] autorelease];
+        isDetached = _isDetached;
+        
+        [_subscribers removeAllObjects];
+    }
+    
+    // Attached requests parse the same bytes with their own parser blocks
+    for (HPRequestOperation *subscriber in subscribers) {
+        [subscriber completeCoalescedRequestWithData:data MIMEType:_MIMEType error:error];
+    }
+    
+    if (isDetached) {
+        // Nobody is listening to this request itself any more, only the 
+        // finish blocks still see how the connection ended
+        if (error != nil) {
+            [self sendErrorToBlocks:error];
+        } else {
+            [self sendResourcesToBlocks:nil];
+        }
+        
+        return;
+    }
+    
 	if (data != nil) {
         if ([data length] == 0) {
             [self sendResourcesToBlocks:nil];
@@ -279,35 +700,97 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
             return;
         }
         
-		NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        if (_parseQueue == nil) {
+            [self parseData:data error:error];
+            
+            return;
+        }
         
-		if (![self isCancelled] && _parserBlock != nil) {
-			id parsedData = _parserBlock(data, _MIMEType);
-			
-            if (parsedData == nil) {
-                [self sendErrorToBlocks:[NSError errorWithDomain:kHPErrorDomain 
-                                                            code:kHPRequestParserFailureErrorCode 
-                                                        userInfo:nil]];
-            } else if (error != nil) {
-				[self sendErrorToBlocks:[NSError errorWithDomain:kHPErrorDomain 
-                                                            code:kHPRequestServerFailureErrorCode 
-                                                        userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
-                                                                  parsedData, @"serverError", nil]]];
-            } else {
-				[self sendResourcesToBlocks:parsedData];
-			}
-		} else {
-			[self sendErrorToBlocks:[NSError errorWithDomain:kHPErrorDomain 
-                                                        code:kHPRequestParserFailureErrorCode 
-                                                    userInfo:nil]];
-		}
-		
-		[pool drain];
+        // Keep the network thread and the main thread free while parsing
+        [_parseQueue addOperationWithBlock:^{
+            [self parseData:data error:error];
+        }];
 	} else {
 		[self sendErrorToBlocks:error];
 	}
 }
 
+- (void)parseData:(NSData *)data error:(NSError *)error {
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    
+    NSError *parseError = nil;
+    id resources = [self resourcesFromData:data MIMEType:_MIMEType responseError:error error:&parseError];
+    
+    if (parseError != nil) {
+        [self sendErrorToBlocks:parseError];
+    } else {
+        [self sendResourcesToBlocks:resources];
+    }
+	
+	[pool drain];
+}
+
+- (id)resourcesFromData:(NSData *)data 
+               MIMEType:(NSString *)MIMEType 
+          responseError:(NSError *)responseError 
+                  error:(NSError **)error {
+    if (_itemBlock != nil && responseError == nil) {
+        // Complete bodies, such as cached responses, are split into items too
+        HPJSONArrayStreamParser *streamParser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+        CFAbsoluteTime parseStartTime = CFAbsoluteTimeGetCurrent();
+        NSArray *items = [streamParser itemsByAppendingData:data];
+        
+        _parseDuration = CFAbsoluteTimeGetCurrent() - parseStartTime;
+        
+        if ([streamParser isComplete]) {
+            [self callItemBlockWithItems:items];
+        } else {
+            *error = [NSError errorWithDomain:kHPErrorDomain 
+                                         code:kHPRequestParserFailureErrorCode 
+                                     userInfo:nil];
+        }
+        
+        return nil;
+    }
+    
+	if ([self isCancelled] || _parserBlock == nil) {
+        *error = [NSError errorWithDomain:kHPErrorDomain 
+                                     code:kHPRequestParserFailureErrorCode 
+                                 userInfo:nil];
+        
+        return nil;
+    }
+    
+    CFAbsoluteTime parseStartTime = CFAbsoluteTimeGetCurrent();
+    id parsedData = _parserBlock(data, MIMEType);
+    
+    _parseDuration = CFAbsoluteTimeGetCurrent() - parseStartTime;
+    
+    if (_loggingEnabled) {
+        NSLog(@"Parsed %@ in %.1f ms", [_requestURL absoluteString], _parseDuration * 1000.0);
+    }
+    
+    if ([self isCancelled]) {
+        // Cancelled while parsing, the result is no longer wanted
+        *error = [NSError errorWithDomain:kHPErrorDomain 
+                                     code:kHPRequestConnectionCancelledErrorCode 
+                                 userInfo:nil];
+    } else if (parsedData == nil) {
+        *error = [NSError errorWithDomain:kHPErrorDomain 
+                                     code:kHPRequestParserFailureErrorCode 
+                                 userInfo:nil];
+    } else if (responseError != nil) {
+        *error = [NSError errorWithDomain:kHPErrorDomain 
+                                     code:kHPRequestServerFailureErrorCode 
+                                 userInfo:[NSDictionary dictionaryWithObjectsAndKeys:
+                                           parsedData, @"serverError", nil]];
+    } else {
+        return parsedData;
+    }
+    
+    return nil;
+}
+
 - (void)callProgressBlockWithPercentage:(NSNumber *)percentage {
 	if (![NSThread isMainThread]) {
 		[self performSelectorOnMainThread:_cmd 
@@ -320,6 +803,29 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 	if (![self isCancelled] && _progressBlock != nil) {
 		_progressBlock([percentage floatValue]);
 	}
+    
+    // Attached requests follow the shared connection
+    for (HPRequestOperation *subscriber in [self coalescedRequests]) {
+        [subscriber callProgressBlockWithPercentage:percentage];
+    }
+}
+
+- (void)callItemBlockWithItems:(NSArray *)items {
+	if (![NSThread isMainThread]) {
+		[self performSelectorOnMainThread:_cmd 
+							   withObject:items 
+							waitUntilDone:NO];
+		
+		return;
+	}
+	
+	if ([self isCancelled] || _isFinished || _itemBlock == nil) {
+        return;
+	}
+    
+    for (id item in items) {
+        _itemBlock(item);
+    }
 }
 
 - (void)callUploadProgressBlockWithPercentage:(NSNumber *)percentage {
@@ -334,6 +840,217 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 	if (![self isCancelled] && _uploadProgressBlock != nil) {
 		_uploadProgressBlock([percentage floatValue]);
 	}
+    
+    for (HPRequestOperation *subscriber in [self coalescedRequests]) {
+        [subscriber callUploadProgressBlockWithPercentage:percentage];
+    }
+}
+
+#pragma mark - Streaming
+
+// Chunks are parsed on the parseQueue in arrival order, at most one drain runs 
+// at a time for each operation. A nil chunk marks the end of the body.
+- (void)enqueueStreamData:(NSData *)data {
+    BOOL shouldDrain = NO;
+    
+    @synchronized(_streamChunks) {
+        if (data != nil) {
+            [_streamChunks addObject:data];
+        } else {
+            _hasStreamEnded = YES;
+        }
+        
+        shouldDrain = !_isDrainingStream;
+        _isDrainingStream = YES;
+    }
+    
+    if (!shouldDrain) {
+        return;
+    }
+    
+    if (_parseQueue == nil) {
+        [self drainStreamChunks];
+        
+        return;
+    }
+    
+    [_parseQueue addOperationWithBlock:^{
+        [self drainStreamChunks];
+    }];
+}
+
+- (void)drainStreamChunks {
+    while (YES) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSData *data = nil;
+        BOOL hasEnded = NO;
+        
+        @synchronized(_streamChunks) {
+            if ([_streamChunks count] == 0) {
+                _isDrainingStream = NO;
+                hasEnded = _hasStreamEnded;
+            } else {
+                data = [[[_streamChunks objectAtIndex:0] retain] autorelease];
+                
+                [_streamChunks removeObjectAtIndex:0];
+            }
+        }
+        
+        if (data == nil) {
+            [pool drain];
+            
+            if (hasEnded) {
+                [self finishStreamParsing];
+            }
+            
+            return;
+        }
+        
+        if (![self isCancelled] && ![_streamParser hasFailed]) {
+            NSArray *items = [_streamParser itemsByAppendingData:data];
+            
+            if ([items count] > 0) {
+                [self callItemBlockWithItems:items];
+            }
+            
+            // No point in downloading the rest of a body that can not be parsed
+            if ([_streamParser hasFailed]) {
+                [self performSelector:@selector(cancelFailedStream) 
+                             onThread:[HPRequestOperation networkThread] 
+                           withObject:nil 
+                        waitUntilDone:NO];
+            }
+        }
+        
+        [pool drain];
+    }
+}
+
+- (void)finishStreamParsing {
+    if ([_streamParser isComplete]) {
+        // All items have been delivered already
+        [self sendResourcesToBlocks:nil];
+    } else {
+        [self callParserBlockWithData:nil 
+                                error:[NSError errorWithDomain:kHPErrorDomain 
+                                                          code:kHPRequestParserFailureErrorCode 
+                                                      userInfo:nil]];
+    }
+}
+
+- (void)cancelFailedStream {
+    // The download finished first, the end of the stream reports the failure
+    if (_connection == nil) {
+        return;
+    }
+    
+    [_connection cancel];
+    [_connection release], _connection = nil;
+    
+    [self discardDownloadFile];
+    
+    [self callParserBlockWithData:nil 
+                            error:[NSError errorWithDomain:kHPErrorDomain 
+                                                      code:kHPRequestParserFailureErrorCode 
+                                                  userInfo:nil]];
+}
+
+#pragma mark - Download file
+
+- (BOOL)openDownloadFile {
+    NSString *downloadPath = [[HPCacheManager sharedManager] temporaryPathForURL:_requestURL];
+    
+    if (downloadPath == nil) {
+        return NO;
+    }
+    
+    _downloadFileDescriptor = open([downloadPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_EXCL, 0644);
+    
+    if (_downloadFileDescriptor < 0) {
+        return NO;
+    }
+    
+    _downloadPath = [downloadPath copy];
+    _downloadBuffer = [[NSMutableData alloc] initWithCapacity:HPRequestOperationDownloadBufferLength];
+    
+    return YES;
+}
+
+- (BOOL)flushDownloadBuffer {
+    const uint8_t *bytes = [_downloadBuffer bytes];
+    NSUInteger length = [_downloadBuffer length];
+    
+    while (length > 0) {
+        ssize_t written = write(_downloadFileDescriptor, bytes, length);
+        
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            return NO;
+        }
+        
+        bytes += written;
+        length -= written;
+    }
+    
+    [_downloadBuffer setLength:0];
+    
+    return YES;
+}
+
+- (NSData *)dataFromDownloadFile {
+    BOOL success = [self flushDownloadBuffer];
+    
+    if (close(_downloadFileDescriptor) != 0) {
+        success = NO;
+    }
+    
+    _downloadFileDescriptor = -1;
+    
+    NSData *data = nil;
+    
+    if (success && _isCached && [_response isKindOfClass:[NSHTTPURLResponse class]]) {
+        // The file becomes the cache entry, the body is never copied
+        data = [[[HPCacheManager sharedManager] cacheFileAtPath:_downloadPath 
+                                                         forURL:_requestURL 
+                                                       response:(NSHTTPURLResponse *)_response] cacheData];
+    }
+    
+    if (success && data == nil) {
+        data = [NSData dataWithContentsOfFile:_downloadPath 
+                                      options:NSDataReadingMappedIfSafe 
+                                        error:nil];
+        
+        if (data != nil && _isCached && ![_response isKindOfClass:[NSHTTPURLResponse class]]) {
+            [[HPCacheManager sharedManager] cacheData:data 
+                                               forURL:_requestURL 
+                                         withMIMEType:_MIMEType];
+        }
+    }
+    
+    // A mapping stays valid after its file is removed
+    [self discardDownloadFile];
+    
+    return data;
+}
+
+- (void)discardDownloadFile {
+    if (_downloadPath == nil) {
+        return;
+    }
+    
+    if (_downloadFileDescriptor >= 0) {
+        close(_downloadFileDescriptor);
+        
+        _downloadFileDescriptor = -1;
+    }
+    
+    unlink([_downloadPath fileSystemRepresentation]);
+    
+    [_downloadPath release], _downloadPath = nil;
+    [_downloadBuffer release], _downloadBuffer = nil;
 }
 
 #pragma mark - NSURLConnectionDelegate calls
@@ -372,7 +1089,29 @@ static NSUInteger const HPRequestOperationDataLoggingLimit = 50 * 1024;
 				_expectedSize = 0;
 			}
             
-			_loadedData = [[NSMutableData alloc] initWithCapacity:_expectedSize];
+            _receivedLength = 0;
+            
+            // Error bodies are always small enough to keep in memory
+            if (_downloadsToFile && statusCode < 300 && ![self openDownloadFile]) {
+                [connection cancel];
+                
+                [self callParserBlockWithData:nil 
+                                        error:[NSError errorWithDomain:kHPErrorDomain 
+                                                                  code:kHPRequestFileFailureErrorCode 
+                                                              userInfo:nil]];
+                
+                break;
+            }
+            
+            // Successful responses of streaming requests are parsed as they 
+            // arrive, the body is only kept if it has to be cached
+            if (_itemBlock != nil && statusCode < 300) {
+                _streamParser = [[HPJSONArrayStreamParser alloc] init];
+            }
+            
+            if (_downloadPath == nil && (_streamParser == nil || _isCached)) {
+                _loadedData = [[NSMutableData alloc] initWithCapacity:_expectedSize];
+            }
 			
 			break;
 		}
@@ -387,15 +1126,48 @@ totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite {
 }
 
 - (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data {
-    [_loadedData appendData:data];
+    if (_downloadPath != nil) {
+        [_downloadBuffer appendData:data];
+        
+        if ([_downloadBuffer length] >= HPRequestOperationDownloadBufferLength && ![self flushDownloadBuffer]) {
+            [connection cancel];
+            [_connection release], _connection = nil;
+            
+            [self discardDownloadFile];
+            
+            [self callParserBlockWithData:nil 
+                                    error:[NSError errorWithDomain:kHPErrorDomain 
+                                                              code:kHPRequestFileFailureErrorCode 
+                                                          userInfo:nil]];
+            
+            return;
+        }
+    } else {
+        [_loadedData appendData:data];
+    }
+    
+    _receivedLength += [data length];
+    
+    if (_streamParser != nil) {
+        [self enqueueStreamData:data];
+    }
 	
-	if (_progressBlock != nil) {
-		[self callProgressBlockWithPercentage:[NSNumber numberWithFloat:((float)[_loadedData length] / (float)_expectedSize)]];
+	if (_expectedSize > 0 && (_progressBlock != nil || [[self coalescedRequests] count] > 0)) {
+        float progress = MIN((float)_receivedLength / (float)_expectedSize, 1.0);
+        
+        // Avoid flooding the main thread with an update for every chunk
+        if (progress - _reportedProgress >= HPRequestOperationProgressReportingStep || progress >= 1.0) {
+            _reportedProgress = progress;
+            
+            [self callProgressBlockWithPercentage:[NSNumber numberWithFloat:progress]];
+        }
 	}
 }
 
 - (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error {
 	[_connection release], _connection = nil;
+    
+    [self discardDownloadFile];
 
     if ([error code] == kHPNetworkErrorCode) {
         [self callParserBlockWithData:nil 
@@ -421,7 +1193,25 @@ totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite {
 		statusCode = [(NSHTTPURLResponse *)_response statusCode];
 	}
     
-	if (statusCode == 304 || statusCode >= 400) {
+	if (statusCode == 304 && _revalidatedItem != nil) {
+        // Not modified, keep the cached bytes and extend their lifetime
+        HPCacheItem *cacheItem = [[HPCacheManager sharedManager] refreshCachedItem:_revalidatedItem 
+                                                                      withResponse:(NSHTTPURLResponse *)_response];
+        
+        if (_staleWhileRevalidate) {
+            // The stale resources are still valid, so they are not parsed 
+            // again. The stale response was queued for the main thread before 
+            // the connection started, so this can not overtake it. Unlike 
+            // _hasServedStaleResponse, the mode is never written by another 
+            // thread.
+            [self sendStaleResourcesToBlocks];
+        } else {
+            [_MIMEType release];
+            _MIMEType = [cacheItem.MIMEType copy];
+            
+            [self callParserBlockWithData:cacheItem.cacheData error:nil];
+        }
+    } else if (statusCode == 304 || statusCode >= 400) {
         switch (statusCode) {
             case 400: {
                 [self callParserBlockWithData:_loadedData 
@@ -442,21 +1232,56 @@ totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite {
         }
 	} else {
 		if (_isCached) {
+            [_MIMEType release];
+            
 			if ([_response respondsToSelector:@selector(MIMEType)]) {
 				_MIMEType = [[(NSHTTPURLResponse *)_response MIMEType] copy];
 			} else {
 				_MIMEType = [[NSString alloc] initWithString:@"text/plain"];
 			}
             
-			[[HPCacheManager sharedManager] cacheData:_loadedData 
-											   forURL:_requestURL 
-										 withMIMEType:_MIMEType];
+            if (_downloadPath != nil) {
+                // Cached when the file is closed below
+            } else if ([_response isKindOfClass:[NSHTTPURLResponse class]]) {
+                [[HPCacheManager sharedManager] cacheData:_loadedData 
+                                                   forURL:_requestURL 
+                                                 response:(NSHTTPURLResponse *)_response];
+            } else {
+                [[HPCacheManager sharedManager] cacheData:_loadedData 
+                                                   forURL:_requestURL 
+                                             withMIMEType:_MIMEType];
+            }
 		}
 		
-		[self callParserBlockWithData:_loadedData error:nil];
+        NSData *data = _loadedData;
+        
+        if (_downloadPath != nil) {
+            data = [self dataFromDownloadFile];
+            
+            if (data == nil) {
+                [self callParserBlockWithData:nil 
+                                        error:[NSError errorWithDomain:kHPErrorDomain 
+                                                                  code:kHPRequestFileFailureErrorCode 
+                                                              userInfo:nil]];
+                
+                return;
+            }
+        }
+        
+        if (_streamParser == nil) {
+            [self callParserBlockWithData:data error:nil];
+        } else {
+            // Completes once the chunks still queued have been parsed
+            [self enqueueStreamData:nil];
+        }
 	}
 }
 
+- (NSCachedURLResponse *)connection:(NSURLConnection *)connection willCacheResponse:(NSCachedURLResponse *)cachedResponse {
+    // Responses are cached by HPCacheManager only
+    return nil;
+}
+
 - (NSInputStream *)connection:(NSURLConnection *)connection needNewBodyStream:(NSURLRequest *)request {
     return [NSInputStream inputStreamWithData:_requestData];
 }
@@ -521,16 +1346,27 @@ totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite {
 }
 
 - (BOOL)completeRequestWithCachedResponse {
-    if (![self hasCachedResponseAvailable]) {
+    if (![self hasCachedResponseAvailable] || _revalidatedItem != nil) {
         return NO;
     }
     
-    HPCacheItem *cacheItem = [[HPCacheManager sharedManager] cachedItemForURL:_requestURL];
+    HPCacheItem *cacheItem = [[HPCacheManager sharedManager] cachedItemForURL:_requestURL 
+                                                                   allowStale:_staleWhileRevalidate];
     
     if (cacheItem == nil) {
         return NO;
     }
     
+    if ([cacheItem isStale]) {
+        // Serve the stale response now, the request still has to run to refresh it
+        _revalidatedItem = [cacheItem retain];
+        
+        [self serveStaleCacheItem:cacheItem];
+        
+        return NO;
+    }
+    
+    [_MIMEType release];
     _MIMEType = [cacheItem.MIMEType copy];
     
     [self callParserBlockWithData:cacheItem.cacheData error:nil];
@@ -538,10 +1374,119 @@ totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite {
     return YES;
 }
 
+- (void)completeRequestWithCachedResponseInBackground:(void (^)(BOOL completed))block {
+    if (!_isCached || _revalidatedItem != nil) {
+        block(NO);
+        
+        return;
+    }
+    
+    [_cacheLookupBlock release];
+    _cacheLookupBlock = [block copy];
+    
+    [[HPCacheManager sharedManager] cachedItemForURL:_requestURL 
+                                          allowStale:_staleWhileRevalidate 
+                                          completion:^(HPCacheItem *cacheItem) {
+        // The cache read queue only does I/O, cached bytes are parsed on the 
+        // parseQueue like a response from the network
+        if (cacheItem == nil || _parseQueue == nil) {
+            [self parseCachedItem:cacheItem];
+            
+            return;
+        }
+        
+        [_parseQueue addOperationWithBlock:^{
+            [self parseCachedItem:cacheItem];
+        }];
+    }];
+}
+
+- (void)parseCachedItem:(HPCacheItem *)cacheItem {
+    NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:4];
+    
+    // The operation itself is updated on the main thread along with the 
+    // lookup result
+    if (cacheItem != nil && ![self isCancelled]) {
+        NSError *error = nil;
+        id resources = nil;
+        
+        if ([cacheItem.cacheData length] > 0) {
+            resources = [self resourcesFromData:cacheItem.cacheData 
+                                       MIMEType:cacheItem.MIMEType 
+                                  responseError:nil 
+                                          error:&error];
+        }
+        
+        [result setObject:cacheItem forKey:HPRequestOperationCacheLookupItemKey];
+        [result setObject:[NSNumber numberWithBool:[cacheItem isStale]] forKey:HPRequestOperationCacheLookupStaleKey];
+        
+        if (resources != nil) {
+            [result setObject:resources forKey:HPRequestOperationCacheLookupResourcesKey];
+        }
+        
+        if (error != nil) {
+            [result setObject:error forKey:HPRequestOperationCacheLookupErrorKey];
+        }
+    }
+    
+    [self performSelectorOnMainThread:@selector(finishCacheLookupWithResult:) 
+                           withObject:result 
+                        waitUntilDone:NO];
+}
+
+- (void)finishCacheLookupWithResult:(NSDictionary *)result {
+    void (^block)(BOOL) = [_cacheLookupBlock autorelease];
+    HPCacheItem *cacheItem = [result objectForKey:HPRequestOperationCacheLookupItemKey];
+    BOOL completed = NO;
+    
+    _cacheLookupBlock = nil;
+    
+    // Cancellation is checked on the same thread that cancels, right before 
+    // the resources are delivered ahead of the lookup result
+    if (cacheItem != nil && ![self isCancelled]) {
+        [_MIMEType release];
+        _MIMEType = [cacheItem.MIMEType copy];
+        
+        if ([[result objectForKey:HPRequestOperationCacheLookupStaleKey] boolValue]) {
+            // Serve the stale response now, the request still has to run to refresh it
+            [_revalidatedItem release];
+            _revalidatedItem = [cacheItem retain];
+            
+            _isServingStaleResponse = YES;
+        } else {
+            completed = YES;
+        }
+        
+        [self sendResourcesToBlocks:[result objectForKey:HPRequestOperationCacheLookupResourcesKey] 
+                          withError:[result objectForKey:HPRequestOperationCacheLookupErrorKey]];
+    }
+    
+    block(completed);
+}
+
+- (void)serveStaleCacheItem:(HPCacheItem *)cacheItem {
+    _isServingStaleResponse = YES;
+    
+    [_MIMEType release];
+    _MIMEType = [cacheItem.MIMEType copy];
+    
+    // Parsed right away instead of on the parse queue, so the stale resources 
+    // are on their way to the main thread before the lookup result and before 
+    // anything the refresh delivers
+    if ([cacheItem.cacheData length] == 0) {
+        [self sendResourcesToBlocks:nil];
+    } else {
+        [self parseData:cacheItem.cacheData error:nil];
+    }
+}
+
 #pragma mark - Memory management
 
 - (void)dealloc {
 	[_connection cancel];
+    
+    [self discardDownloadFile];
+    [self endForegroundActivity];
 
     [_cookies release], _cookies = nil;
 	[_MIMEType release], _MIMEType = nil;
@@ -554,9 +1499,20 @@ totalBytesExpectedToWrite:(NSInteger)totalBytesExpectedToWrite {
     [_requestData release], _requestData = nil;
 	[_parserBlock release], _parserBlock = nil;
 	[_progressBlock release], _progressBlock = nil;
+    [_updateBlock release], _updateBlock = nil;
+    [_cacheLookupBlock release], _cacheLookupBlock = nil;
     [_completionBlocks release], _completionBlocks = nil;
+    [_finishBlocks release], _finishBlocks = nil;
     [_uploadProgressBlock release], _uploadProgressBlock = nil;
     [_startTime release], _startTime = nil;
+    [_revalidatedItem release], _revalidatedItem = nil;
+    [_staleResources release], _staleResources = nil;
+    [_subscribers release], _subscribers = nil;
+    [_parseQueue release], _parseQueue = nil;
+    [_itemBlock release], _itemBlock = nil;
+    [_streamParser release], _streamParser = nil;
+    [_streamChunks release], _streamChunks = nil;
+    [_leader release], _leader = nil;
     [_username release], _username = nil;
     [_password release], _password = nil;
 	
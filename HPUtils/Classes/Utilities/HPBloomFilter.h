@@ -0,0 +1,75 @@
+//
+//  HPBloomFilter.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-18.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+
+/** Counting Bloom filter over string keys
+
+ Answers whether a key may be in a set, with no false negatives and a small 
+ rate of false positives. Each slot is a 4-bit counter instead of a single bit, 
+ so keys can be removed as well as added. Counters that reach their maximum 
+ stick there, which can only cause false positives.
+
+ Adding and removing keys must be serialized by the caller. Lookups take no 
+ locks and can run concurrently with changes, in which case a key that is 
+ being added or removed at the same time may be reported either way.
+
+ Removing a key that was never added breaks the no false negatives guarantee, 
+ so callers should only remove keys they know to be in the set.
+ */
+@interface HPBloomFilter : NSObject {
+@private
+    uint8_t *_counters;
+    NSUInteger _slotCount;
+    NSUInteger _hashCount;
+    NSUInteger _capacity;
+    NSUInteger _count;
+}
+
+/** Number of keys the filter was sized for
+
+ Adding more keys than this keeps the filter correct but increases the false 
+ positive rate.
+ */
+@property (nonatomic, readonly) NSUInteger capacity;
+
+/** Number of keys currently in the filter
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/** Initializes an empty filter
+
+ @param capacity Expected number of keys
+ @param falsePositiveRate Target false positive rate at capacity, between 0 and 1
+ */
+- (id)initWithCapacity:(NSUInteger)capacity falsePositiveRate:(double)falsePositiveRate;
+
+/** Adds a key
+
+ @param key Key to add
+ */
+- (void)addKey:(NSString *)key;
+
+/** Removes a key that was previously added
+
+ @param key Key to remove
+ */
+- (void)removeKey:(NSString *)key;
+
+/** Checks whether a key may be in the filter
+
+ @param key Key to search for
+
+ @returns BOOL NO if the key is definitely not in the filter
+ */
+- (BOOL)mayContainKey:(NSString *)key;
+
+/** Removes all keys
+ */
+- (void)removeAllKeys;
+
+@end
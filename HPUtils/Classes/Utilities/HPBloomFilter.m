@@ -0,0 +1,178 @@
+//
+//  HPBloomFilter.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-18.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#include <math.h>
+
+#import "HPBloomFilter.h"
+
+
+static NSUInteger const kHPBloomFilterMinimumCapacity = 64;
+static uint8_t const kHPBloomFilterCounterMax = 0x0F;
+
+// Keys are hashed from a stack buffer when their UTF-8 form fits into it
+static NSUInteger const kHPBloomFilterKeyBufferLength = 256;
+
+
+// FNV-1a over the key bytes, followed by a 64-bit finalizer to derive a second
+// independent hash. Slots are picked by double hashing, h1 + i * h2.
+static void HPBloomFilterHashKey(NSString *key, uint64_t *h1, uint64_t *h2) {
+    char buffer[kHPBloomFilterKeyBufferLength];
+    const char *bytes = buffer;
+
+    if (![key getCString:buffer maxLength:sizeof(buffer) encoding:NSUTF8StringEncoding]) {
+        bytes = [key UTF8String];
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const char *cursor = bytes; cursor != NULL && *cursor != '\0'; cursor++) {
+        hash ^= (uint8_t)*cursor;
+        hash *= 1099511628211ULL;
+    }
+
+    uint64_t mixed = hash;
+
+    mixed ^= mixed >> 33;
+    mixed *= 0xFF51AFD7ED558CCDULL;
+    mixed ^= mixed >> 33;
+    mixed *= 0xC4CEB9FE1A85EC53ULL;
+    mixed ^= mixed >> 33;
+
+    *h1 = hash;
+    *h2 = mixed | 1;
+}
+
+static inline uint8_t HPBloomFilterCounter(const uint8_t *counters, NSUInteger slot) {
+    uint8_t byte = counters[slot >> 1];
+
+    return (slot & 1) ? (byte >> 4) : (byte & 0x0F);
+}
+
+static inline void HPBloomFilterSetCounter(uint8_t *counters, NSUInteger slot, uint8_t value) {
+    uint8_t *byte = &counters[slot >> 1];
+
+    if (slot & 1) {
+        *byte = (uint8_t)((*byte & 0x0F) | (value << 4));
+    } else {
+        *byte = (uint8_t)((*byte & 0xF0) | value);
+    }
+}
+
+
+@implementation HPBloomFilter
+
+@synthesize capacity = _capacity;
+@synthesize count = _count;
+
+- (id)init {
+    return [self initWithCapacity:4096 falsePositiveRate:0.01];
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity falsePositiveRate:(double)falsePositiveRate {
+    self = [super init];
+
+    if (self) {
+        if (falsePositiveRate <= 0.0 || falsePositiveRate >= 1.0) {
+            falsePositiveRate = 0.01;
+        }
+
+        _capacity = MAX(capacity, kHPBloomFilterMinimumCapacity);
+        _count = 0;
+
+        double slotCount = ceil(-(double)_capacity * log(falsePositiveRate) / (M_LN2 * M_LN2));
+
+        _slotCount = (NSUInteger)slotCount;
+        _hashCount = MAX((NSUInteger)round(slotCount / _capacity * M_LN2), 1);
+        _counters = calloc((_slotCount + 1) / 2, sizeof(uint8_t));
+    }
+
+    return self;
+}
+
+#pragma mark - Access
+
+- (void)addKey:(NSString *)key {
+    if (key == nil) {
+        return;
+    }
+
+    uint64_t h1, h2;
+
+    HPBloomFilterHashKey(key, &h1, &h2);
+
+    for (NSUInteger i = 0; i < _hashCount; i++) {
+        NSUInteger slot = (NSUInteger)((h1 + i * h2) % _slotCount);
+        uint8_t counter = HPBloomFilterCounter(_counters, slot);
+
+        if (counter < kHPBloomFilterCounterMax) {
+            HPBloomFilterSetCounter(_counters, slot, counter + 1);
+        }
+    }
+
+    _count++;
+}
+
+- (void)removeKey:(NSString *)key {
+    if (key == nil) {
+        return;
+    }
+
+    uint64_t h1, h2;
+
+    HPBloomFilterHashKey(key, &h1, &h2);
+
+    for (NSUInteger i = 0; i < _hashCount; i++) {
+        NSUInteger slot = (NSUInteger)((h1 + i * h2) % _slotCount);
+        uint8_t counter = HPBloomFilterCounter(_counters, slot);
+
+        // Saturated counters no longer know how many keys share them
+        if (counter > 0 && counter < kHPBloomFilterCounterMax) {
+            HPBloomFilterSetCounter(_counters, slot, counter - 1);
+        }
+    }
+
+    if (_count > 0) {
+        _count--;
+    }
+}
+
+- (BOOL)mayContainKey:(NSString *)key {
+    if (key == nil) {
+        return NO;
+    }
+
+    uint64_t h1, h2;
+
+    HPBloomFilterHashKey(key, &h1, &h2);
+
+    for (NSUInteger i = 0; i < _hashCount; i++) {
+        NSUInteger slot = (NSUInteger)((h1 + i * h2) % _slotCount);
+
+        if (HPBloomFilterCounter(_counters, slot) == 0) {
+            return NO;
+        }
+    }
+
+    return YES;
+}
+
+- (void)removeAllKeys {
+    memset(_counters, 0, (_slotCount + 1) / 2);
+
+    _count = 0;
+}
+
+#pragma mark - Memory management
+
+- (void)dealloc {
+    free(_counters), _counters = NULL;
+
+    [super dealloc];
+}
+
+@end
@@ -0,0 +1,239 @@
+//
+//  HPCacheIndex.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-11.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+@class HPBloomFilter;
+
+/** Index record for a single file in a cache directory
+ */
+@interface HPCacheIndexEntry : NSObject {
+@private
+    NSString *_key;
+    NSString *_MIMEType;
+    unsigned long long _size;
+    NSTimeInterval _timeStamp;
+    NSTimeInterval _expirationTime;
+    NSTimeInterval _accessTime;
+}
+
+/** Key of the entry, which is also its file name
+ */
+@property (nonatomic, readonly, copy) NSString *key;
+
+/** MIME type of the stored file
+ */
+@property (nonatomic, readonly, copy) NSString *MIMEType;
+
+/** Size of the file on disk in bytes
+ */
+@property (nonatomic, readonly, assign) unsigned long long size;
+
+/** Storage time of the entry as an interval since the reference date
+ */
+@property (nonatomic, readonly, assign) NSTimeInterval timeStamp;
+
+/** Time after which the entry is no longer fresh, as an interval since the 
+ reference date
+ */
+@property (nonatomic, readonly, assign) NSTimeInterval expirationTime;
+
+/** Last access time of the entry as an interval since the reference date
+ */
+@property (nonatomic, readonly, assign) NSTimeInterval accessTime;
+
++ (HPCacheIndexEntry *)entryWithKey:(NSString *)key
+                               size:(unsigned long long)size
+                          timeStamp:(NSTimeInterval)timeStamp
+                     expirationTime:(NSTimeInterval)expirationTime
+                           MIMEType:(NSString *)MIMEType;
+
+- (id)initWithKey:(NSString *)key
+             size:(unsigned long long)size
+        timeStamp:(NSTimeInterval)timeStamp
+   expirationTime:(NSTimeInterval)expirationTime
+         MIMEType:(NSString *)MIMEType;
+
+@end
+
+
+/** Persistent key to size, time stamp, expiration and MIME type index for a cache directory
+
+ The index lives in memory and is persisted as an append-only log of checksummed
+ records inside the directory it describes, so lookups and sweeps never have to
+ open the cache files themselves. The log is compacted into a fresh snapshot
+ when it accumulates too many superseded records.
+
+ Once loaded, the index also keeps a counting Bloom filter over its keys, which 
+ answers most lookups for missing keys without taking the lock.
+
+ If the previous session did not shut down cleanly, or the log has a torn or
+ corrupt tail, loading reconciles the index with the directory contents: files
+ without a record are added through the entry block and records without a file
+ are dropped.
+
+ A shared index can be used by several processes for the same directory. 
+ Appends and compactions are then serialized with an advisory lock on a lock 
+ file, and every process applies the records the others appended before 
+ writing its own, so all of them follow the same log. Local changes are 
+ visible in memory right away and are applied again on top of records other 
+ processes logged before them, so memory always matches the order of the log.
+ */
+@interface HPCacheIndex : NSObject {
+@private
+    NSString *_directoryPath;
+    NSString *_logPath;
+    NSString *_markerPath;
+    NSString *_lockPath;
+    NSMutableDictionary *_entries;
+    NSMutableArray *_pendingOperations;
+    dispatch_queue_t _logQueue;
+    NSLock *_lock;
+    HPBloomFilter *_filter;
+    NSMutableArray *_retiredFilters;
+    volatile int32_t _filterReaderCount;
+    NSMutableData *_unloggedRecords;
+    NSUInteger _unloggedRecordCount;
+    NSUInteger _recordCount;
+    unsigned long long _totalSize;
+    int _logDescriptor;
+    int _lockDescriptor;
+    unsigned long long _logOffset;
+    uint64_t _logInode;
+    BOOL _shared;
+    BOOL _loaded;
+    BOOL _dirty;
+    BOOL _flushScheduled;
+    volatile int32_t _refreshScheduled;
+}
+
+/** Directory described by this index
+ */
+@property (nonatomic, readonly, copy) NSString *directoryPath;
+
+/** Total size of all indexed files in bytes
+
+ This is maintained incrementally, so checking it is cheap.
+ */
+@property (readonly) unsigned long long totalSize;
+
+/** Whether the index has finished loading
+
+ Until the index is loaded, callers should fall back to the file system.
+ */
+@property (readonly, getter=isLoaded) BOOL loaded;
+
+/** Initializes an index for a directory
+
+ @param directoryPath Path of the cache directory
+ */
+- (id)initWithDirectoryPath:(NSString *)directoryPath;
+
+/** Initializes an index for a directory that may be shared between processes
+
+ @param directoryPath Path of the cache directory
+ @param shared Whether other processes use the same directory
+ */
+- (id)initWithDirectoryPath:(NSString *)directoryPath shared:(BOOL)shared;
+
+/** Loads the index from disk, recovering from an unclean shutdown if necessary
+
+ This call performs file I/O and should not be made on the main thread.
+
+ Files are looked up directly in the directory and in one level of 
+ subdirectories, and are keyed by their file name either way.
+
+ @param entryBlock Block that reads the index entry for a file in the
+ directory, given its key and full path. Only called for files that are 
+ missing from the index during recovery. Can return nil for files that are not 
+ valid cache entries.
+ */
+- (void)loadWithEntryBlock:(HPCacheIndexEntry *(^)(NSString *key, NSString *path))entryBlock;
+
+/** Returns the entry for a key
+
+ @param key Key to search for
+
+ @returns HPCacheIndexEntry instance, or nil
+ */
+- (HPCacheIndexEntry *)entryForKey:(NSString *)key;
+
+/** Checks whether an entry is available for a key
+
+ @param key Key to search for
+
+ @returns BOOL Boolean that determines whether an entry is available
+ */
+- (BOOL)containsKey:(NSString *)key;
+
+/** Checks whether a key may be in the index without taking the lock
+
+ Always returns YES until the index is loaded. Once it is, NO means the key is 
+ definitely not in the index.
+
+ @param key Key to search for
+
+ @returns BOOL NO if the key is definitely not in the index
+ */
+- (BOOL)mayContainKey:(NSString *)key;
+
+/** Applies changes other processes made to a shared index in the background
+
+ Never blocks the caller, later lookups see the changes once they are applied. 
+ Only one refresh is scheduled at a time, and it only costs a stat call when 
+ nothing changed. Does nothing for an index that is not shared or not loaded 
+ yet.
+ */
+- (void)refreshFromSharedLog;
+
+/** Returns all entries that expired before a given date
+
+ @param date Cut-off date
+
+ @returns An array of HPCacheIndexEntry instances
+ */
+- (NSArray *)entriesExpiredBeforeDate:(NSDate *)date;
+
+/** Returns the least recently used entries
+
+ @param count Maximum number of entries to return
+
+ @returns An array of HPCacheIndexEntry instances, least recently used first
+ */
+- (NSArray *)leastRecentlyUsedEntries:(NSUInteger)count;
+
+/** Marks the entry for a key as accessed now
+
+ Touches only update the entry in memory and never allocate or write to the 
+ log, access times are persisted with the next snapshot of the log. A touch is 
+ dropped when the lock is busy. Access times only order evictions, so a lost 
+ touch is harmless.
+
+ @param key Key to touch
+ */
+- (void)touchKey:(NSString *)key;
+
+/** Adds or replaces an entry
+
+ @param entry Entry to store
+ */
+- (void)addEntry:(HPCacheIndexEntry *)entry;
+
+/** Removes the entry for a key
+
+ @param key Key to remove
+ */
+- (void)removeEntryForKey:(NSString *)key;
+
+/** Flushes pending records and marks the index as cleanly shut down
+
+ Called when the application moves to the background or terminates. Blocks 
+ while another process holds the shared files and syncs them to disk, so it 
+ should not be called on the main thread.
+ */
+- (void)synchronize;
+
+@end
@@ -0,0 +1,1198 @@
+//
+//  HPCacheIndex.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-11.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libkern/OSAtomic.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#import "HPBloomFilter.h"
+#import "HPCacheIndex.h"
+
+
+static NSString * const kHPCacheIndexLogFilename = @".index";
+static NSString * const kHPCacheIndexMarkerFilename = @".index-dirty";
+static NSString * const kHPCacheIndexLockFilename = @".index-lock";
+
+static uint32_t const kHPCacheIndexMagic = 0x49435048; // "HPCI"
+static uint32_t const kHPCacheIndexVersion = 3;
+
+// Number of superseded records tolerated in the log before it is compacted
+static NSUInteger const kHPCacheIndexCompactionSlack = 1024;
+
+// Key filter sizing, the filter is rebuilt with twice the headroom whenever the 
+// number of keys outgrows it
+static NSUInteger const kHPCacheIndexFilterMinimumCapacity = 4096;
+static double const kHPCacheIndexFilterFalsePositiveRate = 0.01;
+
+// Touches are no longer logged, access times reach the log with snapshots. 
+// Touch records in logs of earlier versions are still replayed.
+enum {
+    HPCacheIndexOperationAdd = 'A',
+    HPCacheIndexOperationRemove = 'R',
+    HPCacheIndexOperationTouch = 'T',
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} __attribute__((packed)) HPCacheIndexFileHeader;
+
+typedef struct {
+    uint32_t checksum;
+    uint16_t keyLength;
+    uint8_t MIMELength;
+    uint8_t operation;
+    uint64_t size;
+    double timeStamp;
+    double expirationTime;
+    double accessTime;
+} __attribute__((packed)) HPCacheIndexRecordHeader;
+
+
+// FNV-1a, only used to detect torn or corrupt records
+static uint32_t HPCacheIndexChecksum(const uint8_t *bytes, size_t length) {
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static void HPCacheIndexAppendRecord(NSMutableData *buffer,
+                                     uint8_t operation,
+                                     NSString *key,
+                                     unsigned long long size,
+                                     NSTimeInterval timeStamp,
+                                     NSTimeInterval expirationTime,
+                                     NSTimeInterval accessTime,
+                                     NSString *MIMEType) {
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *MIMEData = [MIMEType dataUsingEncoding:NSUTF8StringEncoding];
+
+    if (keyData == nil || [keyData length] > UINT16_MAX) {
+        return;
+    }
+
+    if ([MIMEData length] > UINT8_MAX) {
+        MIMEData = nil;
+    }
+
+    HPCacheIndexRecordHeader header;
+
+    header.checksum = 0;
+    header.keyLength = (uint16_t)[keyData length];
+    header.MIMELength = (uint8_t)[MIMEData length];
+    header.operation = operation;
+    header.size = size;
+    header.timeStamp = timeStamp;
+    header.expirationTime = expirationTime;
+    header.accessTime = accessTime;
+
+    NSUInteger recordOffset = [buffer length];
+
+    [buffer appendBytes:&header length:sizeof(header)];
+    [buffer appendData:keyData];
+
+    if (MIMEData != nil) {
+        [buffer appendData:MIMEData];
+    }
+
+    uint8_t *record = (uint8_t *)[buffer mutableBytes] + recordOffset;
+    uint32_t checksum = HPCacheIndexChecksum(record + sizeof(uint32_t),
+                                             [buffer length] - recordOffset - sizeof(uint32_t));
+
+    memcpy(record, &checksum, sizeof(checksum));
+}
+
+static void HPCacheIndexAppendOperation(NSMutableData *buffer, id operation) {
+    if ([operation isKindOfClass:[HPCacheIndexEntry class]]) {
+        HPCacheIndexEntry *entry = (HPCacheIndexEntry *)operation;
+
+        HPCacheIndexAppendRecord(buffer, HPCacheIndexOperationAdd,
+                                 entry.key, entry.size, entry.timeStamp, entry.expirationTime,
+                                 entry.accessTime, entry.MIMEType);
+    } else {
+        HPCacheIndexAppendRecord(buffer, HPCacheIndexOperationRemove,
+                                 (NSString *)operation, 0, 0.0, 0.0, 0.0, nil);
+    }
+}
+
+
+@interface HPCacheIndexEntry (PrivateMethods)
+- (void)setAccessTime:(NSTimeInterval)accessTime;
+@end
+
+
+@implementation HPCacheIndexEntry
+
+@synthesize key = _key;
+@synthesize MIMEType = _MIMEType;
+@synthesize size = _size;
+@synthesize timeStamp = _timeStamp;
+@synthesize expirationTime = _expirationTime;
+@synthesize accessTime = _accessTime;
+
++ (HPCacheIndexEntry *)entryWithKey:(NSString *)key
+                               size:(unsigned long long)size
+                          timeStamp:(NSTimeInterval)timeStamp
+                     expirationTime:(NSTimeInterval)expirationTime
+                           MIMEType:(NSString *)MIMEType {
+    return [[[HPCacheIndexEntry alloc] initWithKey:key
+                                              size:size
+                                         timeStamp:timeStamp
+                                    expirationTime:expirationTime
+                                          MIMEType:MIMEType] autorelease];
+}
+
+- (id)initWithKey:(NSString *)key
+             size:(unsigned long long)size
+        timeStamp:(NSTimeInterval)timeStamp
+   expirationTime:(NSTimeInterval)expirationTime
+         MIMEType:(NSString *)MIMEType {
+    self = [super init];
+
+    if (self) {
+        _key = [key copy];
+        _MIMEType = [MIMEType copy];
+        _size = size;
+        _timeStamp = timeStamp;
+        _expirationTime = expirationTime;
+        _accessTime = timeStamp;
+    }
+
+    return self;
+}
+
+- (void)setAccessTime:(NSTimeInterval)accessTime {
+    _accessTime = accessTime;
+}
+
+- (void)dealloc {
+    [_key release], _key = nil;
+    [_MIMEType release], _MIMEType = nil;
+
+    [super dealloc];
+}
+
+@end
+
+
+@interface HPCacheIndex (PrivateMethods)
+- (NSUInteger)replayLogData:(NSData *)logData recordCount:(NSUInteger *)recordCount;
+- (NSUInteger)replayRecordBytes:(const uint8_t *)bytes length:(NSUInteger)length recordCount:(NSUInteger *)recordCount;
+- (void)recoverKey:(NSString *)key
+            atPath:(NSString *)path
+      existingKeys:(NSMutableSet *)existingKeys
+        entryBlock:(HPCacheIndexEntry *(^)(NSString *key, NSString *path))entryBlock;
+- (void)applyOperation:(id)operation;
+- (void)rebuildFilter;
+- (void)releaseRetiredFilters;
+- (void)enqueueOperations:(NSArray *)operations;
+- (void)enqueueRecords:(NSData *)records count:(NSUInteger)recordCount;
+- (void)flushUnloggedRecords;
+- (void)openLogIfNeeded;
+- (void)writeSnapshot;
+- (BOOL)needsCompaction;
+- (void)lockSharedFiles;
+- (void)unlockSharedFiles;
+- (BOOL)catchUpWithSharedLog;
+- (NSArray *)deadProcessMarkerPaths;
+@end
+
+
+@implementation HPCacheIndex
+
+@synthesize directoryPath = _directoryPath;
+
+- (id)initWithDirectoryPath:(NSString *)directoryPath {
+    return [self initWithDirectoryPath:directoryPath shared:NO];
+}
+
+- (id)initWithDirectoryPath:(NSString *)directoryPath shared:(BOOL)shared {
+    self = [super init];
+
+    if (self) {
+        _shared = shared;
+        _directoryPath = [directoryPath copy];
+        _logPath = [[directoryPath stringByAppendingPathComponent:kHPCacheIndexLogFilename] copy];
+        _lockPath = [[directoryPath stringByAppendingPathComponent:kHPCacheIndexLockFilename] copy];
+
+        // Every process sharing the directory keeps its own marker, so one of 
+        // them shutting down cleanly does not hide a crash of another
+        if (_shared) {
+            _markerPath = [[directoryPath stringByAppendingPathComponent:
+                            [NSString stringWithFormat:@"%@-%d", kHPCacheIndexMarkerFilename, getpid()]] copy];
+        } else {
+            _markerPath = [[directoryPath stringByAppendingPathComponent:kHPCacheIndexMarkerFilename] copy];
+        }
+
+        _entries = [[NSMutableDictionary alloc] init];
+        _pendingOperations = [[NSMutableArray alloc] init];
+        _retiredFilters = [[NSMutableArray alloc] init];
+        _filter = nil;
+        _filterReaderCount = 0;
+        _unloggedRecords = [[NSMutableData alloc] init];
+        _unloggedRecordCount = 0;
+        _flushScheduled = NO;
+        _refreshScheduled = 0;
+        _lock = [[NSLock alloc] init];
+        _logQueue = dispatch_queue_create("com.hippofoundry.HPUtils.HPCacheIndex", DISPATCH_QUEUE_SERIAL);
+        _logDescriptor = -1;
+        _lockDescriptor = -1;
+        _logOffset = 0;
+        _logInode = 0;
+        _recordCount = 0;
+        _totalSize = 0;
+        _loaded = NO;
+        _dirty = NO;
+    }
+
+    return self;
+}
+
+#pragma mark - Loading and recovery
+
+- (void)loadWithEntryBlock:(HPCacheIndexEntry *(^)(NSString *key, NSString *path))entryBlock {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+
+    // Other processes cannot append to or replace the log while it is read
+    [self lockSharedFiles];
+
+    struct stat logStatus;
+
+    if (stat([_logPath fileSystemRepresentation], &logStatus) == 0) {
+        _logInode = (uint64_t)logStatus.st_ino;
+    }
+
+    NSData *logData = [NSData dataWithContentsOfFile:_logPath
+                                             options:NSDataReadingMappedIfSafe
+                                               error:nil];
+
+    // A leftover marker means the previous session never reached synchronize
+    BOOL needsRecovery = [fileManager fileExistsAtPath:_markerPath];
+    NSArray *deadMarkerPaths = [self deadProcessMarkerPaths];
+    HPCacheIndexFileHeader header;
+
+    if ([deadMarkerPaths count] > 0) {
+        needsRecovery = YES;
+    }
+
+    if (logData != nil && [logData length] >= sizeof(header)) {
+        memcpy(&header, [logData bytes], sizeof(header));
+
+        if (header.magic == kHPCacheIndexMagic && header.version == kHPCacheIndexVersion) {
+            NSUInteger recordCount = 0;
+
+            [_lock lock];
+
+            _logOffset = [self replayLogData:logData recordCount:&recordCount];
+            _recordCount += recordCount;
+
+            [_lock unlock];
+
+            if (_logOffset < [logData length]) {
+                needsRecovery = YES;
+            }
+        } else {
+            needsRecovery = YES;
+        }
+    } else {
+        needsRecovery = YES;
+    }
+
+    [self unlockSharedFiles];
+
+    if (needsRecovery) {
+        NSArray *fileNames = [fileManager contentsOfDirectoryAtPath:_directoryPath error:nil];
+        NSMutableSet *existingKeys = [NSMutableSet setWithCapacity:[fileNames count]];
+
+        for (NSString *fileName in fileNames) {
+            if ([fileName hasPrefix:@"."]) {
+                continue;
+            }
+
+            NSString *path = [_directoryPath stringByAppendingPathComponent:fileName];
+            BOOL isDirectory = NO;
+
+            if (![fileManager fileExistsAtPath:path isDirectory:&isDirectory]) {
+                continue;
+            }
+
+            // Shard directories are recovered one at a time, so only a single 
+            // shard listing is alive at any point
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+            if (isDirectory) {
+                for (NSString *shardFileName in [fileManager contentsOfDirectoryAtPath:path error:nil]) {
+                    if ([shardFileName hasPrefix:@"."]) {
+                        continue;
+                    }
+
+                    [self recoverKey:shardFileName
+                              atPath:[path stringByAppendingPathComponent:shardFileName]
+                        existingKeys:existingKeys
+                          entryBlock:entryBlock];
+                }
+            } else {
+                [self recoverKey:fileName atPath:path existingKeys:existingKeys entryBlock:entryBlock];
+            }
+
+            [pool drain];
+        }
+
+        [_lock lock];
+
+        for (NSString *key in [_entries allKeys]) {
+            if (![existingKeys containsObject:key]) {
+                [self applyOperation:key];
+            }
+        }
+
+        [_lock unlock];
+    }
+
+    [_lock lock];
+
+    // Changes made while loading were held back, apply them on top of the
+    // loaded state and log them before anything that comes after
+    for (id operation in _pendingOperations) {
+        [self applyOperation:operation];
+    }
+
+    BOOL needsSnapshot = (needsRecovery || [self needsCompaction]);
+
+    dispatch_async(_logQueue, ^{
+        if (needsSnapshot) {
+            [self writeSnapshot];
+        } else {
+            [self lockSharedFiles];
+            [self openLogIfNeeded];
+            [self unlockSharedFiles];
+        }
+
+        // Crashed processes are covered by the snapshot from here on
+        for (NSString *markerPath in deadMarkerPaths) {
+            unlink([markerPath fileSystemRepresentation]);
+        }
+    });
+
+    if (!needsSnapshot) {
+        [self enqueueOperations:_pendingOperations];
+    }
+
+    [_pendingOperations removeAllObjects];
+
+    [self rebuildFilter];
+
+    _loaded = YES;
+
+    [_lock unlock];
+}
+
+// Must be called with the lock held
+- (NSUInteger)replayLogData:(NSData *)logData recordCount:(NSUInteger *)recordCount {
+    NSUInteger headerLength = sizeof(HPCacheIndexFileHeader);
+
+    if ([logData length] < headerLength) {
+        return 0;
+    }
+
+    return headerLength + [self replayRecordBytes:(const uint8_t *)[logData bytes] + headerLength
+                                           length:[logData length] - headerLength
+                                      recordCount:recordCount];
+}
+
+// Must be called with the lock held. Returns the length of the valid records 
+// at the start of the buffer.
+- (NSUInteger)replayRecordBytes:(const uint8_t *)bytes length:(NSUInteger)length recordCount:(NSUInteger *)recordCount {
+    NSUInteger offset = 0;
+    NSUInteger count = 0;
+
+    while (offset + sizeof(HPCacheIndexRecordHeader) <= length) {
+        HPCacheIndexRecordHeader header;
+
+        memcpy(&header, bytes + offset, sizeof(header));
+
+        NSUInteger recordLength = sizeof(header) + header.keyLength + header.MIMELength;
+
+        if (offset + recordLength > length) {
+            break;
+        }
+
+        if (HPCacheIndexChecksum(bytes + offset + sizeof(uint32_t), recordLength - sizeof(uint32_t)) != header.checksum) {
+            break;
+        }
+
+        NSString *key = [[NSString alloc] initWithBytes:bytes + offset + sizeof(header)
+                                                 length:header.keyLength
+                                               encoding:NSUTF8StringEncoding];
+
+        if (key == nil) {
+            break;
+        }
+
+        if (header.operation == HPCacheIndexOperationAdd) {
+            NSString *MIMEType = nil;
+
+            if (header.MIMELength > 0) {
+                MIMEType = [[[NSString alloc] initWithBytes:bytes + offset + sizeof(header) + header.keyLength
+                                                     length:header.MIMELength
+                                                   encoding:NSUTF8StringEncoding] autorelease];
+            }
+
+            HPCacheIndexEntry *entry = [[HPCacheIndexEntry alloc] initWithKey:key
+                                                                         size:header.size
+                                                                    timeStamp:header.timeStamp
+                                                               expirationTime:header.expirationTime
+                                                                     MIMEType:MIMEType];
+
+            [entry setAccessTime:header.accessTime];
+            [self applyOperation:entry];
+
+            [entry release];
+        } else if (header.operation == HPCacheIndexOperationRemove) {
+            [self applyOperation:key];
+        } else if (header.operation == HPCacheIndexOperationTouch) {
+            [[_entries objectForKey:key] setAccessTime:header.accessTime];
+        } else {
+            [key release];
+
+            break;
+        }
+
+        [key release];
+
+        offset += recordLength;
+        count += 1;
+    }
+
+    if (recordCount != NULL) {
+        *recordCount = count;
+    }
+
+    return offset;
+}
+
+- (void)recoverKey:(NSString *)key
+            atPath:(NSString *)path
+      existingKeys:(NSMutableSet *)existingKeys
+        entryBlock:(HPCacheIndexEntry *(^)(NSString *key, NSString *path))entryBlock {
+    [existingKeys addObject:key];
+
+    [_lock lock];
+    BOOL isIndexed = ([_entries objectForKey:key] != nil);
+    [_lock unlock];
+
+    if (isIndexed || entryBlock == nil) {
+        return;
+    }
+
+    HPCacheIndexEntry *entry = entryBlock(key, path);
+
+    if (entry != nil) {
+        [_lock lock];
+        [self applyOperation:entry];
+        [_lock unlock];
+    }
+}
+
+#pragma mark - Lookups
+
+- (BOOL)isLoaded {
+    [_lock lock];
+    BOOL loaded = _loaded;
+    [_lock unlock];
+
+    return loaded;
+}
+
+- (HPCacheIndexEntry *)entryForKey:(NSString *)key {
+    if (key == nil) {
+        return nil;
+    }
+
+    [_lock lock];
+    HPCacheIndexEntry *entry = [[_entries objectForKey:key] retain];
+    [_lock unlock];
+
+    return [entry autorelease];
+}
+
+- (BOOL)mayContainKey:(NSString *)key {
+    if (key == nil) {
+        return NO;
+    }
+
+    // Readers are counted so replaced filters are only released once nobody 
+    // can still be using them
+    OSAtomicIncrement32Barrier(&_filterReaderCount);
+
+    HPBloomFilter *filter = _filter;
+    BOOL mayContainKey = (filter == nil || [filter mayContainKey:key]);
+
+    OSAtomicDecrement32Barrier(&_filterReaderCount);
+
+    return mayContainKey;
+}
+
+- (BOOL)containsKey:(NSString *)key {
+    if (![self mayContainKey:key]) {
+        return NO;
+    }
+
+    [_lock lock];
+    BOOL containsKey = ([_entries objectForKey:key] != nil);
+    [_lock unlock];
+
+    return containsKey;
+}
+
+- (unsigned long long)totalSize {
+    [_lock lock];
+    unsigned long long totalSize = _totalSize;
+    [_lock unlock];
+
+    return totalSize;
+}
+
+- (NSArray *)leastRecentlyUsedEntries:(NSUInteger)count {
+    [_lock lock];
+    NSArray *entries = [_entries allValues];
+    [_lock unlock];
+
+    NSArray *sortedEntries = [entries sortedArrayUsingComparator:^NSComparisonResult(id first, id second) {
+        NSTimeInterval firstAccessTime = [(HPCacheIndexEntry *)first accessTime];
+        NSTimeInterval secondAccessTime = [(HPCacheIndexEntry *)second accessTime];
+
+        if (firstAccessTime < secondAccessTime) {
+            return NSOrderedAscending;
+        } else if (firstAccessTime > secondAccessTime) {
+            return NSOrderedDescending;
+        }
+
+        return NSOrderedSame;
+    }];
+
+    if ([sortedEntries count] <= count) {
+        return sortedEntries;
+    }
+
+    return [sortedEntries subarrayWithRange:NSMakeRange(0, count)];
+}
+
+- (NSArray *)entriesExpiredBeforeDate:(NSDate *)date {
+    NSTimeInterval cutOff = [date timeIntervalSinceReferenceDate];
+    NSMutableArray *entries = [NSMutableArray array];
+
+    [_lock lock];
+
+    for (HPCacheIndexEntry *entry in [_entries objectEnumerator]) {
+        if (entry.expirationTime < cutOff) {
+            [entries addObject:entry];
+        }
+    }
+
+    [_lock unlock];
+
+    return entries;
+}
+
+#pragma mark - Mutations
+
+- (void)addEntry:(HPCacheIndexEntry *)entry {
+    if (entry.key == nil) {
+        return;
+    }
+
+    [_lock lock];
+
+    if (_loaded) {
+        [self applyOperation:entry];
+        [self enqueueOperations:[NSArray arrayWithObject:entry]];
+    } else {
+        [_pendingOperations addObject:entry];
+    }
+
+    [_lock unlock];
+}
+
+- (void)touchKey:(NSString *)key {
+    if (key == nil) {
+        return;
+    }
+
+    // Every cache hit ends up here, so a touch never waits for a snapshot or 
+    // a recovery holding the lock and is dropped instead
+    if (![_lock tryLock]) {
+        return;
+    }
+
+    [[_entries objectForKey:key] setAccessTime:[NSDate timeIntervalSinceReferenceDate]];
+
+    [_lock unlock];
+}
+
+- (void)removeEntryForKey:(NSString *)key {
+    if (key == nil) {
+        return;
+    }
+
+    NSString *operation = [[key copy] autorelease];
+
+    [_lock lock];
+
+    if (_loaded) {
+        [self applyOperation:operation];
+        [self enqueueOperations:[NSArray arrayWithObject:operation]];
+    } else {
+        [_pendingOperations addObject:operation];
+    }
+
+    [_lock unlock];
+}
+
+// Must be called with the lock held
+- (void)applyOperation:(id)operation {
+    NSString *key = nil;
+
+    if ([operation isKindOfClass:[HPCacheIndexEntry class]]) {
+        key = [(HPCacheIndexEntry *)operation key];
+    } else {
+        key = (NSString *)operation;
+    }
+
+    HPCacheIndexEntry *previousEntry = [_entries objectForKey:key];
+
+    if (previousEntry != nil) {
+        _totalSize -= MIN(_totalSize, previousEntry.size);
+
+        [_entries removeObjectForKey:key];
+    }
+
+    if ([operation isKindOfClass:[HPCacheIndexEntry class]]) {
+        _totalSize += [(HPCacheIndexEntry *)operation size];
+
+        [_entries setObject:operation forKey:key];
+
+        if (previousEntry == nil) {
+            [_filter addKey:key];
+
+            if (_filter != nil && [_filter count] > [_filter capacity]) {
+                [self rebuildFilter];
+            }
+        }
+    } else if (previousEntry != nil) {
+        [_filter removeKey:key];
+    }
+}
+
+// Must be called with the lock held
+- (void)rebuildFilter {
+    NSUInteger capacity = MAX(2 * [_entries count], kHPCacheIndexFilterMinimumCapacity);
+    HPBloomFilter *filter = [[HPBloomFilter alloc] initWithCapacity:capacity
+                                                  falsePositiveRate:kHPCacheIndexFilterFalsePositiveRate];
+
+    for (NSString *key in _entries) {
+        [filter addKey:key];
+    }
+
+    // Lookups read the filter without the lock, so the one being replaced is 
+    // kept alive until no lookup can still hold it
+    if (_filter != nil) {
+        [_retiredFilters addObject:_filter];
+        [_filter release];
+    }
+
+    OSMemoryBarrier();
+
+    _filter = filter;
+
+    [self releaseRetiredFilters];
+}
+
+// Must be called with the lock held
+- (void)releaseRetiredFilters {
+    OSMemoryBarrier();
+
+    // Lookups that start from here on read the current filter, so the retired 
+    // ones are unused as soon as no lookup is in progress
+    if ([_retiredFilters count] > 0 && _filterReaderCount == 0) {
+        [_retiredFilters removeAllObjects];
+    }
+}
+
+// Must be called with the lock held, so records reach the log in the same
+// order the changes were applied in memory
+- (void)enqueueOperations:(NSArray *)operations {
+    if ([operations count] == 0) {
+        return;
+    }
+
+    NSMutableData *records = [NSMutableData data];
+
+    for (id operation in operations) {
+        HPCacheIndexAppendOperation(records, operation);
+    }
+
+    [self enqueueRecords:records count:[operations count]];
+}
+
+// Must be called with the lock held. The changes are already applied in 
+// memory, and are kept until they are in the log so they can be applied again 
+// on top of what other processes logged in the meantime.
+- (void)enqueueRecords:(NSData *)records count:(NSUInteger)recordCount {
+    if (recordCount == 0) {
+        return;
+    }
+
+    [_unloggedRecords appendData:records];
+
+    _unloggedRecordCount += recordCount;
+
+    if (_flushScheduled) {
+        return;
+    }
+
+    _flushScheduled = YES;
+
+    dispatch_async(_logQueue, ^{
+        [self flushUnloggedRecords];
+    });
+}
+
+// Must be called on the log queue
+- (void)flushUnloggedRecords {
+    // Apply what other processes appended first, so the log stays in a 
+    // single order for everyone and memory follows the same order
+    [self lockSharedFiles];
+
+    if (_shared) {
+        [self catchUpWithSharedLog];
+    }
+
+    [_lock lock];
+
+    NSData *records = [[_unloggedRecords copy] autorelease];
+    NSUInteger recordCount = _unloggedRecordCount;
+
+    [_unloggedRecords setLength:0];
+
+    _unloggedRecordCount = 0;
+    _flushScheduled = NO;
+
+    [_lock unlock];
+
+    [self openLogIfNeeded];
+
+    const uint8_t *cursor = (const uint8_t *)[records bytes];
+    size_t remaining = [records length];
+
+    while (_logDescriptor >= 0 && remaining > 0) {
+        ssize_t written = write(_logDescriptor, cursor, remaining);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        cursor += written;
+        remaining -= written;
+    }
+
+    struct stat logStatus;
+
+    if (_shared && _logDescriptor >= 0 && fstat(_logDescriptor, &logStatus) == 0) {
+        _logOffset = (unsigned long long)logStatus.st_size;
+    }
+
+    [self unlockSharedFiles];
+
+    [_lock lock];
+
+    _recordCount += recordCount;
+
+    BOOL needsCompaction = [self needsCompaction];
+
+    [self releaseRetiredFilters];
+
+    [_lock unlock];
+
+    if (needsCompaction) {
+        [self writeSnapshot];
+    }
+}
+
+#pragma mark - Log file handling
+
+// Must be called with the lock held
+- (BOOL)needsCompaction {
+    return _recordCount > 2 * [_entries count] + kHPCacheIndexCompactionSlack;
+}
+
+// Must be called on the log queue
+- (void)openLogIfNeeded {
+    if (!_dirty) {
+        int marker = open([_markerPath fileSystemRepresentation], O_WRONLY | O_CREAT, 0644);
+
+        if (marker >= 0) {
+            close(marker);
+        }
+
+        _dirty = YES;
+    }
+
+    if (_logDescriptor >= 0) {
+        return;
+    }
+
+    _logDescriptor = open([_logPath fileSystemRepresentation], O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+    if (_logDescriptor >= 0 && lseek(_logDescriptor, 0, SEEK_END) == 0) {
+        HPCacheIndexFileHeader header;
+
+        header.magic = kHPCacheIndexMagic;
+        header.version = kHPCacheIndexVersion;
+
+        if (write(_logDescriptor, &header, sizeof(header)) != sizeof(header)) {
+            close(_logDescriptor);
+
+            _logDescriptor = -1;
+        } else {
+            _logOffset = sizeof(header);
+        }
+    }
+
+    struct stat logStatus;
+
+    if (_logDescriptor >= 0 && fstat(_logDescriptor, &logStatus) == 0) {
+        _logInode = (uint64_t)logStatus.st_ino;
+    }
+}
+
+// Must be called on the log queue
+- (void)writeSnapshot {
+    [self lockSharedFiles];
+
+    // The snapshot replaces the log, so it has to include everything other 
+    // processes appended to it
+    if (_shared) {
+        [self catchUpWithSharedLog];
+    }
+
+    NSMutableData *snapshot = [[NSMutableData alloc] init];
+    HPCacheIndexFileHeader header;
+
+    header.magic = kHPCacheIndexMagic;
+    header.version = kHPCacheIndexVersion;
+
+    [snapshot appendBytes:&header length:sizeof(header)];
+
+    [_lock lock];
+
+    for (HPCacheIndexEntry *entry in [_entries objectEnumerator]) {
+        HPCacheIndexAppendOperation(snapshot, entry);
+    }
+
+    NSUInteger recordCount = [_entries count];
+
+    [_lock unlock];
+
+    // Records that are not in the log yet are part of the snapshot as well, 
+    // logging them again afterwards is harmless
+
+    if (_logDescriptor >= 0) {
+        close(_logDescriptor);
+
+        _logDescriptor = -1;
+    }
+
+    NSError *error = nil;
+
+    if ([snapshot writeToFile:_logPath options:NSDataWritingAtomic error:&error]) {
+        [_lock lock];
+        _recordCount = recordCount;
+        [_lock unlock];
+
+        _logOffset = [snapshot length];
+    } else {
+        NSLog(@">>> CACHE INDEX ERROR: %@", error);
+    }
+
+    [snapshot release];
+
+    [self openLogIfNeeded];
+    [self unlockSharedFiles];
+}
+
+#pragma mark - Sharing between processes
+
+- (void)lockSharedFiles {
+    if (!_shared) {
+        return;
+    }
+
+    if (_lockDescriptor < 0) {
+        _lockDescriptor = open([_lockPath fileSystemRepresentation], O_RDONLY | O_CREAT, 0644);
+    }
+
+    while (_lockDescriptor >= 0 && flock(_lockDescriptor, LOCK_EX) != 0 && errno == EINTR) {
+        // Retry when interrupted by a signal
+    }
+}
+
+- (void)unlockSharedFiles {
+    if (_shared && _lockDescriptor >= 0) {
+        flock(_lockDescriptor, LOCK_UN);
+    }
+}
+
+// Must be called on the log queue with the shared files locked. Returns whether 
+// any records of other processes were applied.
+- (BOOL)catchUpWithSharedLog {
+    struct stat logStatus;
+
+    if (stat([_logPath fileSystemRepresentation], &logStatus) != 0) {
+        return NO;
+    }
+
+    // Another process compacted the log into a new file, start over from it
+    BOOL reload = ((uint64_t)logStatus.st_ino != _logInode);
+    NSData *changes = nil;
+
+    if (reload) {
+        changes = [NSData dataWithContentsOfFile:_logPath
+                                         options:NSDataReadingMappedIfSafe
+                                           error:nil];
+    } else if ((unsigned long long)logStatus.st_size > _logOffset) {
+        int fd = open([_logPath fileSystemRepresentation], O_RDONLY);
+
+        if (fd < 0) {
+            return NO;
+        }
+
+        NSMutableData *tail = [NSMutableData dataWithLength:(NSUInteger)(logStatus.st_size - _logOffset)];
+        ssize_t length = pread(fd, [tail mutableBytes], [tail length], (off_t)_logOffset);
+
+        close(fd);
+
+        if (length > 0) {
+            [tail setLength:(NSUInteger)length];
+
+            changes = tail;
+        }
+    }
+
+    if (changes == nil) {
+        return NO;
+    }
+
+    NSUInteger recordCount = 0;
+    NSUInteger replayedLength = 0;
+    NSDictionary *previousEntries = nil;
+    HPBloomFilter *filter = nil;
+
+    [_lock lock];
+
+    if (reload) {
+        // The filter is detached while the entries are replaced, lookups 
+        // treat a missing filter as a possible hit
+        filter = _filter;
+        _filter = nil;
+
+        OSMemoryBarrier();
+
+        previousEntries = [_entries autorelease];
+        _entries = [[NSMutableDictionary alloc] initWithCapacity:[previousEntries count]];
+        _totalSize = 0;
+        _recordCount = 0;
+
+        replayedLength = [self replayLogData:changes recordCount:&recordCount];
+
+        _logOffset = replayedLength;
+        _logInode = (uint64_t)logStatus.st_ino;
+    } else {
+        replayedLength = [self replayRecordBytes:(const uint8_t *)[changes bytes]
+                                          length:[changes length]
+                                     recordCount:&recordCount];
+
+        _logOffset += replayedLength;
+    }
+
+    _recordCount += recordCount;
+
+    // Local changes that are not in the log yet will be appended after these 
+    // records, so they are applied again to take precedence the same way
+    if (reload || recordCount > 0) {
+        [self replayRecordBytes:(const uint8_t *)[_unloggedRecords bytes]
+                         length:[_unloggedRecords length]
+                    recordCount:NULL];
+    }
+
+    if (reload) {
+        // Counting filters can drop keys, so the same filter is brought up to 
+        // date instead of being replaced by a new one of the same size
+        for (NSString *key in previousEntries) {
+            if ([_entries objectForKey:key] == nil) {
+                [filter removeKey:key];
+            }
+        }
+
+        for (NSString *key in _entries) {
+            HPCacheIndexEntry *previousEntry = [previousEntries objectForKey:key];
+
+            if (previousEntry == nil) {
+                [filter addKey:key];
+            } else {
+                HPCacheIndexEntry *entry = [_entries objectForKey:key];
+
+                // Touches are not logged, so access times are carried over 
+                // from the entries being replaced
+                if (entry.accessTime < previousEntry.accessTime) {
+                    [entry setAccessTime:previousEntry.accessTime];
+                }
+            }
+        }
+
+        OSMemoryBarrier();
+
+        _filter = filter;
+
+        if (_filter != nil && [_filter count] > [_filter capacity]) {
+            [self rebuildFilter];
+        }
+    }
+
+    [_lock unlock];
+
+    if (reload && _logDescriptor >= 0) {
+        close(_logDescriptor);
+
+        _logDescriptor = -1;
+    }
+
+    return (reload || recordCount > 0);
+}
+
+- (NSArray *)deadProcessMarkerPaths {
+    if (!_shared) {
+        return nil;
+    }
+
+    NSString *markerPrefix = [kHPCacheIndexMarkerFilename stringByAppendingString:@"-"];
+    NSMutableArray *markerPaths = [NSMutableArray array];
+
+    for (NSString *fileName in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_directoryPath error:nil]) {
+        if (![fileName hasPrefix:markerPrefix]) {
+            continue;
+        }
+
+        pid_t pid = (pid_t)[[fileName substringFromIndex:[markerPrefix length]] intValue];
+
+        if (pid > 0 && pid != getpid() && kill(pid, 0) != 0 && errno == ESRCH) {
+            [markerPaths addObject:[_directoryPath stringByAppendingPathComponent:fileName]];
+        }
+    }
+
+    return markerPaths;
+}
+
+- (void)refreshFromSharedLog {
+    if (!_shared || ![self isLoaded]) {
+        return;
+    }
+
+    // Lookups never wait for the log queue or the lock file, one catch-up at 
+    // a time runs in the background instead
+    if (!OSAtomicCompareAndSwap32Barrier(0, 1, &_refreshScheduled)) {
+        return;
+    }
+
+    dispatch_async(_logQueue, ^{
+        OSAtomicCompareAndSwap32Barrier(1, 0, &_refreshScheduled);
+
+        struct stat logStatus;
+
+        // Cheap check first, the log only changes when something was stored 
+        // or removed
+        if (stat([_logPath fileSystemRepresentation], &logStatus) != 0
+            || ((uint64_t)logStatus.st_ino == _logInode && (unsigned long long)logStatus.st_size == _logOffset)) {
+            return;
+        }
+
+        [self lockSharedFiles];
+        [self catchUpWithSharedLog];
+        [self unlockSharedFiles];
+    });
+}
+
+- (void)synchronize {
+    [_lock lock];
+    BOOL loaded = _loaded;
+    [_lock unlock];
+
+    if (!loaded) {
+        return;
+    }
+
+    dispatch_sync(_logQueue, ^{
+        [_lock lock];
+        BOOL needsCompaction = [self needsCompaction];
+        [_lock unlock];
+
+        if (needsCompaction) {
+            [self writeSnapshot];
+        }
+
+        if (_logDescriptor >= 0) {
+            fsync(_logDescriptor);
+        }
+
+        unlink([_markerPath fileSystemRepresentation]);
+
+        _dirty = NO;
+    });
+}
+
+#pragma mark - Memory management
+
+- (void)dealloc {
+    if (_logDescriptor >= 0) {
+        close(_logDescriptor);
+    }
+
+    if (_lockDescriptor >= 0) {
+        close(_lockDescriptor);
+    }
+
+    dispatch_release(_logQueue);
+
+    [_lock release], _lock = nil;
+    [_entries release], _entries = nil;
+    [_pendingOperations release], _pendingOperations = nil;
+    [_filter release], _filter = nil;
+    [_retiredFilters release], _retiredFilters = nil;
+    [_unloggedRecords release], _unloggedRecords = nil;
+    [_directoryPath release], _directoryPath = nil;
+    [_logPath release], _logPath = nil;
+    [_markerPath release], _markerPath = nil;
+    [_lockPath release], _lockPath = nil;
+
+    [super dealloc];
+}
+
+@end
@@ -0,0 +1,61 @@
+//
+//  HPJSONArrayStreamParser.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-21.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+
+/** Incremental parser for a top-level JSON array
+
+ Takes the body of a JSON array in chunks, as they arrive from the network, 
+ and returns each element of the array as soon as its last byte has been 
+ seen. Only the bytes of the element that is currently incomplete are kept, 
+ the rest of the body can be released right after it is passed in.
+
+ The tokenizer only tracks nesting, strings and escapes to find element 
+ boundaries. Each complete element is handed to NSJSONSerialization, so 
+ elements are validated as strictly as a full parse would.
+
+ Instances are not thread safe, chunks have to be appended in order from a 
+ single thread at a time.
+ */
+@interface HPJSONArrayStreamParser : NSObject {
+@private
+    NSMutableData *_elementData;
+    NSUInteger _depth;
+    NSUInteger _itemCount;
+    BOOL _hasStarted;
+    BOOL _hasFinished;
+    BOOL _hasFailed;
+    BOOL _isInElement;
+    BOOL _isInString;
+    BOOL _isEscaped;
+}
+
+/** Number of elements returned so far
+ */
+@property (nonatomic, readonly) NSUInteger itemCount;
+
+/** Whether the input is not a valid JSON array
+
+ Once set, any further input is ignored.
+ */
+@property (nonatomic, readonly) BOOL hasFailed;
+
+/** Whether the closing bracket of the array has been seen and the input so 
+ far is valid
+ */
+@property (nonatomic, readonly, getter=isComplete) BOOL complete;
+
+/** Parses the next chunk of the body
+
+ @param data Next chunk of the body
+
+ @returns Array of the elements completed by this chunk, in order, which is 
+ empty if no element was completed or the input is invalid
+ */
+- (NSArray *)itemsByAppendingData:(NSData *)data;
+
+@end
@@ -0,0 +1,194 @@
+//
+//  HPJSONArrayStreamParser.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-21.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import "HPJSONArrayStreamParser.h"
+
+
+static BOOL HPJSONIsWhitespace(uint8_t byte) {
+    return (byte == ' ' || byte == '\t' || byte == '\n' || byte == '\r');
+}
+
+
+@interface HPJSONArrayStreamParser (PrivateMethods)
+- (BOOL)finishElementWithBytes:(const uint8_t *)bytes length:(NSUInteger)length items:(NSMutableArray *)items;
+@end
+
+
+@implementation HPJSONArrayStreamParser
+
+@synthesize itemCount = _itemCount;
+@synthesize hasFailed = _hasFailed;
+
+- (id)init {
+    self = [super init];
+
+    if (self) {
+        _elementData = [[NSMutableData alloc] init];
+        _depth = 0;
+        _itemCount = 0;
+        _hasStarted = NO;
+        _hasFinished = NO;
+        _hasFailed = NO;
+        _isInElement = NO;
+        _isInString = NO;
+        _isEscaped = NO;
+    }
+
+    return self;
+}
+
+- (BOOL)isComplete {
+    return (_hasFinished && !_hasFailed);
+}
+
+- (NSArray *)itemsByAppendingData:(NSData *)data {
+    NSMutableArray *items = [NSMutableArray array];
+
+    if (_hasFailed) {
+        return items;
+    }
+
+    const uint8_t *bytes = (const uint8_t *)[data bytes];
+    NSUInteger length = [data length];
+
+    // Start of the part of the current element that is in this chunk
+    NSUInteger elementStart = 0;
+
+    for (NSUInteger i = 0; i < length; i++) {
+        uint8_t byte = bytes[i];
+
+        if (_isInString) {
+            if (_isEscaped) {
+                _isEscaped = NO;
+            } else if (byte == '\\') {
+                _isEscaped = YES;
+            } else if (byte == '"') {
+                _isInString = NO;
+            }
+
+            continue;
+        }
+
+        if (!_hasStarted || _hasFinished) {
+            if (HPJSONIsWhitespace(byte)) {
+                continue;
+            }
+
+            if (_hasStarted || byte != '[') {
+                _hasFailed = YES;
+
+                return items;
+            }
+
+            _hasStarted = YES;
+            _depth = 1;
+
+            continue;
+        }
+
+        if (_depth == 1) {
+            if (byte == ',' || byte == ']') {
+                if (_isInElement) {
+                    if (![self finishElementWithBytes:bytes + elementStart length:i - elementStart items:items]) {
+                        return items;
+                    }
+                } else if (byte == ',' || _itemCount > 0) {
+                    // Empty element, such as a leading or doubled comma
+                    _hasFailed = YES;
+
+                    return items;
+                }
+
+                if (byte == ']') {
+                    _depth = 0;
+                    _hasFinished = YES;
+                }
+
+                continue;
+            }
+
+            if (!_isInElement) {
+                if (HPJSONIsWhitespace(byte)) {
+                    continue;
+                }
+
+                _isInElement = YES;
+                elementStart = i;
+            }
+        }
+
+        switch (byte) {
+            case '"':
+                _isInString = YES;
+                break;
+            case '[':
+            case '{':
+                _depth++;
+                break;
+            case ']':
+            case '}':
+                // Closing brackets of the array itself are handled above, 
+                // anything else at this depth closes something never opened
+                if (_depth <= 1) {
+                    _hasFailed = YES;
+
+                    return items;
+                }
+
+                _depth--;
+                break;
+        }
+    }
+
+    if (_isInElement) {
+        [_elementData appendBytes:bytes + elementStart length:length - elementStart];
+    }
+
+    return items;
+}
+
+- (BOOL)finishElementWithBytes:(const uint8_t *)bytes length:(NSUInteger)length items:(NSMutableArray *)items {
+    NSData *elementData = nil;
+
+    // Elements that fit in a single chunk are parsed in place
+    if ([_elementData length] == 0) {
+        elementData = [NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
+    } else {
+        [_elementData appendBytes:bytes length:length];
+
+        elementData = _elementData;
+    }
+
+    id item = [NSJSONSerialization JSONObjectWithData:elementData 
+                                              options:NSJSONReadingAllowFragments 
+                                                error:nil];
+
+    [_elementData setLength:0];
+
+    _isInElement = NO;
+
+    if (item == nil) {
+        _hasFailed = YES;
+
+        return NO;
+    }
+
+    [items addObject:item];
+
+    _itemCount++;
+
+    return YES;
+}
+
+- (void)dealloc {
+    [_elementData release], _elementData = nil;
+
+    [super dealloc];
+}
+
+@end
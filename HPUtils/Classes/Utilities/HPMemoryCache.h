@@ -0,0 +1,139 @@
+//
+//  HPMemoryCache.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-04.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import "HPMemoryPressureManager.h"
+
+
+/** Bounded, cost-based in-memory LRU cache
+
+ Objects are distributed over a fixed number of shards by key hash. Each shard
+ has its own lock, its own LRU list and an equal share of the total cost limit,
+ so concurrent lookups for different keys rarely contend with each other.
+
+ A memory cache registers with the shared
+ [HPMemoryPressureManager](HPMemoryPressureManager) and gives back its least
+ recently used objects under memory pressure, unless it was created with
+ initWithTotalCostLimit:shardCount:respondsToMemoryPressure: to keep costs that
+ are not in bytes out of the pressure passes.
+
+ [HPCacheManager](HPCacheManager) uses an HPMemoryCache as a hot tier in front
+ of its disk directories.
+ */
+@interface HPMemoryCache : NSObject <HPMemoryPressureResponder> {
+@private
+    void *_shards;
+    NSUInteger _shardCount;
+    NSUInteger _totalCostLimit;
+    BOOL _respondsToMemoryPressure;
+
+    int64_t _hitCount;
+    int64_t _missCount;
+    int64_t _evictionCount;
+}
+
+/** Maximum total cost of all objects held by the cache
+
+ The limit is split evenly between shards. Lowering the limit evicts least
+ recently used objects immediately.
+ */
+@property (nonatomic, assign) NSUInteger totalCostLimit;
+
+/** Current total cost of all objects held by the cache
+ */
+@property (nonatomic, readonly) NSUInteger totalCost;
+
+/** Current number of objects held by the cache
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/** Number of lookups that found an object
+ */
+@property (nonatomic, readonly) int64_t hitCount;
+
+/** Number of lookups that did not find an object
+ */
+@property (nonatomic, readonly) int64_t missCount;
+
+/** Number of objects dropped to stay under the cost limit or to give memory 
+ back, explicit removals are not counted
+ */
+@property (nonatomic, readonly) int64_t evictionCount;
+
+/** Initializes a memory cache
+
+ @param totalCostLimit Maximum total cost of all objects
+ @param shardCount Number of independently locked shards, at least 1
+ */
+- (id)initWithTotalCostLimit:(NSUInteger)totalCostLimit shardCount:(NSUInteger)shardCount;
+
+/** Initializes a memory cache that may stay out of memory pressure handling
+
+ The pressure manager compares the cost of its responders, so caches whose 
+ costs are not in bytes, such as a count of small objects, should not register.
+
+ @param totalCostLimit Maximum total cost of all objects
+ @param shardCount Number of independently locked shards, at least 1
+ @param respondsToMemoryPressure Whether the cache registers with the shared 
+ pressure manager
+ */
+- (id)initWithTotalCostLimit:(NSUInteger)totalCostLimit 
+                  shardCount:(NSUInteger)shardCount 
+    respondsToMemoryPressure:(BOOL)respondsToMemoryPressure;
+
+/** Returns the object for a key and marks it as most recently used
+
+ @param key Key to search for
+
+ @returns Retained and autoreleased object, or nil
+ */
+- (id)objectForKey:(NSString *)key;
+
+/** Checks whether an object is available for a key
+
+ Unlike objectForKey:, this does not affect LRU order or hit and miss counters.
+
+ @param key Key to search for
+
+ @returns BOOL Boolean that determines whether an object is available
+ */
+- (BOOL)containsObjectForKey:(NSString *)key;
+
+/** Stores an object for a key
+
+ Objects with a cost larger than the share of a single shard are not stored.
+
+ @param object Object to store
+ @param key Key for identification
+ @param cost Cost of the object, usually its size in bytes
+ */
+- (void)setObject:(id)object forKey:(NSString *)key cost:(NSUInteger)cost;
+
+/** Removes the object for a key
+
+ @param key Key to remove
+ */
+- (void)removeObjectForKey:(NSString *)key;
+
+/** Removes all objects
+ */
+- (void)removeAllObjects;
+
+/** Evicts least recently used objects until the total cost is below a limit
+
+ Shards holding less than an even share keep their objects, and the budget they 
+ leave unused goes to the busier shards.
+
+ @param cost Target total cost
+ */
+- (void)trimToCost:(NSUInteger)cost;
+
+/** Resets hit, miss and eviction counters
+ */
+- (void)resetStatistics;
+
+@end
@@ -0,0 +1,451 @@
+//
+//  HPMemoryCache.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-04.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#include <libkern/OSAtomic.h>
+#include <pthread.h>
+
+#import "HPMemoryCache.h"
+#import "HPMemoryPressureManager.h"
+
+
+typedef struct HPMemoryCacheNode {
+    struct HPMemoryCacheNode *prev;
+    struct HPMemoryCacheNode *next;
+    id key;
+    id object;
+    NSUInteger cost;
+} HPMemoryCacheNode;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CFMutableDictionaryRef nodes;
+    HPMemoryCacheNode *head;
+    HPMemoryCacheNode *tail;
+    NSUInteger totalCost;
+    NSUInteger costLimit;
+} HPMemoryCacheShard;
+
+
+static void HPMemoryCacheShardUnlink(HPMemoryCacheShard *shard, HPMemoryCacheNode *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        shard->head = node->next;
+    }
+
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        shard->tail = node->prev;
+    }
+
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void HPMemoryCacheShardPushFront(HPMemoryCacheShard *shard, HPMemoryCacheNode *node) {
+    node->prev = NULL;
+    node->next = shard->head;
+
+    if (shard->head != NULL) {
+        shard->head->prev = node;
+    }
+
+    shard->head = node;
+
+    if (shard->tail == NULL) {
+        shard->tail = node;
+    }
+}
+
+// Must be called with the shard lock held. Released objects are collected in
+// the given array so their dealloc does not run under the lock.
+static void HPMemoryCacheShardRemoveNode(HPMemoryCacheShard *shard, HPMemoryCacheNode *node, NSMutableArray *graveyard) {
+    HPMemoryCacheShardUnlink(shard, node);
+    CFDictionaryRemoveValue(shard->nodes, node->key);
+
+    shard->totalCost -= node->cost;
+
+    [graveyard addObject:node->object];
+
+    [node->key release];
+    [node->object release];
+
+    free(node);
+}
+
+static NSUInteger HPMemoryCacheShardTrim(HPMemoryCacheShard *shard, NSUInteger costLimit, NSMutableArray *graveyard) {
+    NSUInteger evictedCount = 0;
+
+    while (shard->totalCost > costLimit && shard->tail != NULL) {
+        HPMemoryCacheShardRemoveNode(shard, shard->tail, graveyard);
+
+        evictedCount++;
+    }
+
+    return evictedCount;
+}
+
+
+@implementation HPMemoryCache
+
+@synthesize totalCostLimit = _totalCostLimit;
+
+- (id)init {
+    return [self initWithTotalCostLimit:4 * 1024 * 1024 shardCount:8];
+}
+
+- (id)initWithTotalCostLimit:(NSUInteger)totalCostLimit shardCount:(NSUInteger)shardCount {
+    return [self initWithTotalCostLimit:totalCostLimit shardCount:shardCount respondsToMemoryPressure:YES];
+}
+
+- (id)initWithTotalCostLimit:(NSUInteger)totalCostLimit 
+                  shardCount:(NSUInteger)shardCount 
+    respondsToMemoryPressure:(BOOL)respondsToMemoryPressure {
+    self = [super init];
+
+    if (self) {
+        _shardCount = MAX(shardCount, 1);
+        _totalCostLimit = totalCostLimit;
+        _respondsToMemoryPressure = respondsToMemoryPressure;
+        _shards = calloc(_shardCount, sizeof(HPMemoryCacheShard));
+
+        HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+
+        for (NSUInteger i = 0; i < _shardCount; i++) {
+            pthread_mutex_init(&shards[i].lock, NULL);
+
+            shards[i].nodes = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+            shards[i].costLimit = _totalCostLimit / _shardCount;
+        }
+
+        if (_respondsToMemoryPressure) {
+            [[HPMemoryPressureManager sharedManager] registerResponder:self];
+        }
+    }
+
+    return self;
+}
+
+- (HPMemoryCacheShard *)shardForKey:(NSString *)key {
+    return &((HPMemoryCacheShard *)_shards)[[key hash] % _shardCount];
+}
+
+#pragma mark - Access
+
+- (id)objectForKey:(NSString *)key {
+    if (key == nil) {
+        return nil;
+    }
+
+    HPMemoryCacheShard *shard = [self shardForKey:key];
+    id object = nil;
+
+    pthread_mutex_lock(&shard->lock);
+
+    HPMemoryCacheNode *node = (HPMemoryCacheNode *)CFDictionaryGetValue(shard->nodes, key);
+
+    if (node != NULL) {
+        if (node != shard->head) {
+            HPMemoryCacheShardUnlink(shard, node);
+            HPMemoryCacheShardPushFront(shard, node);
+        }
+
+        object = [node->object retain];
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (object != nil) {
+        OSAtomicIncrement64Barrier(&_hitCount);
+    } else {
+        OSAtomicIncrement64Barrier(&_missCount);
+    }
+
+    return [object autorelease];
+}
+
+- (BOOL)containsObjectForKey:(NSString *)key {
+    if (key == nil) {
+        return NO;
+    }
+
+    HPMemoryCacheShard *shard = [self shardForKey:key];
+
+    pthread_mutex_lock(&shard->lock);
+
+    BOOL containsObject = CFDictionaryContainsKey(shard->nodes, key);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return containsObject;
+}
+
+- (void)setObject:(id)object forKey:(NSString *)key cost:(NSUInteger)cost {
+    if (key == nil) {
+        return;
+    }
+
+    if (object == nil) {
+        [self removeObjectForKey:key];
+
+        return;
+    }
+
+    HPMemoryCacheShard *shard = [self shardForKey:key];
+    NSMutableArray *graveyard = [[NSMutableArray alloc] init];
+    NSUInteger evictedCount = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    HPMemoryCacheNode *node = (HPMemoryCacheNode *)CFDictionaryGetValue(shard->nodes, key);
+
+    if (node != NULL) {
+        HPMemoryCacheShardRemoveNode(shard, node, graveyard);
+    }
+
+    if (cost <= shard->costLimit) {
+        node = calloc(1, sizeof(HPMemoryCacheNode));
+        node->key = [key copy];
+        node->object = [object retain];
+        node->cost = cost;
+
+        CFDictionarySetValue(shard->nodes, node->key, node);
+        HPMemoryCacheShardPushFront(shard, node);
+
+        shard->totalCost += cost;
+
+        evictedCount = HPMemoryCacheShardTrim(shard, shard->costLimit, graveyard);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (evictedCount > 0) {
+        OSAtomicAdd64Barrier(evictedCount, &_evictionCount);
+    }
+
+    [graveyard release];
+}
+
+- (void)removeObjectForKey:(NSString *)key {
+    if (key == nil) {
+        return;
+    }
+
+    HPMemoryCacheShard *shard = [self shardForKey:key];
+    NSMutableArray *graveyard = [[NSMutableArray alloc] init];
+
+    pthread_mutex_lock(&shard->lock);
+
+    HPMemoryCacheNode *node = (HPMemoryCacheNode *)CFDictionaryGetValue(shard->nodes, key);
+
+    if (node != NULL) {
+        HPMemoryCacheShardRemoveNode(shard, node, graveyard);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    [graveyard release];
+}
+
+- (void)removeAllObjects {
+    HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        NSMutableArray *graveyard = [[NSMutableArray alloc] init];
+
+        pthread_mutex_lock(&shards[i].lock);
+        HPMemoryCacheShardTrim(&shards[i], 0, graveyard);
+        pthread_mutex_unlock(&shards[i].lock);
+
+        [graveyard release];
+    }
+}
+
+- (void)trimToCost:(NSUInteger)cost {
+    HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+    NSUInteger *shardCosts = calloc(_shardCount, sizeof(NSUInteger));
+    NSUInteger *shardOrder = calloc(_shardCount, sizeof(NSUInteger));
+    NSUInteger evictedCount = 0;
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        shardCosts[i] = shards[i].totalCost;
+        pthread_mutex_unlock(&shards[i].lock);
+
+        // Insertion sort by cost, shard counts are small
+        NSUInteger j = i;
+
+        while (j > 0 && shardCosts[shardOrder[j - 1]] > shardCosts[i]) {
+            shardOrder[j] = shardOrder[j - 1];
+            j--;
+        }
+
+        shardOrder[j] = i;
+    }
+
+    // Splitting the target evenly would over-evict hot shards while cold ones 
+    // sit below their share. Shards are visited from the cheapest, each keeps 
+    // what it holds if that fits an even split of the remaining budget, and 
+    // the rest is split between the shards that do not fit.
+    NSUInteger remainingCost = cost;
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        NSUInteger shardIndex = shardOrder[i];
+        NSUInteger shardCostLimit = remainingCost / (_shardCount - i);
+
+        if (shardCosts[shardIndex] <= shardCostLimit) {
+            remainingCost -= shardCosts[shardIndex];
+
+            continue;
+        }
+
+        NSMutableArray *graveyard = [[NSMutableArray alloc] init];
+
+        pthread_mutex_lock(&shards[shardIndex].lock);
+        evictedCount += HPMemoryCacheShardTrim(&shards[shardIndex], shardCostLimit, graveyard);
+        pthread_mutex_unlock(&shards[shardIndex].lock);
+
+        [graveyard release];
+
+        remainingCost -= shardCostLimit;
+    }
+
+    free(shardCosts);
+    free(shardOrder);
+
+    if (evictedCount > 0) {
+        OSAtomicAdd64Barrier(evictedCount, &_evictionCount);
+    }
+}
+
+#pragma mark - Limits and statistics
+
+- (void)setTotalCostLimit:(NSUInteger)totalCostLimit {
+    HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+    NSUInteger shardCostLimit = totalCostLimit / _shardCount;
+
+    NSUInteger evictedCount = 0;
+
+    _totalCostLimit = totalCostLimit;
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        NSMutableArray *graveyard = [[NSMutableArray alloc] init];
+
+        pthread_mutex_lock(&shards[i].lock);
+
+        shards[i].costLimit = shardCostLimit;
+
+        evictedCount += HPMemoryCacheShardTrim(&shards[i], shardCostLimit, graveyard);
+
+        pthread_mutex_unlock(&shards[i].lock);
+
+        [graveyard release];
+    }
+
+    if (evictedCount > 0) {
+        OSAtomicAdd64Barrier(evictedCount, &_evictionCount);
+    }
+}
+
+- (NSUInteger)totalCost {
+    HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+    NSUInteger totalCost = 0;
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        totalCost += shards[i].totalCost;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    return totalCost;
+}
+
+- (NSUInteger)count {
+    HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+    NSUInteger count = 0;
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        count += CFDictionaryGetCount(shards[i].nodes);
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    return count;
+}
+
+- (int64_t)hitCount {
+    return OSAtomicAdd64Barrier(0, &_hitCount);
+}
+
+- (int64_t)missCount {
+    return OSAtomicAdd64Barrier(0, &_missCount);
+}
+
+- (int64_t)evictionCount {
+    return OSAtomicAdd64Barrier(0, &_evictionCount);
+}
+
+- (void)resetStatistics {
+    int64_t count;
+
+    do {
+        count = _hitCount;
+    } while (!OSAtomicCompareAndSwap64Barrier(count, 0, &_hitCount));
+
+    do {
+        count = _missCount;
+    } while (!OSAtomicCompareAndSwap64Barrier(count, 0, &_missCount));
+
+    do {
+        count = _evictionCount;
+    } while (!OSAtomicCompareAndSwap64Barrier(count, 0, &_evictionCount));
+}
+
+#pragma mark - Memory pressure
+
+- (NSUInteger)memoryCost {
+    return [self totalCost];
+}
+
+- (void)reduceMemoryForPressureLevel:(HPMemoryPressureLevel)level {
+    switch (level) {
+        case HPMemoryPressureLevelTrim:
+            [self trimToCost:[self totalCost] / 4 * 3];
+            break;
+        case HPMemoryPressureLevelHalve:
+            [self trimToCost:[self totalCost] / 2];
+            break;
+        case HPMemoryPressureLevelPurge:
+            [self trimToCost:0];
+            break;
+    }
+}
+
+#pragma mark - Memory management
+
+- (void)dealloc {
+    HPMemoryCacheShard *shards = (HPMemoryCacheShard *)_shards;
+
+    if (_respondsToMemoryPressure) {
+        [[HPMemoryPressureManager sharedManager] unregisterResponder:self];
+    }
+
+    [self removeAllObjects];
+
+    for (NSUInteger i = 0; i < _shardCount; i++) {
+        CFRelease(shards[i].nodes);
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+
+    free(_shards), _shards = NULL;
+
+    [super dealloc];
+}
+
+@end
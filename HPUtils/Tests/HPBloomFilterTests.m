@@ -0,0 +1,116 @@
+//
+//  HPBloomFilterTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPBloomFilter.h"
+
+
+@interface HPBloomFilterTests : SenTestCase {
+@private
+    HPBloomFilter *_filter;
+}
+
+@end
+
+
+@implementation HPBloomFilterTests
+
+- (void)setUp {
+    [super setUp];
+
+    _filter = [[HPBloomFilter alloc] initWithCapacity:1024 falsePositiveRate:0.01];
+}
+
+- (void)tearDown {
+    [_filter release], _filter = nil;
+
+    [super tearDown];
+}
+
+- (void)testAddedKeysAreAlwaysFound {
+    for (NSUInteger i = 0; i < 1024; i++) {
+        [_filter addKey:[NSString stringWithFormat:@"key-%u", i]];
+    }
+
+    for (NSUInteger i = 0; i < 1024; i++) {
+        STAssertTrue([_filter mayContainKey:[NSString stringWithFormat:@"key-%u", i]], @"Added key %u was not found", i);
+    }
+
+    STAssertEquals([_filter count], (NSUInteger)1024, @"Count does not match the number of added keys");
+}
+
+- (void)testFalsePositiveRateAtCapacity {
+    NSUInteger falsePositiveCount = 0;
+
+    for (NSUInteger i = 0; i < 1024; i++) {
+        [_filter addKey:[NSString stringWithFormat:@"key-%u", i]];
+    }
+
+    for (NSUInteger i = 0; i < 10000; i++) {
+        if ([_filter mayContainKey:[NSString stringWithFormat:@"missing-%u", i]]) {
+            falsePositiveCount++;
+        }
+    }
+
+    // Three times the target rate leaves room for the variance of 10000 probes
+    STAssertTrue(falsePositiveCount < 300, @"%u false positives in 10000 lookups", falsePositiveCount);
+}
+
+- (void)testRemovedKeysAreNotFound {
+    [_filter addKey:@"first"];
+    [_filter addKey:@"first"];
+    [_filter addKey:@"second"];
+
+    [_filter removeKey:@"first"];
+
+    STAssertTrue([_filter mayContainKey:@"first"], @"Key added twice and removed once was not found");
+
+    [_filter removeKey:@"first"];
+
+    STAssertFalse([_filter mayContainKey:@"first"], @"Removed key was still found");
+    STAssertTrue([_filter mayContainKey:@"second"], @"Removing a key dropped another one");
+    STAssertEquals([_filter count], (NSUInteger)1, @"Count does not match after removals");
+}
+
+- (void)testSaturatedCountersStick {
+    // Each add raises the counters of the key by at least one, so 16 adds 
+    // saturate all of them at 15
+    for (NSUInteger i = 0; i < 16; i++) {
+        [_filter addKey:@"hot"];
+    }
+
+    for (NSUInteger i = 0; i < 16; i++) {
+        [_filter removeKey:@"hot"];
+    }
+
+    // A saturated counter no longer knows how many keys share it, so it must 
+    // never drop back to zero and hide a key
+    STAssertTrue([_filter mayContainKey:@"hot"], @"Saturated counters were decremented");
+    STAssertEquals([_filter count], (NSUInteger)0, @"Count does not match after removals");
+}
+
+- (void)testRemoveAllKeys {
+    [_filter addKey:@"first"];
+    [_filter addKey:@"second"];
+
+    [_filter removeAllKeys];
+
+    STAssertFalse([_filter mayContainKey:@"first"], @"Key was found after removing all keys");
+    STAssertFalse([_filter mayContainKey:@"second"], @"Key was found after removing all keys");
+    STAssertEquals([_filter count], (NSUInteger)0, @"Count was not reset");
+}
+
+- (void)testNilKeys {
+    [_filter addKey:nil];
+
+    STAssertFalse([_filter mayContainKey:nil], @"Nil key was found");
+    STAssertEquals([_filter count], (NSUInteger)0, @"Nil key was counted");
+}
+
+@end
@@ -0,0 +1,224 @@
+//
+//  HPCacheIndexTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPCacheIndex.h"
+
+
+static NSString * const kHPCacheIndexTestsLogFilename = @".index";
+static NSString * const kHPCacheIndexTestsMIMEType = @"application/json";
+
+
+@interface HPCacheIndexTests : SenTestCase {
+@private
+    NSString *_directoryPath;
+}
+
+- (void)addEntryForKey:(NSString *)key size:(unsigned long long)size toIndex:(HPCacheIndex *)index;
+- (HPCacheIndex *)loadedIndexWithEntryBlock:(HPCacheIndexEntry *(^)(NSString *key, NSString *path))entryBlock;
+
+@end
+
+
+@implementation HPCacheIndexTests
+
+- (void)setUp {
+    [super setUp];
+
+    _directoryPath = [[NSTemporaryDirectory() stringByAppendingPathComponent:
+                       [[NSProcessInfo processInfo] globallyUniqueString]] copy];
+
+    [[NSFileManager defaultManager] createDirectoryAtPath:_directoryPath
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:_directoryPath error:nil];
+
+    [_directoryPath release], _directoryPath = nil;
+
+    [super tearDown];
+}
+
+- (void)addEntryForKey:(NSString *)key size:(unsigned long long)size toIndex:(HPCacheIndex *)index {
+    NSMutableData *data = [NSMutableData dataWithLength:(NSUInteger)size];
+
+    // Recovery drops records without a file, so every entry needs one
+    [data writeToFile:[_directoryPath stringByAppendingPathComponent:key] atomically:NO];
+
+    NSTimeInterval timeStamp = [NSDate timeIntervalSinceReferenceDate];
+
+    [index addEntry:[HPCacheIndexEntry entryWithKey:key
+                                               size:size
+                                          timeStamp:timeStamp
+                                     expirationTime:timeStamp + 3600.0
+                                           MIMEType:kHPCacheIndexTestsMIMEType]];
+}
+
+- (HPCacheIndex *)loadedIndexWithEntryBlock:(HPCacheIndexEntry *(^)(NSString *key, NSString *path))entryBlock {
+    HPCacheIndex *index = [[[HPCacheIndex alloc] initWithDirectoryPath:_directoryPath] autorelease];
+
+    [index loadWithEntryBlock:entryBlock];
+
+    return index;
+}
+
+- (void)testLogReplayRestoresEntries {
+    HPCacheIndex *index = [self loadedIndexWithEntryBlock:nil];
+
+    for (NSUInteger i = 0; i < 10; i++) {
+        [self addEntryForKey:[NSString stringWithFormat:@"key-%u", i] size:(i + 1) * 100 toIndex:index];
+    }
+
+    [index removeEntryForKey:@"key-0"];
+    [[NSFileManager defaultManager] removeItemAtPath:[_directoryPath stringByAppendingPathComponent:@"key-0"]
+                                               error:nil];
+    [index synchronize];
+
+    __block NSUInteger recoveredCount = 0;
+
+    HPCacheIndex *reloadedIndex = [self loadedIndexWithEntryBlock:^HPCacheIndexEntry *(NSString *key, NSString *path) {
+        recoveredCount++;
+
+        return nil;
+    }];
+
+    STAssertEquals(recoveredCount, (NSUInteger)0, @"A clean log should not need recovery");
+    STAssertNil([reloadedIndex entryForKey:@"key-0"], @"Removed entry came back after replay");
+
+    for (NSUInteger i = 1; i < 10; i++) {
+        HPCacheIndexEntry *entry = [reloadedIndex entryForKey:[NSString stringWithFormat:@"key-%u", i]];
+
+        STAssertNotNil(entry, @"Entry %u is missing after replay", i);
+        STAssertEquals([entry size], (unsigned long long)(i + 1) * 100, @"Size of entry %u does not match", i);
+        STAssertEqualObjects([entry MIMEType], kHPCacheIndexTestsMIMEType, @"MIME type of entry %u does not match", i);
+    }
+
+    STAssertEquals([reloadedIndex totalSize], [index totalSize], @"Total size does not match after replay");
+}
+
+- (void)testLogReplayRecoversTruncatedTail {
+    HPCacheIndex *index = [[HPCacheIndex alloc] initWithDirectoryPath:_directoryPath];
+
+    [index loadWithEntryBlock:nil];
+
+    for (NSUInteger i = 0; i < 10; i++) {
+        [self addEntryForKey:[NSString stringWithFormat:@"key-%u", i] size:100 toIndex:index];
+    }
+
+    [index synchronize];
+    [index release];
+
+    NSString *logPath = [_directoryPath stringByAppendingPathComponent:kHPCacheIndexTestsLogFilename];
+    NSFileHandle *logHandle = [NSFileHandle fileHandleForUpdatingAtPath:logPath];
+
+    STAssertNotNil(logHandle, @"Log file was not written");
+
+    // Tear the last record in half, as a crash in the middle of a write would
+    [logHandle truncateFileAtOffset:[logHandle seekToEndOfFile] - 8];
+    [logHandle closeFile];
+
+    NSMutableArray *recoveredKeys = [NSMutableArray array];
+
+    HPCacheIndex *reloadedIndex = [self loadedIndexWithEntryBlock:^HPCacheIndexEntry *(NSString *key, NSString *path) {
+        [recoveredKeys addObject:key];
+
+        NSTimeInterval timeStamp = [NSDate timeIntervalSinceReferenceDate];
+
+        return [HPCacheIndexEntry entryWithKey:key
+                                          size:100
+                                     timeStamp:timeStamp
+                                expirationTime:timeStamp + 3600.0
+                                      MIMEType:kHPCacheIndexTestsMIMEType];
+    }];
+
+    STAssertEqualObjects(recoveredKeys, [NSArray arrayWithObject:@"key-9"], @"Only the torn record should be recovered");
+
+    for (NSUInteger i = 0; i < 10; i++) {
+        STAssertNotNil([reloadedIndex entryForKey:[NSString stringWithFormat:@"key-%u", i]],
+                       @"Entry %u is missing after recovery", i);
+    }
+
+    STAssertEquals([reloadedIndex totalSize], (unsigned long long)1000, @"Total size does not match after recovery");
+}
+
+- (void)testLogCompaction {
+    HPCacheIndex *index = [self loadedIndexWithEntryBlock:nil];
+
+    [self addEntryForKey:@"cold-1" size:10 toIndex:index];
+    [self addEntryForKey:@"cold-2" size:20 toIndex:index];
+
+    for (NSUInteger i = 1; i <= 1200; i++) {
+        [self addEntryForKey:@"hot" size:i toIndex:index];
+    }
+
+    [index synchronize];
+
+    NSString *logPath = [_directoryPath stringByAppendingPathComponent:kHPCacheIndexTestsLogFilename];
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:logPath error:nil];
+
+    STAssertTrue([attributes fileSize] < 1024, @"Log was not compacted, %llu bytes", [attributes fileSize]);
+
+    __block NSUInteger recoveredCount = 0;
+    HPCacheIndexEntry *(^entryBlock)(NSString *, NSString *) = ^HPCacheIndexEntry *(NSString *key, NSString *path) {
+        recoveredCount++;
+
+        return nil;
+    };
+
+    HPCacheIndex *reloadedIndex = [self loadedIndexWithEntryBlock:entryBlock];
+
+    STAssertEquals(recoveredCount, (NSUInteger)0, @"A compacted log should not need recovery");
+    STAssertEquals([[reloadedIndex entryForKey:@"hot"] size], (unsigned long long)1200, @"Compaction lost the last size");
+    STAssertEquals([reloadedIndex totalSize], (unsigned long long)1230, @"Total size does not match after compaction");
+
+    // Records written after a compaction are appended to the snapshot
+    [self addEntryForKey:@"cold-3" size:30 toIndex:reloadedIndex];
+    [reloadedIndex synchronize];
+
+    HPCacheIndex *appendedIndex = [self loadedIndexWithEntryBlock:entryBlock];
+
+    STAssertEquals(recoveredCount, (NSUInteger)0, @"Appending to a compacted log should not need recovery");
+    STAssertNotNil([appendedIndex entryForKey:@"cold-3"], @"Entry appended after compaction is missing");
+    STAssertEquals([appendedIndex totalSize], (unsigned long long)1260, @"Total size does not match after appending");
+}
+
+- (void)testTouchedKeysAreUsedLast {
+    HPCacheIndex *index = [self loadedIndexWithEntryBlock:nil];
+
+    for (NSUInteger i = 0; i < 3; i++) {
+        [self addEntryForKey:[NSString stringWithFormat:@"key-%u", i] size:100 toIndex:index];
+    }
+
+    [index synchronize];
+
+    NSString *logPath = [_directoryPath stringByAppendingPathComponent:kHPCacheIndexTestsLogFilename];
+    unsigned long long logSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:logPath error:nil] fileSize];
+
+    [NSThread sleepForTimeInterval:0.01];
+
+    for (NSUInteger i = 0; i < 1000; i++) {
+        [index touchKey:@"key-0"];
+    }
+
+    NSArray *entries = [index leastRecentlyUsedEntries:3];
+
+    STAssertEquals([entries count], (NSUInteger)3, @"Not all entries were returned");
+    STAssertEqualObjects([[entries lastObject] key], @"key-0", @"Touched entry should be used last");
+
+    // Touches stay in memory until the next snapshot
+    [index synchronize];
+
+    STAssertEquals([[[NSFileManager defaultManager] attributesOfItemAtPath:logPath error:nil] fileSize], logSize,
+                   @"Touches should not be written to the log");
+}
+
+@end
@@ -0,0 +1,121 @@
+//
+//  HPCacheManagerTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPCacheManager.h"
+
+
+// Expiration dates are relative to the time of the call
+static NSTimeInterval const kHPCacheManagerTestsTimeAccuracy = 5.0;
+
+
+@interface HPCacheManagerTests : SenTestCase
+
+- (NSHTTPURLResponse *)responseWithHeaders:(NSDictionary *)headers;
+
+@end
+
+
+@implementation HPCacheManagerTests
+
+- (NSHTTPURLResponse *)responseWithHeaders:(NSDictionary *)headers {
+    return [[[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"http://example.com/resource"] 
+                                        statusCode:200 
+                                       HTTPVersion:@"HTTP/1.1" 
+                                      headerFields:headers] autorelease];
+}
+
+- (void)testNoStoreAnywhereMakesResponseNonStorable {
+    NSArray *values = [NSArray arrayWithObjects:@"no-store", @"max-age=60, no-store", 
+                       @"public,max-age=60,  No-Store ", @"no-cache, no-store", nil];
+
+    for (NSString *value in values) {
+        BOOL storable = YES;
+        NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:
+                                                                            [NSDictionary dictionaryWithObject:value forKey:@"Cache-Control"]] 
+                                                                  storable:&storable];
+
+        STAssertFalse(storable, @"Cache-Control: %@ was storable", value);
+        STAssertTrue([expirationDate timeIntervalSinceNow] <= 0.0, @"Cache-Control: %@ was not expired", value);
+    }
+}
+
+- (void)testNoCacheExpiresImmediately {
+    NSArray *values = [NSArray arrayWithObjects:@"no-cache", @"max-age=600, no-cache", @"no-cache, max-age=600", nil];
+
+    for (NSString *value in values) {
+        BOOL storable = NO;
+        NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:
+                                                                            [NSDictionary dictionaryWithObject:value forKey:@"Cache-Control"]] 
+                                                                  storable:&storable];
+
+        STAssertTrue(storable, @"Cache-Control: %@ was not storable", value);
+        STAssertTrue([expirationDate timeIntervalSinceNow] <= 0.0, @"Cache-Control: %@ was not expired", value);
+    }
+}
+
+- (void)testMaxAge {
+    NSDictionary *headers = [NSDictionary dictionaryWithObject:@"public, MAX-AGE=120, must-revalidate" forKey:@"cache-control"];
+    NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL];
+
+    STAssertEqualsWithAccuracy([expirationDate timeIntervalSinceNow], 120.0, kHPCacheManagerTestsTimeAccuracy, 
+                               @"max-age was not applied");
+}
+
+- (void)testMaxAgeMinusAge {
+    NSDictionary *headers = [NSDictionary dictionaryWithObjectsAndKeys:@"max-age=100", @"Cache-Control", @"40", @"Age", nil];
+    NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL];
+
+    STAssertEqualsWithAccuracy([expirationDate timeIntervalSinceNow], 60.0, kHPCacheManagerTestsTimeAccuracy, 
+                               @"Age was not subtracted from max-age");
+
+    headers = [NSDictionary dictionaryWithObjectsAndKeys:@"max-age=100", @"Cache-Control", @"400", @"Age", nil];
+    expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL];
+
+    STAssertTrue([expirationDate timeIntervalSinceNow] <= 0.0, @"Response older than max-age was not expired");
+}
+
+- (void)testCacheControlTakesPrecedenceOverExpires {
+    NSDictionary *headers = [NSDictionary dictionaryWithObjectsAndKeys:@"max-age=30", @"Cache-Control", 
+                             @"Thu, 01 Dec 2033 16:00:00 GMT", @"Expires", nil];
+    NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL];
+
+    STAssertEqualsWithAccuracy([expirationDate timeIntervalSinceNow], 30.0, kHPCacheManagerTestsTimeAccuracy, 
+                               @"Expires was preferred over max-age");
+}
+
+- (void)testExpiresRelativeToServerDate {
+    NSDictionary *headers = [NSDictionary dictionaryWithObjectsAndKeys:@"Thu, 01 Dec 1994 16:05:00 GMT", @"Expires", 
+                             @"Thu, 01 Dec 1994 16:00:00 GMT", @"Date", nil];
+    NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL];
+
+    STAssertEqualsWithAccuracy([expirationDate timeIntervalSinceNow], 300.0, kHPCacheManagerTestsTimeAccuracy, 
+                               @"Expires was not measured against the server date");
+}
+
+- (void)testInvalidExpiresIsExpired {
+    NSDictionary *headers = [NSDictionary dictionaryWithObject:@"0" forKey:@"Expires"];
+    NSDate *expirationDate = [HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL];
+
+    STAssertNotNil(expirationDate, @"Invalid Expires was ignored");
+    STAssertTrue([expirationDate timeIntervalSinceNow] <= 0.0, @"Invalid Expires was not expired");
+}
+
+- (void)testNoCachingHeaders {
+    BOOL storable = NO;
+    NSDictionary *headers = [NSDictionary dictionaryWithObject:@"public" forKey:@"Cache-Control"];
+
+    STAssertNil([HPCacheManager expirationDateForResponse:[self responseWithHeaders:nil] storable:&storable], 
+                @"Response without caching headers had an expiration date");
+    STAssertTrue(storable, @"Response without caching headers was not storable");
+    STAssertNil([HPCacheManager expirationDateForResponse:[self responseWithHeaders:headers] storable:NULL], 
+                @"Cache-Control without a lifetime had an expiration date");
+}
+
+@end
@@ -0,0 +1,124 @@
+//
+//  HPJSONArrayStreamParserTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPJSONArrayStreamParser.h"
+
+
+// Strings contain brackets, braces, commas, escaped quotes and escaped 
+// backslashes, so every tokenizer state is split at some point
+static NSString * const kHPStreamParserTestBody = @" [ {\"name\": \"a],[b\", \"quote\": \"\\\"}\", \"path\": \"c:\\\\\"}, "
+                                                  @"[1, [2, 3], {\"x\": null}], \"\\u005d\\\\\\\"\", 4.5e1, true, {} ] ";
+
+
+@interface HPJSONArrayStreamParserTests : SenTestCase
+
+- (NSArray *)itemsByParsingBody:(NSData *)body chunkLength:(NSUInteger)chunkLength parser:(HPJSONArrayStreamParser *)parser;
+
+@end
+
+
+@implementation HPJSONArrayStreamParserTests
+
+- (NSArray *)itemsByParsingBody:(NSData *)body chunkLength:(NSUInteger)chunkLength parser:(HPJSONArrayStreamParser *)parser {
+    NSMutableArray *items = [NSMutableArray array];
+
+    for (NSUInteger offset = 0; offset < [body length]; offset += chunkLength) {
+        NSRange range = NSMakeRange(offset, MIN(chunkLength, [body length] - offset));
+
+        [items addObjectsFromArray:[parser itemsByAppendingData:[body subdataWithRange:range]]];
+    }
+
+    return items;
+}
+
+- (void)testWholeBody {
+    NSData *body = [kHPStreamParserTestBody dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray *expectedItems = [NSJSONSerialization JSONObjectWithData:body options:0 error:nil];
+    HPJSONArrayStreamParser *parser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+    NSArray *items = [parser itemsByAppendingData:body];
+
+    STAssertNotNil(expectedItems, @"Test body is not valid JSON");
+    STAssertEqualObjects(items, expectedItems, @"Items differ from a full parse");
+    STAssertTrue([parser isComplete], @"Parser did not see the end of the array");
+    STAssertFalse([parser hasFailed], @"Parser failed on a valid body");
+    STAssertEquals([parser itemCount], [expectedItems count], @"Item count does not match");
+}
+
+- (void)testEverySplitPoint {
+    NSData *body = [kHPStreamParserTestBody dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray *expectedItems = [NSJSONSerialization JSONObjectWithData:body options:0 error:nil];
+
+    // Two chunks, split at every offset, including inside strings and right 
+    // after a backslash
+    for (NSUInteger splitOffset = 1; splitOffset < [body length]; splitOffset++) {
+        HPJSONArrayStreamParser *parser = [[HPJSONArrayStreamParser alloc] init];
+        NSMutableArray *items = [NSMutableArray array];
+
+        [items addObjectsFromArray:[parser itemsByAppendingData:[body subdataWithRange:NSMakeRange(0, splitOffset)]]];
+        [items addObjectsFromArray:[parser itemsByAppendingData:[body subdataWithRange:NSMakeRange(splitOffset, [body length] - splitOffset)]]];
+
+        STAssertEqualObjects(items, expectedItems, @"Items differ when split at %u", splitOffset);
+        STAssertTrue([parser isComplete], @"Parser did not complete when split at %u", splitOffset);
+
+        [parser release];
+    }
+}
+
+- (void)testSingleByteChunks {
+    NSData *body = [kHPStreamParserTestBody dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray *expectedItems = [NSJSONSerialization JSONObjectWithData:body options:0 error:nil];
+    HPJSONArrayStreamParser *parser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+
+    STAssertEqualObjects([self itemsByParsingBody:body chunkLength:1 parser:parser], expectedItems, 
+                         @"Items differ when fed one byte at a time");
+    STAssertTrue([parser isComplete], @"Parser did not complete when fed one byte at a time");
+}
+
+- (void)testMultiByteCharactersSplitAcrossChunks {
+    NSData *body = [@"[\"caf\u00e9 \u2603\", \"\u00fc\"]" dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray *expectedItems = [NSJSONSerialization JSONObjectWithData:body options:0 error:nil];
+    HPJSONArrayStreamParser *parser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+
+    STAssertEqualObjects([self itemsByParsingBody:body chunkLength:1 parser:parser], expectedItems, 
+                         @"Items differ when UTF-8 sequences are split");
+}
+
+- (void)testEmptyArray {
+    HPJSONArrayStreamParser *parser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+    NSArray *items = [parser itemsByAppendingData:[@" [ ] " dataUsingEncoding:NSUTF8StringEncoding]];
+
+    STAssertEquals([items count], (NSUInteger)0, @"Empty array returned items");
+    STAssertTrue([parser isComplete], @"Empty array did not complete");
+}
+
+- (void)testIncompleteBody {
+    HPJSONArrayStreamParser *parser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+    NSArray *items = [parser itemsByAppendingData:[@"[1, \"two\", [3" dataUsingEncoding:NSUTF8StringEncoding]];
+
+    STAssertEqualObjects(items, ([NSArray arrayWithObjects:[NSNumber numberWithInt:1], @"two", nil]), 
+                         @"Completed items were not returned before the end of the body");
+    STAssertFalse([parser isComplete], @"Parser completed before the closing bracket");
+    STAssertFalse([parser hasFailed], @"Parser failed on a valid prefix");
+}
+
+- (void)testInvalidBodies {
+    NSArray *bodies = [NSArray arrayWithObjects:@"{\"a\": 1}", @"[1, }", @"[1,, 2]", @"[1] 2", @"[tru]", nil];
+
+    for (NSString *bodyString in bodies) {
+        HPJSONArrayStreamParser *parser = [[[HPJSONArrayStreamParser alloc] init] autorelease];
+
+        [parser itemsByAppendingData:[bodyString dataUsingEncoding:NSUTF8StringEncoding]];
+
+        STAssertTrue([parser hasFailed], @"Parser accepted %@", bodyString);
+        STAssertFalse([parser isComplete], @"Parser completed %@", bodyString);
+    }
+}
+
+@end
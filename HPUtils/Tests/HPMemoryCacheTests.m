@@ -0,0 +1,176 @@
+//
+//  HPMemoryCacheTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPMemoryCache.h"
+
+
+@interface HPMemoryCacheTests : SenTestCase
+
+@end
+
+
+@implementation HPMemoryCacheTests
+
+- (void)testStoresAndRemovesObjects {
+    HPMemoryCache *cache = [[HPMemoryCache alloc] initWithTotalCostLimit:1000 shardCount:4];
+
+    [cache setObject:@"one" forKey:@"a" cost:10];
+    [cache setObject:@"two" forKey:@"b" cost:20];
+
+    STAssertEqualObjects([cache objectForKey:@"a"], @"one", @"Stored object was not returned");
+    STAssertTrue([cache containsObjectForKey:@"b"], @"Stored object was not found");
+    STAssertEquals([cache count], (NSUInteger)2, @"Count does not match the stored objects");
+    STAssertEquals([cache totalCost], (NSUInteger)30, @"Total cost does not match the stored objects");
+
+    // Replacing an object replaces its cost as well
+    [cache setObject:@"three" forKey:@"a" cost:5];
+
+    STAssertEqualObjects([cache objectForKey:@"a"], @"three", @"Replaced object was not returned");
+    STAssertEquals([cache totalCost], (NSUInteger)25, @"Total cost was not updated on replace");
+
+    [cache removeObjectForKey:@"b"];
+
+    STAssertNil([cache objectForKey:@"b"], @"Removed object was returned");
+    STAssertEquals([cache totalCost], (NSUInteger)5, @"Total cost was not updated on remove");
+
+    [cache setObject:nil forKey:@"a" cost:0];
+
+    STAssertEquals([cache count], (NSUInteger)0, @"Setting nil should remove the object");
+
+    [cache release];
+}
+
+- (void)testEvictsLeastRecentlyUsedObjects {
+    HPMemoryCache *cache = [[HPMemoryCache alloc] initWithTotalCostLimit:3 shardCount:1];
+
+    [cache setObject:@"a" forKey:@"a" cost:1];
+    [cache setObject:@"b" forKey:@"b" cost:1];
+    [cache setObject:@"c" forKey:@"c" cost:1];
+
+    // A lookup makes the oldest object the most recently used one
+    [cache objectForKey:@"a"];
+    [cache setObject:@"d" forKey:@"d" cost:1];
+
+    STAssertNotNil([cache objectForKey:@"a"], @"Recently used object was evicted");
+    STAssertNil([cache objectForKey:@"b"], @"Least recently used object was not evicted");
+    STAssertNotNil([cache objectForKey:@"c"], @"Object was evicted out of order");
+    STAssertNotNil([cache objectForKey:@"d"], @"New object was not stored");
+    STAssertEquals([cache evictionCount], (int64_t)1, @"Eviction was not counted");
+
+    // containsObjectForKey: must not refresh the object
+    [cache containsObjectForKey:@"c"];
+    [cache setObject:@"e" forKey:@"e" cost:1];
+
+    STAssertNil([cache objectForKey:@"c"], @"Checking for an object should not mark it as used");
+
+    [cache release];
+}
+
+- (void)testCostLimitIsSplitBetweenShards {
+    HPMemoryCache *cache = [[HPMemoryCache alloc] initWithTotalCostLimit:400 shardCount:4];
+
+    // Larger than the share of a single shard, so it is never stored
+    [cache setObject:@"large" forKey:@"large" cost:101];
+
+    STAssertNil([cache objectForKey:@"large"], @"Object over the shard limit was stored");
+
+    for (NSUInteger i = 0; i < 1000; i++) {
+        [cache setObject:@"value" forKey:[NSString stringWithFormat:@"key-%u", i] cost:7];
+
+        STAssertTrue([cache totalCost] <= 400, @"Total cost went over the limit, %u", [cache totalCost]);
+    }
+
+    STAssertTrue([cache count] > 0, @"No objects were kept");
+
+    [cache setTotalCostLimit:100];
+
+    STAssertTrue([cache totalCost] <= 100, @"Lowering the limit did not evict, %u", [cache totalCost]);
+
+    [cache release];
+}
+
+- (void)testTrimKeepsCostUnderTarget {
+    HPMemoryCache *cache = [[HPMemoryCache alloc] initWithTotalCostLimit:8000 shardCount:8];
+
+    for (NSUInteger i = 0; i < 500; i++) {
+        [cache setObject:@"value" forKey:[NSString stringWithFormat:@"key-%u", i] cost:(i % 13) + 1];
+    }
+
+    NSUInteger totalCost = [cache totalCost];
+
+    [cache trimToCost:totalCost / 2];
+
+    STAssertTrue([cache totalCost] <= totalCost / 2, @"Trim did not reach the target, %u", [cache totalCost]);
+
+    // Water-filling only evicts from shards that are over their share, so a
+    // trim should not throw away much more than it has to
+    STAssertTrue([cache totalCost] > totalCost / 4, @"Trim evicted too much, %u", [cache totalCost]);
+
+    [cache reduceMemoryForPressureLevel:HPMemoryPressureLevelPurge];
+
+    STAssertEquals([cache totalCost], (NSUInteger)0, @"Purge did not empty the cache");
+    STAssertEquals([cache count], (NSUInteger)0, @"Purge did not remove all objects");
+
+    [cache release];
+}
+
+- (void)testStatistics {
+    HPMemoryCache *cache = [[HPMemoryCache alloc] initWithTotalCostLimit:100 shardCount:2];
+
+    [cache setObject:@"a" forKey:@"a" cost:1];
+
+    [cache objectForKey:@"a"];
+    [cache objectForKey:@"a"];
+    [cache objectForKey:@"missing"];
+
+    STAssertEquals([cache hitCount], (int64_t)2, @"Hits were not counted");
+    STAssertEquals([cache missCount], (int64_t)1, @"Misses were not counted");
+
+    [cache resetStatistics];
+
+    STAssertEquals([cache hitCount], (int64_t)0, @"Hit count was not reset");
+    STAssertEquals([cache missCount], (int64_t)0, @"Miss count was not reset");
+
+    [cache release];
+}
+
+- (void)testConcurrentAccess {
+    HPMemoryCache *cache = [[HPMemoryCache alloc] initWithTotalCostLimit:2000 shardCount:8];
+
+    dispatch_apply(8, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iteration) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+        for (NSUInteger i = 0; i < 2000; i++) {
+            NSString *key = [NSString stringWithFormat:@"key-%u", (i * (iteration + 1)) % 500];
+
+            if (i % 3 == 0) {
+                [cache setObject:key forKey:key cost:(i % 5) + 1];
+            } else if (i % 7 == 0) {
+                [cache removeObjectForKey:key];
+            } else {
+                id object = [cache objectForKey:key];
+
+                STAssertTrue(object == nil || [object isEqualToString:key], @"Object stored for a different key");
+            }
+        }
+
+        [pool drain];
+    });
+
+    STAssertTrue([cache totalCost] <= 2000, @"Total cost went over the limit, %u", [cache totalCost]);
+
+    [cache removeAllObjects];
+
+    STAssertEquals([cache totalCost], (NSUInteger)0, @"Total cost not cleared");
+
+    [cache release];
+}
+
+@end
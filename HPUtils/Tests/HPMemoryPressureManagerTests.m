@@ -0,0 +1,144 @@
+//
+//  HPMemoryPressureManagerTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPMemoryCache.h"
+#import "HPMemoryPressureManager.h"
+
+
+// Large enough that caches registered by other tests do not change the order
+// or the outcome of a trim pass
+static NSUInteger const kHPMemoryPressureTestsLargeCost = 600 * 1024 * 1024;
+static NSUInteger const kHPMemoryPressureTestsMediumCost = 300 * 1024 * 1024;
+static NSUInteger const kHPMemoryPressureTestsSmallCost = 100 * 1024 * 1024;
+
+
+@interface HPTestMemoryResponder : NSObject <HPMemoryPressureResponder> {
+@private
+    NSUInteger _memoryCost;
+    NSUInteger _reductionCount;
+}
+
+@property (nonatomic, assign) NSUInteger memoryCost;
+@property (nonatomic, readonly) NSUInteger reductionCount;
+
+- (id)initWithMemoryCost:(NSUInteger)memoryCost;
+
+@end
+
+
+@implementation HPTestMemoryResponder
+
+@synthesize memoryCost = _memoryCost;
+@synthesize reductionCount = _reductionCount;
+
+- (id)initWithMemoryCost:(NSUInteger)memoryCost {
+    self = [super init];
+
+    if (self) {
+        _memoryCost = memoryCost;
+        _reductionCount = 0;
+
+        [[HPMemoryPressureManager sharedManager] registerResponder:self];
+    }
+
+    return self;
+}
+
+- (void)reduceMemoryForPressureLevel:(HPMemoryPressureLevel)level {
+    _memoryCost = 0;
+    _reductionCount += 1;
+}
+
+- (void)dealloc {
+    [[HPMemoryPressureManager sharedManager] unregisterResponder:self];
+
+    [super dealloc];
+}
+
+@end
+
+
+@interface HPMemoryPressureManagerTests : SenTestCase
+
+@end
+
+
+@implementation HPMemoryPressureManagerTests
+
+- (void)testTrimReducesLargestRespondersFirst {
+    HPTestMemoryResponder *small = [[HPTestMemoryResponder alloc] initWithMemoryCost:kHPMemoryPressureTestsSmallCost];
+    HPTestMemoryResponder *large = [[HPTestMemoryResponder alloc] initWithMemoryCost:kHPMemoryPressureTestsLargeCost];
+    HPTestMemoryResponder *medium = [[HPTestMemoryResponder alloc] initWithMemoryCost:kHPMemoryPressureTestsMediumCost];
+
+    // Emptying the largest responder releases more than a quarter of the total
+    [[HPMemoryPressureManager sharedManager] applyPressureLevel:HPMemoryPressureLevelTrim];
+
+    STAssertEquals([large reductionCount], (NSUInteger)1, @"Largest responder was not reduced");
+    STAssertEquals([medium reductionCount], (NSUInteger)0, @"Trim went on after reaching its target");
+    STAssertEquals([small reductionCount], (NSUInteger)0, @"Trim went on after reaching its target");
+
+    [small release];
+    [large release];
+    [medium release];
+}
+
+- (void)testHalveReachesEveryResponder {
+    HPTestMemoryResponder *small = [[HPTestMemoryResponder alloc] initWithMemoryCost:kHPMemoryPressureTestsSmallCost];
+    HPTestMemoryResponder *large = [[HPTestMemoryResponder alloc] initWithMemoryCost:kHPMemoryPressureTestsLargeCost];
+    HPTestMemoryResponder *empty = [[HPTestMemoryResponder alloc] initWithMemoryCost:0];
+
+    [[HPMemoryPressureManager sharedManager] applyPressureLevel:HPMemoryPressureLevelHalve];
+
+    STAssertEquals([large reductionCount], (NSUInteger)1, @"Responder was not reduced");
+    STAssertEquals([small reductionCount], (NSUInteger)1, @"Responder was not reduced");
+    STAssertEquals([empty reductionCount], (NSUInteger)0, @"Responder without memory was reduced");
+
+    [small release];
+    [large release];
+    [empty release];
+}
+
+- (void)testUnregisteredRespondersAreSkipped {
+    HPTestMemoryResponder *responder = [[HPTestMemoryResponder alloc] initWithMemoryCost:kHPMemoryPressureTestsSmallCost];
+    NSUInteger totalCost = [[HPMemoryPressureManager sharedManager] totalMemoryCost];
+
+    [[HPMemoryPressureManager sharedManager] unregisterResponder:responder];
+
+    STAssertEquals([[HPMemoryPressureManager sharedManager] totalMemoryCost], totalCost - kHPMemoryPressureTestsSmallCost,
+                   @"Unregistered responder is still counted");
+
+    [[HPMemoryPressureManager sharedManager] applyPressureLevel:HPMemoryPressureLevelPurge];
+
+    STAssertEquals([responder reductionCount], (NSUInteger)0, @"Unregistered responder was reduced");
+
+    [responder release];
+}
+
+- (void)testMemoryCacheCanStayOutOfPressureHandling {
+    HPMemoryCache *registeredCache = [[HPMemoryCache alloc] initWithTotalCostLimit:1000 shardCount:1];
+    HPMemoryCache *memo = [[HPMemoryCache alloc] initWithTotalCostLimit:1000 shardCount:1 respondsToMemoryPressure:NO];
+    NSUInteger totalCost = [[HPMemoryPressureManager sharedManager] totalMemoryCost];
+
+    [registeredCache setObject:@"value" forKey:@"key" cost:100];
+    [memo setObject:@"value" forKey:@"key" cost:1];
+
+    STAssertEquals([[HPMemoryPressureManager sharedManager] totalMemoryCost], totalCost + 100,
+                   @"Only the registered cache should be counted");
+
+    [[HPMemoryPressureManager sharedManager] applyPressureLevel:HPMemoryPressureLevelPurge];
+
+    STAssertEquals([registeredCache count], (NSUInteger)0, @"Registered cache was not purged");
+    STAssertEquals([memo count], (NSUInteger)1, @"Cache that opted out was purged");
+
+    [registeredCache release];
+    [memo release];
+}
+
+@end
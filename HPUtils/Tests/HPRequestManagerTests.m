@@ -0,0 +1,165 @@
+//
+//  HPRequestManagerTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPCacheManager.h"
+#import "HPRequestManager.h"
+#import "HPRequestOperation.h"
+#import "HPTestURLProtocol.h"
+
+
+static NSTimeInterval const kHPRequestManagerTestsTimeout = 5.0;
+
+
+@interface HPRequestManagerTests : SenTestCase {
+@private
+    NSMutableArray *_URLs;
+}
+
+- (NSURL *)uniqueURL;
+- (void)stubResponseForURL:(NSURL *)url;
+- (HPRequestOperation *)requestForURL:(NSURL *)url cached:(BOOL)cached;
+
+@end
+
+
+@implementation HPRequestManagerTests
+
+- (void)setUp {
+    [super setUp];
+
+    _URLs = [[NSMutableArray alloc] init];
+
+    [HPTestURLProtocol setUp];
+}
+
+- (void)tearDown {
+    [HPTestURLProtocol tearDown];
+
+    for (NSURL *url in _URLs) {
+        [[HPCacheManager sharedManager] clearCacheForURL:url];
+    }
+
+    [_URLs release], _URLs = nil;
+
+    [super tearDown];
+}
+
+- (NSURL *)uniqueURL {
+    NSURL *url = [NSURL URLWithString:[NSString stringWithFormat:@"http://hputils.example.com/%@",
+                                       [[NSProcessInfo processInfo] globallyUniqueString]]];
+
+    [_URLs addObject:url];
+
+    return url;
+}
+
+- (void)stubResponseForURL:(NSURL *)url {
+    NSMutableData *body = [NSMutableData dataWithData:[@"{\"padding\": \"" dataUsingEncoding:NSUTF8StringEncoding]];
+
+    // Long enough to arrive in several chunks and report progress
+    for (NSUInteger i = 0; i < 4096; i++) {
+        [body appendBytes:"x" length:1];
+    }
+
+    [body appendData:[@"\"}" dataUsingEncoding:NSUTF8StringEncoding]];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                [NSString stringWithFormat:@"%u", [body length]], @"Content-Length",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:body];
+    [HPTestURLProtocol setResponseDelay:0.5];
+    [HPTestURLProtocol setChunkLength:512];
+}
+
+- (HPRequestOperation *)requestForURL:(NSURL *)url cached:(BOOL)cached {
+    HPRequestOperation *request = [HPRequestOperation requestForURL:url withData:nil method:HPRequestMethodGet cached:cached];
+
+    [request setParserBlock:^id(NSData *loadedData, NSString *MIMEType) {
+        return [NSJSONSerialization JSONObjectWithData:loadedData options:0 error:nil];
+    }];
+
+    return request;
+}
+
+#pragma mark - Coalescing
+
+- (void)testIdenticalRequestsShareOneConnection {
+    NSURL *url = [self uniqueURL];
+
+    [self stubResponseForURL:url];
+
+    HPRequestOperation *firstRequest = [self requestForURL:url cached:NO];
+    HPRequestOperation *secondRequest = [self requestForURL:url cached:NO];
+    __block id firstResources = nil;
+    __block id secondResources = nil;
+    __block float secondProgress = 0.0;
+
+    STAssertEqualObjects(firstRequest.coalescingKey, secondRequest.coalescingKey, @"Identical requests have different keys");
+
+    [firstRequest addCompletionBlock:^(id resources, NSError *error) {
+        firstResources = [resources retain];
+    }];
+    [secondRequest addCompletionBlock:^(id resources, NSError *error) {
+        secondResources = [resources retain];
+    }];
+    [secondRequest setProgressBlock:^(float progress) {
+        secondProgress = progress;
+    }];
+
+    [[HPRequestManager sharedManager] enqueueRequest:firstRequest];
+    [[HPRequestManager sharedManager] enqueueRequest:secondRequest];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestManagerTestsTimeout, ^BOOL{
+        return (firstResources != nil && secondResources != nil);
+    }), @"Coalesced requests did not complete");
+
+    STAssertEquals([[HPTestURLProtocol requestsForURL:url] count], (NSUInteger)1, @"Identical requests opened separate connections");
+    STAssertEqualObjects(secondResources, firstResources, @"Attached request received a different response");
+    STAssertFalse(secondResources == firstResources, @"Attached request did not run its own parser");
+    STAssertEqualsWithAccuracy(secondProgress, 1.0f, 0.001f, @"Attached request did not receive the progress of the connection");
+
+    [firstResources release];
+    [secondResources release];
+}
+
+- (void)testCachedRequestDoesNotAttachToUncachedRequest {
+    NSURL *url = [self uniqueURL];
+
+    [self stubResponseForURL:url];
+
+    HPRequestOperation *uncachedRequest = [self requestForURL:url cached:NO];
+    HPRequestOperation *cachedRequest = [self requestForURL:url cached:YES];
+    __block NSUInteger completionCount = 0;
+
+    STAssertFalse([uncachedRequest.coalescingKey isEqualToString:cachedRequest.coalescingKey],
+                  @"Cached and uncached requests have the same key");
+
+    [uncachedRequest addCompletionBlock:^(id resources, NSError *error) {
+        completionCount += 1;
+    }];
+    [cachedRequest addCompletionBlock:^(id resources, NSError *error) {
+        completionCount += 1;
+    }];
+
+    [[HPRequestManager sharedManager] enqueueRequest:uncachedRequest];
+    [[HPRequestManager sharedManager] enqueueRequest:cachedRequest];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestManagerTestsTimeout, ^BOOL{
+        return (completionCount == 2);
+    }), @"Requests did not complete");
+
+    STAssertEquals([[HPTestURLProtocol requestsForURL:url] count], (NSUInteger)2, @"Cached request shared an uncached connection");
+    STAssertNotNil([[HPCacheManager sharedManager] cachedItemForURL:url], @"Cached request did not store its response");
+}
+
+@end
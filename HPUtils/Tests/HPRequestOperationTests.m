@@ -0,0 +1,455 @@
+//
+//  HPRequestOperationTests.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+#import "HPCacheManager.h"
+#import "HPErrors.h"
+#import "HPRequestOperation.h"
+#import "HPTestURLProtocol.h"
+
+
+static NSTimeInterval const kHPRequestOperationTestsTimeout = 5.0;
+
+
+@interface HPRequestOperationTests : SenTestCase {
+@private
+    NSMutableArray *_URLs;
+}
+
+- (NSURL *)uniqueURL;
+- (NSData *)bodyWithVersion:(NSInteger)version;
+- (HPRequestOperation *)requestForURL:(NSURL *)url;
+- (id)resourcesForRequest:(HPRequestOperation *)request error:(NSError **)error;
+- (void)cacheStaleVersion:(NSInteger)version forURL:(NSURL *)url;
+
+#pragma mark - Stale while revalidate
+
+- (void)testStaleResponseIsServedWhileRevalidating {
+    NSURL *url = [self uniqueURL];
+
+    [self cacheStaleVersion:1 forURL:url];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:[self bodyWithVersion:2]];
+    [HPTestURLProtocol setResponseDelay:0.5];
+
+    HPRequestOperation *request = [self requestForURL:url];
+    __block id staleResources = nil;
+    __block id lateResources = nil;
+    __block id updatedResources = nil;
+
+    [request setStaleWhileRevalidate:YES];
+    [request setUpdateBlock:^(id resources, NSError *error) {
+        updatedResources = [resources retain];
+    }];
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        staleResources = [resources retain];
+    }];
+    [request start];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return (staleResources != nil);
+    }), @"Stale response was not delivered");
+    STAssertFalse([request isFinished], @"Request finished before the refresh");
+    STAssertEqualObjects([staleResources objectForKey:@"version"], [NSNumber numberWithInt:1], @"Stale response was not delivered first");
+
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        lateResources = [resources retain];
+    }];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return [request isFinished];
+    }), @"Refresh did not finish");
+
+    STAssertEqualObjects([updatedResources objectForKey:@"version"], [NSNumber numberWithInt:2], @"Update block did not receive the refresh");
+    STAssertEqualObjects(lateResources, updatedResources, @"Late completion block did not receive the refresh");
+
+    [staleResources release];
+    [lateResources release];
+    [updatedResources release];
+}
+
+- (void)testConfirmedStaleResponseIsDeliveredToLateBlocks {
+    NSURL *url = [self uniqueURL];
+
+    [self cacheStaleVersion:1 forURL:url];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:304
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"\"v1\"", @"ETag",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:nil];
+    [HPTestURLProtocol setResponseDelay:0.5];
+
+    HPRequestOperation *request = [self requestForURL:url];
+    __block id staleResources = nil;
+    __block id lateResources = nil;
+    __block BOOL lateBlockCalled = NO;
+    __block BOOL updated = NO;
+
+    [request setStaleWhileRevalidate:YES];
+    [request setUpdateBlock:^(id resources, NSError *error) {
+        updated = YES;
+    }];
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        staleResources = [resources retain];
+    }];
+    [request start];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return (staleResources != nil);
+    }), @"Stale response was not delivered");
+
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        lateResources = [resources retain];
+        lateBlockCalled = YES;
+    }];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return [request isFinished];
+    }), @"Revalidation did not finish");
+
+    STAssertTrue(lateBlockCalled, @"Late completion block was not called");
+    STAssertEqualObjects(lateResources, staleResources, @"Late completion block did not receive the stale resources");
+    STAssertFalse(updated, @"A 304 should not be reported as an update");
+    STAssertNotNil([[HPCacheManager sharedManager] cachedItemForURL:url], @"Revalidated response is still stale");
+
+    [staleResources release];
+    [lateResources release];
+}
+
+@end
+
+
+@implementation HPRequestOperationTests
+
+- (void)setUp {
+    [super setUp];
+
+    _URLs = [[NSMutableArray alloc] init];
+
+    [HPTestURLProtocol setUp];
+}
+
+- (void)tearDown {
+    [HPTestURLProtocol tearDown];
+
+    for (NSURL *url in _URLs) {
+        [[HPCacheManager sharedManager] clearCacheForURL:url];
+    }
+
+    [_URLs release], _URLs = nil;
+
+    [super tearDown];
+}
+
+- (NSURL *)uniqueURL {
+    NSURL *url = [NSURL URLWithString:[NSString stringWithFormat:@"http://hputils.example.com/%@",
+                                       [[NSProcessInfo processInfo] globallyUniqueString]]];
+
+    [_URLs addObject:url];
+
+    return url;
+}
+
+- (NSData *)bodyWithVersion:(NSInteger)version {
+    return [[NSString stringWithFormat:@"{\"version\": %d}", version] dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (HPRequestOperation *)requestForURL:(NSURL *)url {
+    HPRequestOperation *request = [HPRequestOperation requestForURL:url withData:nil method:HPRequestMethodGet cached:YES];
+
+    [request setParserBlock:^id(NSData *loadedData, NSString *MIMEType) {
+        return [NSJSONSerialization JSONObjectWithData:loadedData options:0 error:nil];
+    }];
+
+    return request;
+}
+
+- (id)resourcesForRequest:(HPRequestOperation *)request error:(NSError **)error {
+    __block id receivedResources = nil;
+    __block NSError *receivedError = nil;
+    __block BOOL completed = NO;
+
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        receivedResources = [resources retain];
+        receivedError = [error retain];
+        completed = YES;
+    }];
+
+    [request start];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return [request isFinished];
+    }), @"Request did not finish");
+
+    STAssertTrue(completed, @"Completion block was not called");
+
+    if (error != NULL) {
+        *error = [receivedError autorelease];
+    } else {
+        [receivedError release];
+    }
+
+    return [receivedResources autorelease];
+}
+
+- (void)cacheStaleVersion:(NSInteger)version forURL:(NSURL *)url {
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                @"\"v1\"", @"ETag",
+                                @"no-cache", @"Cache-Control", nil]
+                          body:[self bodyWithVersion:version]];
+
+    [self resourcesForRequest:[self requestForURL:url] error:NULL];
+}
+
+#pragma mark - Revalidation
+
+- (void)testStaleResponseIsRevalidated {
+    NSURL *url = [self uniqueURL];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                @"\"v1\"", @"ETag",
+                                @"no-cache", @"Cache-Control", nil]
+                          body:[self bodyWithVersion:1]];
+    [HPTestURLProtocol stubURL:url
+                    statusCode:304
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"\"v1\"", @"ETag",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:nil];
+
+    NSError *error = nil;
+    id firstResources = [self resourcesForRequest:[self requestForURL:url] error:&error];
+
+    STAssertNil(error, @"First request failed with %@", error);
+    STAssertEqualObjects([firstResources objectForKey:@"version"], [NSNumber numberWithInt:1], @"First response was not parsed");
+
+    id secondResources = [self resourcesForRequest:[self requestForURL:url] error:&error];
+
+    STAssertNil(error, @"Revalidation failed with %@", error);
+    STAssertEqualObjects(secondResources, firstResources, @"A 304 should deliver the cached resources");
+
+    NSArray *requests = [HPTestURLProtocol requestsForURL:url];
+
+    STAssertEquals([requests count], (NSUInteger)2, @"Stale response was not revalidated");
+    STAssertNil([[requests objectAtIndex:0] valueForHTTPHeaderField:@"If-None-Match"],
+                @"First request should not be conditional");
+    STAssertEqualObjects([[requests lastObject] valueForHTTPHeaderField:@"If-None-Match"], @"\"v1\"",
+                         @"Revalidation did not send the entity tag");
+
+    // The 304 extended the lifetime, so the next request never reaches the network
+    STAssertNotNil([[HPCacheManager sharedManager] cachedItemForURL:url], @"Revalidated response is still stale");
+
+    id thirdResources = [self resourcesForRequest:[self requestForURL:url] error:&error];
+
+    STAssertEqualObjects(thirdResources, firstResources, @"Fresh cached response was not used");
+    STAssertEquals([[HPTestURLProtocol requestsForURL:url] count], (NSUInteger)2, @"Fresh response was loaded again");
+}
+
+- (void)testModifiedResponseReplacesStaleResponse {
+    NSURL *url = [self uniqueURL];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                @"Thu, 01 Dec 1994 16:00:00 GMT", @"Last-Modified",
+                                @"no-cache", @"Cache-Control", nil]
+                          body:[self bodyWithVersion:1]];
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:[self bodyWithVersion:2]];
+
+    [self resourcesForRequest:[self requestForURL:url] error:NULL];
+
+    id resources = [self resourcesForRequest:[self requestForURL:url] error:NULL];
+
+    STAssertEqualObjects([resources objectForKey:@"version"], [NSNumber numberWithInt:2], @"New response was not delivered");
+    STAssertEqualObjects([[[HPTestURLProtocol requestsForURL:url] lastObject] valueForHTTPHeaderField:@"If-Modified-Since"],
+                         @"Thu, 01 Dec 1994 16:00:00 GMT", @"Revalidation did not send the modification date");
+
+    HPCacheItem *cacheItem = [[HPCacheManager sharedManager] cachedItemForURL:url];
+
+    STAssertEqualObjects([NSJSONSerialization JSONObjectWithData:cacheItem.cacheData options:0 error:nil], resources,
+                         @"New response did not replace the cached one");
+}
+
+#pragma mark - Stale while revalidate
+
+- (void)testStaleResponseIsServedWhileRevalidating {
+    NSURL *url = [self uniqueURL];
+
+    [self cacheStaleVersion:1 forURL:url];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"application/json", @"Content-Type",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:[self bodyWithVersion:2]];
+    [HPTestURLProtocol setResponseDelay:0.5];
+
+    HPRequestOperation *request = [self requestForURL:url];
+    __block id staleResources = nil;
+    __block id lateResources = nil;
+    __block id updatedResources = nil;
+
+    [request setStaleWhileRevalidate:YES];
+    [request setUpdateBlock:^(id resources, NSError *error) {
+        updatedResources = [resources retain];
+    }];
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        staleResources = [resources retain];
+    }];
+    [request start];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return (staleResources != nil);
+    }), @"Stale response was not delivered");
+    STAssertFalse([request isFinished], @"Request finished before the refresh");
+    STAssertEqualObjects([staleResources objectForKey:@"version"], [NSNumber numberWithInt:1], @"Stale response was not delivered first");
+
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        lateResources = [resources retain];
+    }];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return [request isFinished];
+    }), @"Refresh did not finish");
+
+    STAssertEqualObjects([updatedResources objectForKey:@"version"], [NSNumber numberWithInt:2], @"Update block did not receive the refresh");
+    STAssertEqualObjects(lateResources, updatedResources, @"Late completion block did not receive the refresh");
+
+    [staleResources release];
+    [lateResources release];
+    [updatedResources release];
+}
+
+- (void)testConfirmedStaleResponseIsDeliveredToLateBlocks {
+    NSURL *url = [self uniqueURL];
+
+    [self cacheStaleVersion:1 forURL:url];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:304
+                       headers:[NSDictionary dictionaryWithObjectsAndKeys:
+                                @"\"v1\"", @"ETag",
+                                @"max-age=600", @"Cache-Control", nil]
+                          body:nil];
+    [HPTestURLProtocol setResponseDelay:0.5];
+
+    HPRequestOperation *request = [self requestForURL:url];
+    __block id staleResources = nil;
+    __block id lateResources = nil;
+    __block BOOL lateBlockCalled = NO;
+    __block BOOL updated = NO;
+
+    [request setStaleWhileRevalidate:YES];
+    [request setUpdateBlock:^(id resources, NSError *error) {
+        updated = YES;
+    }];
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        staleResources = [resources retain];
+    }];
+    [request start];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return (staleResources != nil);
+    }), @"Stale response was not delivered");
+
+    [request addCompletionBlock:^(id resources, NSError *error) {
+        lateResources = [resources retain];
+        lateBlockCalled = YES;
+    }];
+
+    STAssertTrue(HPTestRunLoopUntil(kHPRequestOperationTestsTimeout, ^BOOL{
+        return [request isFinished];
+    }), @"Revalidation did not finish");
+
+    STAssertTrue(lateBlockCalled, @"Late completion block was not called");
+    STAssertEqualObjects(lateResources, staleResources, @"Late completion block did not receive the stale resources");
+    STAssertFalse(updated, @"A 304 should not be reported as an update");
+    STAssertNotNil([[HPCacheManager sharedManager] cachedItemForURL:url], @"Revalidated response is still stale");
+
+    [staleResources release];
+    [lateResources release];
+}
+
+#pragma mark - Streaming
+
+- (void)testStreamedItemsArriveInOrder {
+    NSURL *url = [self uniqueURL];
+    NSMutableArray *expectedItems = [NSMutableArray arrayWithCapacity:200];
+
+    for (NSInteger i = 0; i < 200; i++) {
+        [expectedItems addObject:[NSDictionary dictionaryWithObject:[NSNumber numberWithInteger:i] forKey:@"index"]];
+    }
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObject:@"application/json" forKey:@"Content-Type"]
+                          body:[NSJSONSerialization dataWithJSONObject:expectedItems options:0 error:nil]];
+
+    // Chunks end in the middle of items, so several chunks are queued at once
+    [HPTestURLProtocol setChunkLength:7];
+
+    HPRequestOperation *request = [HPRequestOperation requestForURL:url withData:nil method:HPRequestMethodGet cached:NO];
+    NSMutableArray *items = [NSMutableArray array];
+    NSError *error = nil;
+
+    [request setItemBlock:^(id item) {
+        [items addObject:item];
+    }];
+
+    id resources = [self resourcesForRequest:request error:&error];
+
+    STAssertNil(error, @"Streaming request failed with %@", error);
+    STAssertNil(resources, @"Streaming request should complete without resources");
+    STAssertEqualObjects(items, expectedItems, @"Items were not delivered in order");
+}
+
+- (void)testInvalidStreamFails {
+    NSURL *url = [self uniqueURL];
+
+    [HPTestURLProtocol stubURL:url
+                    statusCode:200
+                       headers:[NSDictionary dictionaryWithObject:@"application/json" forKey:@"Content-Type"]
+                          body:[@"[1, 2, 3} 4, 5]" dataUsingEncoding:NSUTF8StringEncoding]];
+    [HPTestURLProtocol setChunkLength:3];
+
+    HPRequestOperation *request = [HPRequestOperation requestForURL:url withData:nil method:HPRequestMethodGet cached:NO];
+    NSMutableArray *items = [NSMutableArray array];
+    NSError *error = nil;
+
+    [request setItemBlock:^(id item) {
+        [items addObject:item];
+    }];
+
+    [self resourcesForRequest:request error:&error];
+
+    STAssertEquals([error code], (NSInteger)kHPRequestParserFailureErrorCode, @"Invalid body did not fail the request");
+    STAssertFalse([items containsObject:[NSNumber numberWithInt:4]], @"Items after the error were delivered");
+}
+
+@end
@@ -0,0 +1,62 @@
+//
+//  HPTestURLProtocol.h
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+/** URL protocol that answers requests for stubbed URLs with canned responses
+ 
+ Responses stubbed for a URL are used in order, the last one is repeated for 
+ every later request. Every request is recorded, so tests can check how often 
+ a URL was loaded and which headers were sent.
+ */
+@interface HPTestURLProtocol : NSURLProtocol
+
+/** Registers the protocol and removes all stubs and recorded requests
+ */
++ (void)setUp;
+
+/** Unregisters the protocol and removes all stubs and recorded requests
+ */
++ (void)tearDown;
+
+/** Adds a response for a URL
+ 
+ @param url URL to answer
+ @param statusCode HTTP status code of the response
+ @param headers Header fields of the response, can be nil
+ @param body Body of the response, can be nil
+ */
++ (void)stubURL:(NSURL *)url statusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body;
+
+/** Delay before every response is sent, in seconds
+ 
+ Keeps requests in flight long enough for tests to act on them.
+ */
++ (void)setResponseDelay:(NSTimeInterval)responseDelay;
+
+/** Maximum length of the pieces the body is delivered in, 0 to send it at once
+ */
++ (void)setChunkLength:(NSUInteger)chunkLength;
+
+/** Returns the requests that were sent for a URL, oldest first
+ 
+ @param url URL to look up
+ 
+ @returns An array of NSURLRequest instances
+ */
++ (NSArray *)requestsForURL:(NSURL *)url;
+
+@end
+
+
+/** Runs the current run loop until a condition holds or a timeout passes
+ 
+ @param timeout Maximum time to wait, in seconds
+ @param condition Block that is checked after every run loop pass
+ 
+ @returns BOOL YES if the condition was met before the timeout
+ */
+extern BOOL HPTestRunLoopUntil(NSTimeInterval timeout, BOOL (^condition)(void));
@@ -0,0 +1,204 @@
+//
+//  HPTestURLProtocol.m
+//  HPUtils
+//
+//  Created by Taylan Pince on 13-02-25.
+//  Copyright 2013 Hippo Foundry. All rights reserved.
+//
+
+#import "HPTestURLProtocol.h"
+
+
+static NSString * const kHPTestURLProtocolStatusCodeKey = @"statusCode";
+static NSString * const kHPTestURLProtocolHeadersKey = @"headers";
+static NSString * const kHPTestURLProtocolBodyKey = @"body";
+
+static NSMutableDictionary *_stubbedResponses = nil;
+static NSMutableDictionary *_recordedRequests = nil;
+static NSTimeInterval _responseDelay = 0.0;
+static NSUInteger _chunkLength = 0;
+
+
+BOOL HPTestRunLoopUntil(NSTimeInterval timeout, BOOL (^condition)(void)) {
+    NSDate *timeoutDate = [NSDate dateWithTimeIntervalSinceNow:timeout];
+    
+    while (!condition()) {
+        if ([timeoutDate timeIntervalSinceNow] <= 0.0) {
+            return NO;
+        }
+        
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode 
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+        
+        [pool drain];
+    }
+    
+    return YES;
+}
+
+
+@interface HPTestURLProtocol (PrivateMethods)
++ (NSString *)keyForURL:(NSURL *)url;
+- (void)sendResponse:(NSDictionary *)response;
+@end
+
+
+@implementation HPTestURLProtocol
+
++ (void)setUp {
+    @synchronized(self) {
+        [_stubbedResponses release];
+        _stubbedResponses = [[NSMutableDictionary alloc] init];
+        
+        [_recordedRequests release];
+        _recordedRequests = [[NSMutableDictionary alloc] init];
+        
+        _responseDelay = 0.0;
+        _chunkLength = 0;
+    }
+    
+    [NSURLProtocol registerClass:self];
+}
+
++ (void)tearDown {
+    [NSURLProtocol unregisterClass:self];
+    
+    @synchronized(self) {
+        [_stubbedResponses release], _stubbedResponses = nil;
+        [_recordedRequests release], _recordedRequests = nil;
+    }
+}
+
++ (NSString *)keyForURL:(NSURL *)url {
+    return [url absoluteString];
+}
+
++ (void)stubURL:(NSURL *)url statusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body {
+    NSMutableDictionary *response = [NSMutableDictionary dictionaryWithCapacity:3];
+    
+    [response setObject:[NSNumber numberWithInteger:statusCode] forKey:kHPTestURLProtocolStatusCodeKey];
+    
+    if (headers != nil) {
+        [response setObject:headers forKey:kHPTestURLProtocolHeadersKey];
+    }
+    
+    if (body != nil) {
+        [response setObject:body forKey:kHPTestURLProtocolBodyKey];
+    }
+    
+    @synchronized(self) {
+        NSMutableArray *responses = [_stubbedResponses objectForKey:[self keyForURL:url]];
+        
+        if (responses == nil) {
+            responses = [NSMutableArray array];
+            
+            [_stubbedResponses setObject:responses forKey:[self keyForURL:url]];
+        }
+        
+        [responses addObject:response];
+    }
+}
+
++ (void)setResponseDelay:(NSTimeInterval)responseDelay {
+    @synchronized(self) {
+        _responseDelay = responseDelay;
+    }
+}
+
++ (void)setChunkLength:(NSUInteger)chunkLength {
+    @synchronized(self) {
+        _chunkLength = chunkLength;
+    }
+}
+
++ (NSArray *)requestsForURL:(NSURL *)url {
+    @synchronized(self) {
+        return [[[_recordedRequests objectForKey:[self keyForURL:url]] copy] autorelease];
+    }
+}
+
+#pragma mark - NSURLProtocol
+
++ (BOOL)canInitWithRequest:(NSURLRequest *)request {
+    @synchronized(self) {
+        return ([_stubbedResponses objectForKey:[self keyForURL:[request URL]]] != nil);
+    }
+}
+
++ (NSURLRequest *)canonicalRequestForRequest:(NSURLRequest *)request {
+    return request;
+}
+
+- (void)startLoading {
+    NSDictionary *response = nil;
+    NSTimeInterval responseDelay = 0.0;
+    NSString *key = [HPTestURLProtocol keyForURL:[[self request] URL]];
+    
+    @synchronized([HPTestURLProtocol class]) {
+        NSMutableArray *requests = [_recordedRequests objectForKey:key];
+        NSMutableArray *responses = [_stubbedResponses objectForKey:key];
+        
+        if (requests == nil) {
+            requests = [NSMutableArray array];
+            
+            [_recordedRequests setObject:requests forKey:key];
+        }
+        
+        [requests addObject:[self request]];
+        
+        response = [[[responses objectAtIndex:0] retain] autorelease];
+        
+        if ([responses count] > 1) {
+            [responses removeObjectAtIndex:0];
+        }
+        
+        responseDelay = _responseDelay;
+    }
+    
+    if (responseDelay > 0.0) {
+        [self performSelector:@selector(sendResponse:) withObject:response afterDelay:responseDelay];
+    } else {
+        [self sendResponse:response];
+    }
+}
+
+- (void)stopLoading {
+    [NSObject cancelPreviousPerformRequestsWithTarget:self];
+}
+
+- (void)sendResponse:(NSDictionary *)response {
+    NSData *body = [response objectForKey:kHPTestURLProtocolBodyKey];
+    NSHTTPURLResponse *URLResponse = [[NSHTTPURLResponse alloc] initWithURL:[[self request] URL] 
+                                                                 statusCode:[[response objectForKey:kHPTestURLProtocolStatusCodeKey] integerValue] 
+                                                                HTTPVersion:@"HTTP/1.1" 
+                                                               headerFields:[response objectForKey:kHPTestURLProtocolHeadersKey]];
+    NSUInteger chunkLength = 0;
+    
+    @synchronized([HPTestURLProtocol class]) {
+        chunkLength = _chunkLength;
+    }
+    
+    [[self client] URLProtocol:self didReceiveResponse:URLResponse cacheStoragePolicy:NSURLCacheStorageNotAllowed];
+    
+    NSUInteger offset = 0;
+    
+    while (offset < [body length]) {
+        NSUInteger length = [body length] - offset;
+        
+        if (chunkLength > 0) {
+            length = MIN(length, chunkLength);
+        }
+        
+        [[self client] URLProtocol:self didLoadData:[body subdataWithRange:NSMakeRange(offset, length)]];
+        
+        offset += length;
+    }
+    
+    [[self client] URLProtocolDidFinishLoading:self];
+    
+    [URLResponse release];
+}
+
+@end